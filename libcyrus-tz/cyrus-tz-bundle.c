@@ -0,0 +1,297 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The bundle files output by 'cyr_vzic --bundle', which hold the tables and
+ * the VTIMEZONEs of all the zones. The whole file is mapped, and the index
+ * and the names are checked when it is opened, so a lookup is just a binary
+ * search of the index and never reads past the end of the file. The tables
+ * are checked by cyrus_tz_open_memory() when they are used. The checksum
+ * means reading the whole file, so it is only checked on request, by
+ * cyrus_tz_bundle_verify().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cyrus-tz.h"
+#include "cyrus-tz-format.h"
+
+
+struct cyrus_tz_bundle
+{
+  const unsigned char *data;
+  size_t        length;
+
+  uint32_t      num_entries;
+  const unsigned char *entries;
+};
+
+
+static int      check_bundle                    (cyrus_tz_bundle *bundle);
+static const unsigned char *find_entry          (const cyrus_tz_bundle *bundle,
+                                                 const char     *name);
+
+
+static inline const unsigned char*
+entry_at                        (const cyrus_tz_bundle *bundle,
+                                 uint32_t        i)
+{
+  return bundle->entries + (size_t) i * CYRUS_TZ_BUNDLE_ENTRY_SIZE;
+}
+
+
+static inline const char*
+entry_name                      (const cyrus_tz_bundle *bundle,
+                                 uint32_t        i)
+{
+  return (const char*) bundle->data
+    + cyrus_tz_read_uint64 (entry_at (bundle, i) + CYRUS_TZ_BUNDLE_ENTRY_NAME);
+}
+
+
+cyrus_tz_bundle*
+cyrus_tz_bundle_open            (const char     *filename)
+{
+  cyrus_tz_bundle *bundle;
+  struct stat st;
+  void *data;
+  int fd, saved_errno;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) != 0) {
+    saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  if (st.st_size < CYRUS_TZ_BUNDLE_HEADER_SIZE) {
+    close (fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  saved_errno = errno;
+  close (fd);
+  if (data == MAP_FAILED) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  bundle = calloc (1, sizeof (cyrus_tz_bundle));
+  if (!bundle) {
+    munmap (data, st.st_size);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  bundle->data = data;
+  bundle->length = st.st_size;
+
+  if (!check_bundle (bundle)) {
+    cyrus_tz_bundle_close (bundle);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return bundle;
+}
+
+
+void
+cyrus_tz_bundle_close           (cyrus_tz_bundle *bundle)
+{
+  if (!bundle)
+    return;
+
+  munmap ((void*) bundle->data, bundle->length);
+  free (bundle);
+}
+
+
+int
+cyrus_tz_bundle_verify          (const cyrus_tz_bundle *bundle)
+{
+  uint64_t checksum = CYRUS_TZ_FNV_OFFSET_BASIS;
+  size_t i;
+
+  for (i = CYRUS_TZ_BUNDLE_HEADER_SIZE; i < bundle->length; i++) {
+    checksum ^= bundle->data[i];
+    checksum *= CYRUS_TZ_FNV_PRIME;
+  }
+
+  return checksum == cyrus_tz_read_uint64 (bundle->data
+                                           + CYRUS_TZ_BUNDLE_HEADER_CHECKSUM);
+}
+
+
+size_t
+cyrus_tz_bundle_count           (const cyrus_tz_bundle *bundle)
+{
+  return bundle->num_entries;
+}
+
+
+const char*
+cyrus_tz_bundle_name            (const cyrus_tz_bundle *bundle,
+                                 size_t          i)
+{
+  if (i >= bundle->num_entries)
+    return NULL;
+
+  return entry_name (bundle, i);
+}
+
+
+cyrus_tz*
+cyrus_tz_bundle_get             (const cyrus_tz_bundle *bundle,
+                                 const char     *name)
+{
+  const unsigned char *entry;
+
+  entry = find_entry (bundle, name);
+  if (!entry) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return cyrus_tz_open_memory (bundle->data
+                               + cyrus_tz_read_uint64 (entry
+                                 + CYRUS_TZ_BUNDLE_ENTRY_TABLE),
+                               cyrus_tz_read_uint32 (entry
+                                 + CYRUS_TZ_BUNDLE_ENTRY_TABLE_LENGTH));
+}
+
+
+const char*
+cyrus_tz_bundle_get_vtimezone   (const cyrus_tz_bundle *bundle,
+                                 const char     *name,
+                                 size_t         *length)
+{
+  const unsigned char *entry;
+
+  entry = find_entry (bundle, name);
+  if (!entry) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  if (length)
+    *length = cyrus_tz_read_uint32 (entry
+                                    + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE_LENGTH);
+
+  return (const char*) bundle->data
+    + cyrus_tz_read_uint64 (entry + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE);
+}
+
+
+/* This checks the header and every index entry, so the lookups never have
+   to. The names must end with a nul within the file and be in order, the
+   tables must be within the file and aligned, and the VTIMEZONEs must be
+   within the file and end with a nul. It returns 0 if the bundle is
+   invalid. */
+static int
+check_bundle                    (cyrus_tz_bundle *bundle)
+{
+  const unsigned char *entry;
+  const char *name, *prev_name = NULL;
+  uint64_t offset, length;
+  uint32_t i;
+
+  if (memcmp (bundle->data, CYRUS_TZ_BUNDLE_MAGIC, CYRUS_TZ_MAGIC_LENGTH)
+      || bundle->data[CYRUS_TZ_BUNDLE_HEADER_VERSION]
+         != CYRUS_TZ_BUNDLE_FORMAT_VERSION
+      || cyrus_tz_read_uint64 (bundle->data + CYRUS_TZ_BUNDLE_HEADER_LENGTH)
+         != bundle->length)
+    return 0;
+
+  bundle->num_entries
+    = cyrus_tz_read_uint32 (bundle->data
+                            + CYRUS_TZ_BUNDLE_HEADER_NUM_ENTRIES);
+  bundle->entries = bundle->data + CYRUS_TZ_BUNDLE_HEADER_SIZE;
+  if ((uint64_t) bundle->num_entries * CYRUS_TZ_BUNDLE_ENTRY_SIZE
+      > bundle->length - CYRUS_TZ_BUNDLE_HEADER_SIZE)
+    return 0;
+
+  for (i = 0; i < bundle->num_entries; i++) {
+    entry = entry_at (bundle, i);
+
+    offset = cyrus_tz_read_uint64 (entry + CYRUS_TZ_BUNDLE_ENTRY_NAME);
+    if (offset >= bundle->length
+        || !memchr (bundle->data + offset, '\0', bundle->length - offset))
+      return 0;
+    name = (const char*) bundle->data + offset;
+    if (prev_name && strcmp (prev_name, name) >= 0)
+      return 0;
+    prev_name = name;
+
+    offset = cyrus_tz_read_uint64 (entry + CYRUS_TZ_BUNDLE_ENTRY_TABLE);
+    length = cyrus_tz_read_uint32 (entry + CYRUS_TZ_BUNDLE_ENTRY_TABLE_LENGTH);
+    if (offset % 8 || offset > bundle->length
+        || length > bundle->length - offset)
+      return 0;
+
+    offset = cyrus_tz_read_uint64 (entry + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE);
+    length = cyrus_tz_read_uint32 (entry
+                                   + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE_LENGTH);
+    if (offset >= bundle->length || length >= bundle->length - offset
+        || bundle->data[offset + length] != '\0')
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/* This returns the index entry of the name, or NULL if it isn't found. */
+static const unsigned char*
+find_entry                      (const cyrus_tz_bundle *bundle,
+                                 const char     *name)
+{
+  uint32_t lo = 0, hi = bundle->num_entries, mid;
+  int cmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = strcmp (name, entry_name (bundle, mid));
+    if (cmp == 0)
+      return entry_at (bundle, mid);
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  return NULL;
+}
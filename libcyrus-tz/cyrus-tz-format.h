@@ -0,0 +1,232 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The format of the transition table files, which is shared by vzic and the
+ * library. All the integers are little-endian, and each section starts on an
+ * 8-byte boundary, so the file can be mapped and used in place.
+ *
+ *   Header                The magic string and the number of entries in each
+ *                         section.
+ *   Transitions           One CYRUS_TZ_TRANSITION_SIZE entry for each change
+ *                         in the UTC offset or abbreviation, in time order.
+ *                         The first one is at INT64_MIN, and gives the
+ *                         offset used before the first known change.
+ *   Local times           An int64 for each transition, which is the first
+ *                         local time affected by it, i.e. its UTC time plus
+ *                         the smaller of the offsets before and after it.
+ *                         The local times from there up to the UTC time plus
+ *                         the larger offset are in a gap or an overlap. The
+ *                         first one is INT64_MIN.
+ *   Recurrences           One CYRUS_TZ_RECURRENCE_SIZE entry for each change
+ *                         which recurs every year after the last transition,
+ *                         e.g. the start and end of daylight-saving time.
+ *                         If there are any, the last transition must be
+ *                         within 2^56 seconds of 1970.
+ *   Abbreviations         The abbreviations, each ending with a nul. The
+ *                         entries refer to them by their byte offset.
+ *
+ * If you change the format, bump CYRUS_TZ_FORMAT_VERSION.
+ *
+ * The bundle file output by 'cyr_vzic --bundle' holds the tables and the
+ * VTIMEZONEs of all the zones and aliases, so they can all be mapped from
+ * one file:
+ *
+ *   Header                The magic string, the number of index entries,
+ *                         the length of the file, and the 64-bit FNV-1a hash
+ *                         of everything after the header.
+ *   Index                 One CYRUS_TZ_BUNDLE_ENTRY_SIZE entry for each zone
+ *                         and alias, sorted by name, comparing the bytes.
+ *   Data                  The names, tables and VTIMEZONEs, which the index
+ *                         entries refer to by their offset from the start of
+ *                         the file. The names and VTIMEZONEs end with a nul,
+ *                         and the tables start on an 8-byte boundary. The
+ *                         aliases share the table of their zone.
+ *
+ * If you change the bundle format, bump CYRUS_TZ_BUNDLE_FORMAT_VERSION.
+ *
+ * The zone index file output by 'cyr_vzic --zone-index' maps the names of
+ * the zones and aliases to dense zone ids, 0 to the number of zones - 1,
+ * using a minimal perfect hash, so a name is found with two hashes and one
+ * string comparison:
+ *
+ *   Header                The magic string, and the number of names and of
+ *                         zones.
+ *   Displacements         An int32 for each name. A name is hashed with
+ *                         seed 0 to pick one of them, d. If d is negative
+ *                         the name's slot is -d - 1, otherwise it is the
+ *                         hash of the name with seed d, modulo the number
+ *                         of names.
+ *   Slots                 One CYRUS_TZ_INDEX_SLOT_SIZE entry for each name,
+ *                         giving the name, which must be compared, since
+ *                         other strings hash to a slot too, and its zone id.
+ *                         The aliases have the id of their zone.
+ *   Zones                 The offset of the name of each zone, by zone id.
+ *                         The ids are in the order of the zone names.
+ *   Names                 The names, each ending with a nul.
+ *
+ * The offsets are from the start of the file. If you change the format, bump
+ * CYRUS_TZ_INDEX_FORMAT_VERSION.
+ */
+
+#ifndef _CYRUS_TZ_FORMAT_H_
+#define _CYRUS_TZ_FORMAT_H_
+
+#include <stdint.h>
+
+#define CYRUS_TZ_MAGIC                  "CYRUSTZ"
+#define CYRUS_TZ_MAGIC_LENGTH           7
+#define CYRUS_TZ_FORMAT_VERSION         2
+
+/* The header. The byte after the magic string is the format version. */
+#define CYRUS_TZ_HEADER_SIZE            24
+#define CYRUS_TZ_HEADER_VERSION         7
+#define CYRUS_TZ_HEADER_NUM_TRANSITIONS 8       /* uint32 */
+#define CYRUS_TZ_HEADER_NUM_RECURRENCES 12      /* uint32 */
+#define CYRUS_TZ_HEADER_ABBREVS_LENGTH  16      /* uint32 */
+
+/* A transition. */
+#define CYRUS_TZ_TRANSITION_SIZE        16
+#define CYRUS_TZ_TRANSITION_UTC_TIME    0       /* int64, seconds since 1970 */
+#define CYRUS_TZ_TRANSITION_UTOFF       8       /* int32, seconds from UTC */
+#define CYRUS_TZ_TRANSITION_IS_DST      12      /* uint8 */
+#define CYRUS_TZ_TRANSITION_ABBREV      13      /* uint8 */
+
+/* A local time. */
+#define CYRUS_TZ_LOCAL_TIME_SIZE        8
+
+/* A recurrence. The day and time are as given in the Rule line of the Olson
+   files, i.e. a month, a day (e.g. the last Sunday), and a time of day which
+   is in local wall clock time, local standard time or UTC, using the offsets
+   in effect before the change. */
+#define CYRUS_TZ_RECURRENCE_SIZE        40
+#define CYRUS_TZ_RECURRENCE_MONTH       0       /* int32, 0 (Jan) to 11 */
+#define CYRUS_TZ_RECURRENCE_DAY_CODE    4       /* int32, CYRUS_TZ_DAY_* */
+#define CYRUS_TZ_RECURRENCE_DAY_NUMBER  8       /* int32, 1 to 31 */
+#define CYRUS_TZ_RECURRENCE_WEEKDAY     12      /* int32, 0 (Sun) to 6 */
+#define CYRUS_TZ_RECURRENCE_TIME        16      /* int32, seconds */
+#define CYRUS_TZ_RECURRENCE_TIME_CODE   20      /* int32, CYRUS_TZ_TIME_* */
+#define CYRUS_TZ_RECURRENCE_PREV_STDOFF 24      /* int32 */
+#define CYRUS_TZ_RECURRENCE_PREV_UTOFF  28      /* int32 */
+#define CYRUS_TZ_RECURRENCE_UTOFF       32      /* int32 */
+#define CYRUS_TZ_RECURRENCE_IS_DST      36      /* uint8 */
+#define CYRUS_TZ_RECURRENCE_ABBREV      37      /* uint8 */
+
+/* These match the DayCode and TimeCode enums in vzic.h. */
+#define CYRUS_TZ_DAY_SIMPLE             0
+#define CYRUS_TZ_DAY_WEEKDAY_ON_OR_AFTER 1
+#define CYRUS_TZ_DAY_WEEKDAY_ON_OR_BEFORE 2
+#define CYRUS_TZ_DAY_LAST_WEEKDAY       3
+
+#define CYRUS_TZ_TIME_WALL              0
+#define CYRUS_TZ_TIME_STANDARD          1
+#define CYRUS_TZ_TIME_UNIVERSAL         2
+
+/* The bundle header. The byte after the magic string is the version. */
+#define CYRUS_TZ_BUNDLE_MAGIC           "CYRTZBN"
+#define CYRUS_TZ_BUNDLE_FORMAT_VERSION  1
+
+#define CYRUS_TZ_BUNDLE_HEADER_SIZE     32
+#define CYRUS_TZ_BUNDLE_HEADER_VERSION  7
+#define CYRUS_TZ_BUNDLE_HEADER_NUM_ENTRIES 8    /* uint32 */
+#define CYRUS_TZ_BUNDLE_HEADER_LENGTH   16      /* uint64 */
+#define CYRUS_TZ_BUNDLE_HEADER_CHECKSUM 24      /* uint64 */
+
+/* A bundle index entry. The offsets are uint64 and the lengths uint32. The
+   length of the VTIMEZONE doesn't include the nul. */
+#define CYRUS_TZ_BUNDLE_ENTRY_SIZE      32
+#define CYRUS_TZ_BUNDLE_ENTRY_NAME      0
+#define CYRUS_TZ_BUNDLE_ENTRY_TABLE     8
+#define CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE 16
+#define CYRUS_TZ_BUNDLE_ENTRY_TABLE_LENGTH 24
+#define CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE_LENGTH 28
+
+#define CYRUS_TZ_FNV_OFFSET_BASIS       UINT64_C (0xcbf29ce484222325)
+#define CYRUS_TZ_FNV_PRIME              UINT64_C (0x100000001b3)
+
+/* The zone index header. The byte after the magic string is the version. */
+#define CYRUS_TZ_INDEX_MAGIC            "CYRTZIX"
+#define CYRUS_TZ_INDEX_FORMAT_VERSION   1
+
+#define CYRUS_TZ_INDEX_HEADER_SIZE      16
+#define CYRUS_TZ_INDEX_HEADER_VERSION   7
+#define CYRUS_TZ_INDEX_HEADER_NUM_NAMES 8       /* uint32 */
+#define CYRUS_TZ_INDEX_HEADER_NUM_ZONES 12      /* uint32 */
+
+/* A zone index slot. */
+#define CYRUS_TZ_INDEX_SLOT_SIZE        8
+#define CYRUS_TZ_INDEX_SLOT_NAME        0       /* uint32, offset */
+#define CYRUS_TZ_INDEX_SLOT_ZONE_ID     4       /* uint32 */
+
+
+/* These read the little-endian integers. They are read a byte at a time, so
+   the data doesn't need to be aligned and works on any host. Compilers turn
+   them into single loads on little-endian hosts. */
+static inline uint32_t
+cyrus_tz_read_uint32            (const unsigned char *p)
+{
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+    | (uint32_t) p[3] << 24;
+}
+
+
+static inline int32_t
+cyrus_tz_read_int32             (const unsigned char *p)
+{
+  return (int32_t) cyrus_tz_read_uint32 (p);
+}
+
+
+static inline uint64_t
+cyrus_tz_read_uint64            (const unsigned char *p)
+{
+  return (uint64_t) cyrus_tz_read_uint32 (p)
+    | (uint64_t) cyrus_tz_read_uint32 (p + 4) << 32;
+}
+
+
+static inline int64_t
+cyrus_tz_read_int64             (const unsigned char *p)
+{
+  return (int64_t) cyrus_tz_read_uint64 (p);
+}
+
+
+/* The hash of the zone index, which is the 64-bit FNV-1a hash of the name
+   starting from the offset basis xor the seed, folded to 32 bits. */
+static inline uint32_t
+cyrus_tz_index_hash             (uint32_t        seed,
+                                 const char     *name)
+{
+  uint64_t hash = CYRUS_TZ_FNV_OFFSET_BASIS ^ seed;
+
+  for (; *name; name++) {
+    hash ^= (unsigned char) *name;
+    hash *= CYRUS_TZ_FNV_PRIME;
+  }
+
+  return (uint32_t) (hash ^ (hash >> 32));
+}
+
+#endif /* _CYRUS_TZ_FORMAT_H_ */
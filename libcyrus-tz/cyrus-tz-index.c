@@ -0,0 +1,263 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The zone index files output by 'cyr_vzic --zone-index', which map the
+ * names of the zones and aliases to zone ids with a minimal perfect hash.
+ * Everything in the file is checked when it is opened, so a lookup is just
+ * two hashes and one string comparison, and never reads past the end of the
+ * file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cyrus-tz.h"
+#include "cyrus-tz-format.h"
+
+
+struct cyrus_tz_index
+{
+  const unsigned char *data;
+  size_t        length;
+
+  uint32_t      num_names;
+  uint32_t      num_zones;
+  const unsigned char *displacements;
+  const unsigned char *slots;
+  const unsigned char *zones;
+};
+
+
+static int      check_index                     (cyrus_tz_index *index);
+static int      check_name                      (const cyrus_tz_index *index,
+                                                 uint32_t        offset);
+
+
+static inline const unsigned char*
+slot_at                         (const cyrus_tz_index *index,
+                                 uint32_t        i)
+{
+  return index->slots + (size_t) i * CYRUS_TZ_INDEX_SLOT_SIZE;
+}
+
+
+/* This returns the slot the name would be in, if it is in the index. */
+static inline uint32_t
+find_slot                       (const cyrus_tz_index *index,
+                                 const char     *name)
+{
+  int32_t d;
+
+  d = cyrus_tz_read_int32 (index->displacements
+                           + (size_t) (cyrus_tz_index_hash (0, name)
+                                       % index->num_names) * 4);
+  if (d < 0)
+    return -(d + 1);
+
+  return cyrus_tz_index_hash (d, name) % index->num_names;
+}
+
+
+cyrus_tz_index*
+cyrus_tz_index_open             (const char     *filename)
+{
+  cyrus_tz_index *index;
+  struct stat st;
+  void *data;
+  int fd, saved_errno;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) != 0) {
+    saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  if (st.st_size < CYRUS_TZ_INDEX_HEADER_SIZE) {
+    close (fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  saved_errno = errno;
+  close (fd);
+  if (data == MAP_FAILED) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  index = calloc (1, sizeof (cyrus_tz_index));
+  if (!index) {
+    munmap (data, st.st_size);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  index->data = data;
+  index->length = st.st_size;
+
+  if (!check_index (index)) {
+    cyrus_tz_index_close (index);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return index;
+}
+
+
+void
+cyrus_tz_index_close            (cyrus_tz_index *index)
+{
+  if (!index)
+    return;
+
+  munmap ((void*) index->data, index->length);
+  free (index);
+}
+
+
+int
+cyrus_tz_index_lookup           (const cyrus_tz_index *index,
+                                 const char     *name)
+{
+  const unsigned char *slot;
+
+  if (index->num_names == 0)
+    return -1;
+
+  slot = slot_at (index, find_slot (index, name));
+  if (strcmp (name, (const char*) index->data
+              + cyrus_tz_read_uint32 (slot + CYRUS_TZ_INDEX_SLOT_NAME)))
+    return -1;
+
+  return cyrus_tz_read_uint32 (slot + CYRUS_TZ_INDEX_SLOT_ZONE_ID);
+}
+
+
+size_t
+cyrus_tz_index_num_zones        (const cyrus_tz_index *index)
+{
+  return index->num_zones;
+}
+
+
+const char*
+cyrus_tz_index_zone_name        (const cyrus_tz_index *index,
+                                 int             zone_id)
+{
+  if (zone_id < 0 || (uint32_t) zone_id >= index->num_zones)
+    return NULL;
+
+  return (const char*) index->data
+    + cyrus_tz_read_uint32 (index->zones + (size_t) zone_id * 4);
+}
+
+
+/* This checks the header and every displacement, slot and zone, so the
+   lookups never have to. The slots and the displacements must be in range,
+   the names must end with a nul within the file, and each name must be in
+   the slot it hashes to, so no other string can be found in a wrong slot.
+   It returns 0 if the index is invalid. */
+static int
+check_index                     (cyrus_tz_index *index)
+{
+  const unsigned char *slot;
+  const char *name;
+  uint64_t size;
+  uint32_t i, offset;
+  int32_t d;
+
+  if (memcmp (index->data, CYRUS_TZ_INDEX_MAGIC, CYRUS_TZ_MAGIC_LENGTH)
+      || index->data[CYRUS_TZ_INDEX_HEADER_VERSION]
+         != CYRUS_TZ_INDEX_FORMAT_VERSION)
+    return 0;
+
+  index->num_names
+    = cyrus_tz_read_uint32 (index->data + CYRUS_TZ_INDEX_HEADER_NUM_NAMES);
+  index->num_zones
+    = cyrus_tz_read_uint32 (index->data + CYRUS_TZ_INDEX_HEADER_NUM_ZONES);
+  if (index->num_zones > index->num_names || index->num_zones > INT32_MAX)
+    return 0;
+
+  size = CYRUS_TZ_INDEX_HEADER_SIZE
+    + (uint64_t) index->num_names * (4 + CYRUS_TZ_INDEX_SLOT_SIZE)
+    + (uint64_t) index->num_zones * 4;
+  if (size > index->length)
+    return 0;
+
+  index->displacements = index->data + CYRUS_TZ_INDEX_HEADER_SIZE;
+  index->slots = index->displacements + (size_t) index->num_names * 4;
+  index->zones = index->slots
+    + (size_t) index->num_names * CYRUS_TZ_INDEX_SLOT_SIZE;
+
+  for (i = 0; i < index->num_names; i++) {
+    d = cyrus_tz_read_int32 (index->displacements + (size_t) i * 4);
+    if (d < 0 && (uint32_t) -(d + 1) >= index->num_names)
+      return 0;
+  }
+
+  for (i = 0; i < index->num_names; i++) {
+    slot = slot_at (index, i);
+    offset = cyrus_tz_read_uint32 (slot + CYRUS_TZ_INDEX_SLOT_NAME);
+    if (!check_name (index, offset)
+        || cyrus_tz_read_uint32 (slot + CYRUS_TZ_INDEX_SLOT_ZONE_ID)
+           >= index->num_zones)
+      return 0;
+
+    name = (const char*) index->data + offset;
+    if (find_slot (index, name) != i)
+      return 0;
+  }
+
+  for (i = 0; i < index->num_zones; i++) {
+    if (!check_name (index, cyrus_tz_read_uint32 (index->zones
+                                                  + (size_t) i * 4)))
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/* This returns 1 if the name at the offset ends with a nul within the
+   file. */
+static int
+check_name                      (const cyrus_tz_index *index,
+                                 uint32_t        offset)
+{
+  return offset < index->length
+    && memchr (index->data + offset, '\0', index->length - offset);
+}
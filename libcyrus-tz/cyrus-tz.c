@@ -0,0 +1,752 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * A lookup finds the last transition at or before the time with a binary
+ * search. If the time is after the last transition and the zone has
+ * recurring changes, we calculate the recurring changes around the time,
+ * using the same calendar calculations as vzic-time.c, and use the last one
+ * before it. The calendar repeats every 400 years, so times far in the
+ * future are first moved back by a whole number of 400-year eras.
+ *
+ * Local times are resolved in the same way, using the local time of each
+ * transition stored in the table, which is where the gap or overlap around
+ * it starts. The last transition whose local time is at or before the time
+ * gives the offsets before and after it, and the time is either in its gap
+ * or overlap, or after it, in which case it is unique.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cyrus-tz.h"
+#include "cyrus-tz-format.h"
+
+
+#define SECONDS_PER_DAY         (24 * 60 * 60)
+
+/* The number of days in each 400-year era. */
+#define DAYS_PER_ERA            146097
+#define SECONDS_PER_ERA         ((int64_t) DAYS_PER_ERA * SECONDS_PER_DAY)
+
+/* The number of days from 1st March 0000 to 1st Jan 1970. */
+#define DAYS_TO_EPOCH           719468
+
+/* 1st Jan 1970 was a Thursday. */
+#define EPOCH_WEEKDAY           4
+
+/* The recurrences are only used if the last transition is within this many
+   seconds of 1970, so the calendar calculations around it can't overflow.
+   vzic's tables always end within a few centuries of 1970. */
+#define MAX_LAST_TIME           (INT64_C (1) << 56)
+
+
+struct cyrus_tz
+{
+  const unsigned char *data;
+  size_t        length;
+
+  /* Non-zero if we mapped the data, so we have to unmap it. */
+  int           is_mapped;
+
+  uint32_t      num_transitions;
+  const unsigned char *transitions;
+  const unsigned char *local_times;
+
+  uint32_t      num_recurrences;
+  const unsigned char *recurrences;
+
+  const char   *abbrevs;
+  uint32_t      abbrevs_length;
+
+  /* The time of the last transition, after which the recurrences are
+     used. */
+  int64_t       last_time;
+  int64_t       last_local_time;
+};
+
+
+static int      check_table                     (cyrus_tz       *tz);
+static void     lookup_recurrence               (const cyrus_tz *tz,
+                                                 int64_t         utc_time,
+                                                 cyrus_tz_info  *info);
+static cyrus_tz_local_kind resolve_local_time   (const cyrus_tz *tz,
+                                                 int64_t         local_time,
+                                                 cyrus_tz_policy policy,
+                                                 int64_t        *utc_time,
+                                                 uint32_t       *hint);
+static cyrus_tz_local_kind resolve_recurrence   (const cyrus_tz *tz,
+                                                 int64_t         local_time,
+                                                 cyrus_tz_policy policy,
+                                                 int64_t        *utc_time);
+static cyrus_tz_local_kind resolve_change       (int64_t         local_time,
+                                                 int64_t         change_time,
+                                                 int32_t         prev_utoff,
+                                                 int32_t         utoff,
+                                                 cyrus_tz_policy policy,
+                                                 int64_t        *utc_time);
+static int64_t  subtract_utoff                  (int64_t         local_time,
+                                                 int32_t         utoff);
+static int64_t  recurrence_time                 (const unsigned char *rec,
+                                                 int64_t         year);
+static int64_t  days_from_civil                 (int64_t         year,
+                                                 int             month,
+                                                 int             day);
+static int64_t  year_from_days                  (int64_t         days);
+static int      days_in_month                   (int64_t         year,
+                                                 int             month);
+static int      weekday                         (int64_t         days);
+
+
+/* These return the entries of a table. */
+static inline const unsigned char*
+transition_at                   (const cyrus_tz *tz,
+                                 uint32_t        i)
+{
+  return tz->transitions + (size_t) i * CYRUS_TZ_TRANSITION_SIZE;
+}
+
+
+static inline int64_t
+transition_time                 (const cyrus_tz *tz,
+                                 uint32_t        i)
+{
+  return cyrus_tz_read_int64 (transition_at (tz, i)
+                              + CYRUS_TZ_TRANSITION_UTC_TIME);
+}
+
+
+static inline int32_t
+transition_utoff                (const cyrus_tz *tz,
+                                 uint32_t        i)
+{
+  return cyrus_tz_read_int32 (transition_at (tz, i)
+                              + CYRUS_TZ_TRANSITION_UTOFF);
+}
+
+
+static inline int64_t
+local_time_at                   (const cyrus_tz *tz,
+                                 uint32_t        i)
+{
+  return cyrus_tz_read_int64 (tz->local_times
+                              + (size_t) i * CYRUS_TZ_LOCAL_TIME_SIZE);
+}
+
+
+static inline const unsigned char*
+recurrence_at                   (const cyrus_tz *tz,
+                                 uint32_t        i)
+{
+  return tz->recurrences + (size_t) i * CYRUS_TZ_RECURRENCE_SIZE;
+}
+
+
+cyrus_tz*
+cyrus_tz_open                   (const char     *filename)
+{
+  cyrus_tz *tz;
+  struct stat st;
+  void *data;
+  int fd, saved_errno;
+
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat (fd, &st) != 0) {
+    saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  if (st.st_size < CYRUS_TZ_HEADER_SIZE) {
+    close (fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  saved_errno = errno;
+  close (fd);
+  if (data == MAP_FAILED) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  tz = cyrus_tz_open_memory (data, st.st_size);
+  if (!tz) {
+    saved_errno = errno;
+    munmap (data, st.st_size);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  tz->is_mapped = 1;
+
+  return tz;
+}
+
+
+cyrus_tz*
+cyrus_tz_open_memory            (const void     *data,
+                                 size_t          length)
+{
+  cyrus_tz *tz;
+
+  tz = calloc (1, sizeof (cyrus_tz));
+  if (!tz)
+    return NULL;
+
+  tz->data = data;
+  tz->length = length;
+
+  if (!check_table (tz)) {
+    free (tz);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return tz;
+}
+
+
+void
+cyrus_tz_close                  (cyrus_tz       *tz)
+{
+  if (!tz)
+    return;
+
+  if (tz->is_mapped)
+    munmap ((void*) tz->data, tz->length);
+  free (tz);
+}
+
+
+/* This checks the header and sets up the pointers to the sections. It also
+   checks every entry, so the lookups never have to. It returns 0 if the
+   table is invalid. */
+static int
+check_table                     (cyrus_tz       *tz)
+{
+  const unsigned char *p;
+  uint64_t expected_length;
+  int64_t prev_time, time;
+  uint32_t i;
+
+  if (tz->length < CYRUS_TZ_HEADER_SIZE
+      || memcmp (tz->data, CYRUS_TZ_MAGIC, CYRUS_TZ_MAGIC_LENGTH)
+      || tz->data[CYRUS_TZ_HEADER_VERSION] != CYRUS_TZ_FORMAT_VERSION)
+    return 0;
+
+  tz->num_transitions
+    = cyrus_tz_read_uint32 (tz->data + CYRUS_TZ_HEADER_NUM_TRANSITIONS);
+  tz->num_recurrences
+    = cyrus_tz_read_uint32 (tz->data + CYRUS_TZ_HEADER_NUM_RECURRENCES);
+  tz->abbrevs_length
+    = cyrus_tz_read_uint32 (tz->data + CYRUS_TZ_HEADER_ABBREVS_LENGTH);
+
+  expected_length = CYRUS_TZ_HEADER_SIZE
+    + (uint64_t) tz->num_transitions * CYRUS_TZ_TRANSITION_SIZE
+    + (uint64_t) tz->num_transitions * CYRUS_TZ_LOCAL_TIME_SIZE
+    + (uint64_t) tz->num_recurrences * CYRUS_TZ_RECURRENCE_SIZE
+    + tz->abbrevs_length;
+  if (tz->num_transitions == 0 || tz->abbrevs_length == 0
+      || expected_length != tz->length)
+    return 0;
+
+  tz->transitions = tz->data + CYRUS_TZ_HEADER_SIZE;
+  tz->local_times = tz->transitions
+    + (size_t) tz->num_transitions * CYRUS_TZ_TRANSITION_SIZE;
+  tz->recurrences = tz->local_times
+    + (size_t) tz->num_transitions * CYRUS_TZ_LOCAL_TIME_SIZE;
+  tz->abbrevs = (const char*) tz->recurrences
+    + (size_t) tz->num_recurrences * CYRUS_TZ_RECURRENCE_SIZE;
+
+  if (tz->abbrevs[tz->abbrevs_length - 1] != '\0')
+    return 0;
+
+  prev_time = INT64_MIN;
+  for (i = 0; i < tz->num_transitions; i++) {
+    time = transition_time (tz, i);
+    if (time < prev_time
+        || transition_at (tz, i)[CYRUS_TZ_TRANSITION_ABBREV]
+           >= tz->abbrevs_length)
+      return 0;
+    prev_time = time;
+  }
+  tz->last_time = prev_time;
+
+  prev_time = INT64_MIN;
+  for (i = 0; i < tz->num_transitions; i++) {
+    time = local_time_at (tz, i);
+    if (time < prev_time)
+      return 0;
+    prev_time = time;
+  }
+  tz->last_local_time = prev_time;
+
+  if (tz->num_recurrences
+      && (tz->last_time < -MAX_LAST_TIME || tz->last_time > MAX_LAST_TIME
+          || tz->last_local_time < -MAX_LAST_TIME
+          || tz->last_local_time > MAX_LAST_TIME))
+    return 0;
+
+  for (i = 0; i < tz->num_recurrences; i++) {
+    p = recurrence_at (tz, i);
+    if ((uint32_t) cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_MONTH) > 11
+        || (uint32_t) cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_DAY_CODE)
+           > CYRUS_TZ_DAY_LAST_WEEKDAY
+        || cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_DAY_NUMBER) < 1
+        || cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_DAY_NUMBER) > 31
+        || (uint32_t) cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_WEEKDAY)
+           > 6
+        || (uint32_t) cyrus_tz_read_int32 (p + CYRUS_TZ_RECURRENCE_TIME_CODE)
+           > CYRUS_TZ_TIME_UNIVERSAL
+        || p[CYRUS_TZ_RECURRENCE_ABBREV] >= tz->abbrevs_length)
+      return 0;
+  }
+
+  return 1;
+}
+
+
+void
+cyrus_tz_lookup                 (const cyrus_tz *tz,
+                                 int64_t         utc_time,
+                                 cyrus_tz_info  *info)
+{
+  const unsigned char *transition;
+  uint32_t lo, hi, mid;
+
+  if (utc_time > tz->last_time && tz->num_recurrences) {
+    lookup_recurrence (tz, utc_time, info);
+    return;
+  }
+
+  /* Find the last transition at or before the time. The first transition is
+     used for times before it. */
+  lo = 0;
+  hi = tz->num_transitions;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (transition_time (tz, mid) <= utc_time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  transition = transition_at (tz, lo);
+  info->utoff = cyrus_tz_read_int32 (transition + CYRUS_TZ_TRANSITION_UTOFF);
+  info->is_dst = transition[CYRUS_TZ_TRANSITION_IS_DST];
+  info->abbrev = tz->abbrevs + transition[CYRUS_TZ_TRANSITION_ABBREV];
+}
+
+
+/* This finds the last recurring change before the time. We try the years
+   either side of the year of the time in UTC, since the local time of a
+   change may be in a different year. If none of them are after the last
+   transition, the last transition is still in effect. The time is after the
+   last transition, so the difference fits in a uint64_t, even if it doesn't
+   fit in an int64_t. */
+static void
+lookup_recurrence               (const cyrus_tz *tz,
+                                 int64_t         utc_time,
+                                 cyrus_tz_info  *info)
+{
+  const unsigned char *recurrence, *best = NULL, *transition;
+  int64_t days, year, y, time, best_time;
+  uint64_t diff;
+  uint32_t i;
+
+  diff = (uint64_t) utc_time - (uint64_t) tz->last_time;
+  if (diff > 2 * SECONDS_PER_ERA)
+    utc_time = tz->last_time
+      + (int64_t) (diff % SECONDS_PER_ERA + SECONDS_PER_ERA);
+
+  days = utc_time / SECONDS_PER_DAY;
+  if (utc_time % SECONDS_PER_DAY < 0)
+    days--;
+  year = year_from_days (days);
+
+  best_time = tz->last_time;
+  for (y = year - 1; y <= year + 1; y++) {
+    for (i = 0; i < tz->num_recurrences; i++) {
+      recurrence = recurrence_at (tz, i);
+      time = recurrence_time (recurrence, y);
+      if (time <= utc_time && time > best_time) {
+        best = recurrence;
+        best_time = time;
+      }
+    }
+  }
+
+  if (best) {
+    info->utoff = cyrus_tz_read_int32 (best + CYRUS_TZ_RECURRENCE_UTOFF);
+    info->is_dst = best[CYRUS_TZ_RECURRENCE_IS_DST];
+    info->abbrev = tz->abbrevs + best[CYRUS_TZ_RECURRENCE_ABBREV];
+  } else {
+    transition = transition_at (tz, tz->num_transitions - 1);
+    info->utoff = cyrus_tz_read_int32 (transition + CYRUS_TZ_TRANSITION_UTOFF);
+    info->is_dst = transition[CYRUS_TZ_TRANSITION_IS_DST];
+    info->abbrev = tz->abbrevs + transition[CYRUS_TZ_TRANSITION_ABBREV];
+  }
+}
+
+
+cyrus_tz_local_kind
+cyrus_tz_resolve                (const cyrus_tz *tz,
+                                 int64_t         local_time,
+                                 cyrus_tz_policy policy,
+                                 int64_t        *utc_time)
+{
+  uint32_t hint = 0;
+
+  return resolve_local_time (tz, local_time, policy, utc_time, &hint);
+}
+
+
+/* Sorted local times are usually in the same interval as the previous one,
+   so we check that first. */
+size_t
+cyrus_tz_resolve_batch          (const cyrus_tz *tz,
+                                 const int64_t  *local_times,
+                                 size_t          count,
+                                 cyrus_tz_policy policy,
+                                 int64_t        *utc_times,
+                                 cyrus_tz_local_kind *kinds)
+{
+  cyrus_tz_local_kind kind;
+  uint32_t hint = 0;
+  size_t i, num_resolved = 0;
+
+  for (i = 0; i < count; i++) {
+    kind = resolve_local_time (tz, local_times[i], policy, &utc_times[i],
+                               &hint);
+    if (kinds)
+      kinds[i] = kind;
+    if (kind == CYRUS_TZ_UNIQUE || policy != CYRUS_TZ_REJECT)
+      num_resolved++;
+  }
+
+  return num_resolved;
+}
+
+
+/* This finds the last transition whose local time is at or before the time,
+   trying the one in hint first and setting hint to the one found. */
+static cyrus_tz_local_kind
+resolve_local_time              (const cyrus_tz *tz,
+                                 int64_t         local_time,
+                                 cyrus_tz_policy policy,
+                                 int64_t        *utc_time,
+                                 uint32_t       *hint)
+{
+  uint32_t lo, hi, mid;
+
+  if (local_time > tz->last_local_time && tz->num_recurrences)
+    return resolve_recurrence (tz, local_time, policy, utc_time);
+
+  lo = *hint;
+  if (lo < tz->num_transitions && local_time_at (tz, lo) <= local_time
+      && (lo + 1 == tz->num_transitions
+          || local_time_at (tz, lo + 1) > local_time)) {
+    hi = lo + 1;
+  } else {
+    lo = 0;
+    hi = tz->num_transitions;
+  }
+
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (local_time_at (tz, mid) <= local_time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  *hint = lo;
+
+  if (lo == 0) {
+    *utc_time = subtract_utoff (local_time, transition_utoff (tz, 0));
+    return CYRUS_TZ_UNIQUE;
+  }
+
+  return resolve_change (local_time, transition_time (tz, lo),
+                         transition_utoff (tz, lo - 1),
+                         transition_utoff (tz, lo), policy, utc_time);
+}
+
+
+/* This finds the last recurring change whose gap or overlap starts at or
+   before the local time, like lookup_recurrence(). If there isn't one after
+   the last transition, the last transition is used. A time far in the
+   future is resolved in an earlier era, and the offset found is then
+   subtracted from the original time. */
+static cyrus_tz_local_kind
+resolve_recurrence              (const cyrus_tz *tz,
+                                 int64_t         local_time,
+                                 cyrus_tz_policy policy,
+                                 int64_t        *utc_time)
+{
+  const unsigned char *recurrence, *best = NULL;
+  cyrus_tz_local_kind kind;
+  uint32_t last = tz->num_transitions - 1;
+  int64_t era_local_time, days, year, y, time, start, best_time = 0;
+  int64_t best_start;
+  int32_t prev_utoff, utoff;
+  uint64_t diff;
+  uint32_t i;
+
+  era_local_time = local_time;
+  diff = (uint64_t) local_time - (uint64_t) tz->last_local_time;
+  if (diff > 2 * SECONDS_PER_ERA)
+    era_local_time = tz->last_local_time
+      + (int64_t) (diff % SECONDS_PER_ERA + SECONDS_PER_ERA);
+
+  days = era_local_time / SECONDS_PER_DAY;
+  if (era_local_time % SECONDS_PER_DAY < 0)
+    days--;
+  year = year_from_days (days);
+
+  best_start = tz->last_local_time;
+  for (y = year - 1; y <= year + 1; y++) {
+    for (i = 0; i < tz->num_recurrences; i++) {
+      recurrence = recurrence_at (tz, i);
+      time = recurrence_time (recurrence, y);
+      prev_utoff = cyrus_tz_read_int32 (recurrence
+                                        + CYRUS_TZ_RECURRENCE_PREV_UTOFF);
+      utoff = cyrus_tz_read_int32 (recurrence + CYRUS_TZ_RECURRENCE_UTOFF);
+      start = time + (prev_utoff < utoff ? prev_utoff : utoff);
+      if (time > tz->last_time && start <= era_local_time
+          && start > best_start) {
+        best = recurrence;
+        best_time = time;
+        best_start = start;
+      }
+    }
+  }
+
+  if (best) {
+    prev_utoff = cyrus_tz_read_int32 (best + CYRUS_TZ_RECURRENCE_PREV_UTOFF);
+    utoff = cyrus_tz_read_int32 (best + CYRUS_TZ_RECURRENCE_UTOFF);
+    kind = resolve_change (era_local_time, best_time, prev_utoff, utoff,
+                           policy, utc_time);
+  } else {
+    prev_utoff = transition_utoff (tz, last > 0 ? last - 1 : 0);
+    kind = resolve_change (era_local_time, transition_time (tz, last),
+                           prev_utoff, transition_utoff (tz, last), policy,
+                           utc_time);
+  }
+
+  /* The offset is between the smaller and the larger offset of the change,
+     so it fits in an int32_t. */
+  if (era_local_time != local_time
+      && (kind == CYRUS_TZ_UNIQUE || policy != CYRUS_TZ_REJECT))
+    *utc_time = subtract_utoff (local_time,
+                                (int32_t) (era_local_time - *utc_time));
+
+  return kind;
+}
+
+
+/* This converts a local time at or after the start of the gap or overlap
+   around a change, i.e. the change time plus the smaller offset. If it is
+   before the change time plus the larger offset it is in the gap or
+   overlap. The times in a table may be anywhere in the range of times, so
+   the offsets are subtracted with subtract_utoff(). */
+static cyrus_tz_local_kind
+resolve_change                  (int64_t         local_time,
+                                 int64_t         change_time,
+                                 int32_t         prev_utoff,
+                                 int32_t         utoff,
+                                 cyrus_tz_policy policy,
+                                 int64_t        *utc_time)
+{
+  cyrus_tz_local_kind kind;
+
+  if (subtract_utoff (local_time, prev_utoff > utoff ? prev_utoff : utoff)
+      >= change_time) {
+    *utc_time = subtract_utoff (local_time, utoff);
+    return CYRUS_TZ_UNIQUE;
+  }
+
+  kind = utoff > prev_utoff ? CYRUS_TZ_GAP : CYRUS_TZ_OVERLAP;
+
+  switch (policy) {
+  case CYRUS_TZ_EARLIER:
+    *utc_time = subtract_utoff (local_time,
+                                utoff > prev_utoff ? utoff : prev_utoff);
+    break;
+  case CYRUS_TZ_LATER:
+    *utc_time = subtract_utoff (local_time,
+                                utoff > prev_utoff ? prev_utoff : utoff);
+    break;
+  case CYRUS_TZ_SHIFT_FORWARD:
+    if (kind == CYRUS_TZ_GAP)
+      *utc_time = change_time;
+    else
+      *utc_time = subtract_utoff (local_time, prev_utoff);
+    break;
+  default:
+    break;
+  }
+
+  return kind;
+}
+
+
+/* This subtracts an offset from a local time, which may be at the very ends
+   of the range of times. */
+static int64_t
+subtract_utoff                  (int64_t         local_time,
+                                 int32_t         utoff)
+{
+  if (utoff > 0 && local_time < INT64_MIN + utoff)
+    return INT64_MIN;
+  if (utoff < 0 && local_time > INT64_MAX + utoff)
+    return INT64_MAX;
+
+  return local_time - utoff;
+}
+
+
+/* This returns the UTC time of a recurring change in the given year, like
+   output_recurrence_time() in vzic-output.c. */
+static int64_t
+recurrence_time                 (const unsigned char *rec,
+                                 int64_t         year)
+{
+  int month, day_code, day, day_weekday, offset, wday, last_day;
+
+  month = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_MONTH);
+  day_code = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_DAY_CODE);
+  day = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_DAY_NUMBER);
+  day_weekday = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_WEEKDAY);
+
+  switch (day_code) {
+  case CYRUS_TZ_DAY_LAST_WEEKDAY:
+    last_day = days_in_month (year, month);
+    wday = weekday (days_from_civil (year, month, last_day));
+    day = last_day - (wday - day_weekday + 7) % 7;
+    break;
+  case CYRUS_TZ_DAY_WEEKDAY_ON_OR_AFTER:
+    wday = weekday (days_from_civil (year, month, day));
+    day += (day_weekday - wday + 7) % 7;
+    break;
+  case CYRUS_TZ_DAY_WEEKDAY_ON_OR_BEFORE:
+    wday = weekday (days_from_civil (year, month, day));
+    day -= (wday - day_weekday + 7) % 7;
+    break;
+  default:
+    break;
+  }
+
+  switch (cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_TIME_CODE)) {
+  case CYRUS_TZ_TIME_WALL:
+    offset = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_PREV_UTOFF);
+    break;
+  case CYRUS_TZ_TIME_STANDARD:
+    offset = cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_PREV_STDOFF);
+    break;
+  default:
+    offset = 0;
+    break;
+  }
+
+  return days_from_civil (year, month, day) * SECONDS_PER_DAY
+    + cyrus_tz_read_int32 (rec + CYRUS_TZ_RECURRENCE_TIME) - offset;
+}
+
+
+/* Returns the number of days from 1st Jan 1970 to the given date, which may
+   be outside the month. See vzic-time.c. */
+static int64_t
+days_from_civil                 (int64_t         year,
+                                 int             month,
+                                 int             day)
+{
+  int64_t y, era;
+  int year_of_era, day_of_year, day_of_era;
+
+  y = year;
+  if (month < 2)
+    y--;
+
+  era = (y >= 0 ? y : y - 399) / 400;
+  year_of_era = y - era * 400;
+  day_of_year = (153 * ((month + 10) % 12) + 2) / 5 + day - 1;
+  day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100
+    + day_of_year;
+
+  return era * DAYS_PER_ERA + day_of_era - DAYS_TO_EPOCH;
+}
+
+
+/* Returns the year of the given number of days since 1st Jan 1970. */
+static int64_t
+year_from_days                  (int64_t         days)
+{
+  int64_t era;
+  int day_of_era, year_of_era, day_of_year, mp;
+
+  days += DAYS_TO_EPOCH;
+  era = (days >= 0 ? days : days - DAYS_PER_ERA + 1) / DAYS_PER_ERA;
+  day_of_era = days - era * DAYS_PER_ERA;
+  year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524
+                 - day_of_era / (DAYS_PER_ERA - 1)) / 365;
+  day_of_year = day_of_era - (year_of_era * 365 + year_of_era / 4
+                              - year_of_era / 100);
+  mp = (5 * day_of_year + 2) / 153;
+
+  return era * 400 + year_of_era + (mp >= 10 ? 1 : 0);
+}
+
+
+static int
+days_in_month                   (int64_t         year,
+                                 int             month)
+{
+  static const int days[12] = { 31, 28, 31, 30, 31, 30,
+                                31, 31, 30, 31, 30, 31 };
+
+  if (month == 1 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))
+    return 29;
+
+  return days[month];
+}
+
+
+/* Returns the weekday, 0 (Sun) to 6 (Sat), of the given number of days since
+   1st Jan 1970. */
+static int
+weekday                         (int64_t         days)
+{
+  return (days % 7 + 7 + EPOCH_WEEKDAY) % 7;
+}
@@ -0,0 +1,202 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * libcyrus-tz converts UTC times to local time, and local times to UTC, using
+ * the transition tables output by 'cyr_vzic --tables', without parsing the
+ * VTIMEZONE files. Each table is mapped into memory, and a lookup is a
+ * binary search over the transitions, so it takes a few nanoseconds. Times
+ * after the last transition in the table use the zone's recurring changes, so
+ * they are correct forever. It only uses the C library, and the lookups don't
+ * allocate any memory, so a table can be used by several threads at once.
+ * The tables and VTIMEZONEs of all the zones can also be mapped from one
+ * bundle file output by 'cyr_vzic --bundle', and the names of the zones
+ * and aliases can be mapped to zone ids with the index file output by
+ * 'cyr_vzic --zone-index'.
+ */
+
+#ifndef _CYRUS_TZ_H_
+#define _CYRUS_TZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cyrus_tz cyrus_tz;
+
+/* The local time in effect at a given UTC time. */
+typedef struct cyrus_tz_info cyrus_tz_info;
+struct cyrus_tz_info
+{
+  /* The offset from UTC in seconds, i.e. local time = UTC + utoff. */
+  int32_t       utoff;
+
+  /* 1 if it is daylight-saving time. */
+  int           is_dst;
+
+  /* The abbreviation, e.g. "CEST", or "" if the zone doesn't have one. It
+     belongs to the table. */
+  const char   *abbrev;
+};
+
+/* What to do with local times that don't exist, because they are in a gap
+   where the clocks go forward, or that are ambiguous, because they are in an
+   overlap where the clocks go back and they happen twice. */
+typedef enum
+{
+  /* Use the earlier of the two UTC times given by the offsets before and
+     after the change. In an overlap this is the first occurrence. In a gap
+     it is the local time minus the offset after the change, e.g. 02:30 when
+     the clocks go forward from 02:00 to 03:00 is 01:30 standard time. */
+  CYRUS_TZ_EARLIER,
+
+  /* Use the later of the two UTC times. In an overlap this is the second
+     occurrence. In a gap it is the local time minus the offset before the
+     change, e.g. 02:30 is 03:30 daylight-saving time. */
+  CYRUS_TZ_LATER,
+
+  /* Don't resolve gaps and overlaps at all. */
+  CYRUS_TZ_REJECT,
+
+  /* Move times in a gap forward to the end of the gap, i.e. the time of the
+     change, and use the first occurrence in an overlap. */
+  CYRUS_TZ_SHIFT_FORWARD
+} cyrus_tz_policy;
+
+/* The kind of local time found by cyrus_tz_resolve(). */
+typedef enum
+{
+  CYRUS_TZ_UNIQUE,
+  CYRUS_TZ_GAP,
+  CYRUS_TZ_OVERLAP
+} cyrus_tz_local_kind;
+
+/* This maps a table file, e.g. "zoneinfo/tables/Europe/London.tzt". It
+   returns NULL and sets errno if the file can't be read, or to EINVAL if
+   it isn't a valid table. */
+cyrus_tz       *cyrus_tz_open                   (const char     *filename);
+
+/* This uses a table which is already in memory, e.g. read from a database.
+   The data must stay valid until the table is closed. */
+cyrus_tz       *cyrus_tz_open_memory            (const void     *data,
+                                                 size_t          length);
+
+void            cyrus_tz_close                  (cyrus_tz       *tz);
+
+/* This sets info to the local time in effect at the UTC time, in seconds
+   since 1970. */
+void            cyrus_tz_lookup                 (const cyrus_tz *tz,
+                                                 int64_t         utc_time,
+                                                 cyrus_tz_info  *info);
+
+/* This converts a local time, in seconds since 1970 as if the local time
+   were UTC, to a UTC time. It returns whether the local time is unique, in a
+   gap or in an overlap. utc_time is set using the policy, except that it is
+   left alone if the policy is CYRUS_TZ_REJECT and the local time isn't
+   unique. */
+cyrus_tz_local_kind cyrus_tz_resolve            (const cyrus_tz *tz,
+                                                 int64_t         local_time,
+                                                 cyrus_tz_policy policy,
+                                                 int64_t        *utc_time);
+
+/* This converts count local times. It is quickest if they are sorted. If
+   kinds isn't NULL it is set to the kind of each local time. It returns the
+   number of times converted, i.e. count minus the number rejected. */
+size_t          cyrus_tz_resolve_batch          (const cyrus_tz *tz,
+                                                 const int64_t  *local_times,
+                                                 size_t          count,
+                                                 cyrus_tz_policy policy,
+                                                 int64_t        *utc_times,
+                                                 cyrus_tz_local_kind *kinds);
+
+
+/* A bundle file output by 'cyr_vzic --bundle', which holds the tables and
+   the VTIMEZONEs of all the zones and aliases. */
+typedef struct cyrus_tz_bundle cyrus_tz_bundle;
+
+/* This maps a bundle file, e.g. "zoneinfo/zones.bundle". It returns NULL
+   and sets errno if the file can't be read, or to EINVAL if it isn't a valid
+   bundle. The checksum isn't checked, see cyrus_tz_bundle_verify(). */
+cyrus_tz_bundle *cyrus_tz_bundle_open           (const char     *filename);
+
+void            cyrus_tz_bundle_close           (cyrus_tz_bundle *bundle);
+
+/* This returns 1 if the checksum of the bundle is correct, or 0 if it has
+   been corrupted. It reads the whole file. */
+int             cyrus_tz_bundle_verify          (const cyrus_tz_bundle *bundle);
+
+/* These return the number of zones and aliases, and their names, in
+   order. */
+size_t          cyrus_tz_bundle_count           (const cyrus_tz_bundle *bundle);
+const char     *cyrus_tz_bundle_name            (const cyrus_tz_bundle *bundle,
+                                                 size_t          i);
+
+/* This returns the table of a zone or alias. It must be closed with
+   cyrus_tz_close() before the bundle is. It returns NULL and sets errno to
+   ENOENT if the bundle doesn't have the name, or to EINVAL if the table is
+   invalid. */
+cyrus_tz       *cyrus_tz_bundle_get             (const cyrus_tz_bundle *bundle,
+                                                 const char     *name);
+
+/* This returns the VTIMEZONE file of a zone or alias, which ends with a nul
+   and belongs to the bundle, and sets length to its length if it isn't
+   NULL. It returns NULL and sets errno to ENOENT if the bundle doesn't have
+   the name. */
+const char     *cyrus_tz_bundle_get_vtimezone   (const cyrus_tz_bundle *bundle,
+                                                 const char     *name,
+                                                 size_t         *length);
+
+
+/* A zone index file output by 'cyr_vzic --zone-index', which maps the names
+   of the zones and aliases to zone ids, 0 to the number of zones - 1. */
+typedef struct cyrus_tz_index cyrus_tz_index;
+
+/* This maps a zone index file, e.g. "zoneinfo/zones.index". It returns NULL
+   and sets errno if the file can't be read, or to EINVAL if it isn't a
+   valid index. */
+cyrus_tz_index  *cyrus_tz_index_open            (const char     *filename);
+
+void            cyrus_tz_index_close            (cyrus_tz_index *index);
+
+/* This returns the zone id of a zone or alias name, which is the id of the
+   zone for an alias, or -1 if the index doesn't have the name. It takes a
+   constant time, whatever the number of names. */
+int             cyrus_tz_index_lookup           (const cyrus_tz_index *index,
+                                                 const char     *name);
+
+/* These return the number of zones, and the name of the zone with an id,
+   or NULL if there is no such zone. The zone ids are in the order of the
+   zone names. */
+size_t          cyrus_tz_index_num_zones        (const cyrus_tz_index *index);
+const char     *cyrus_tz_index_zone_name        (const cyrus_tz_index *index,
+                                                 int             zone_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CYRUS_TZ_H_ */
@@ -0,0 +1,1040 @@
+/*
+ * libcyrus-tz - fast time zone lookups using the transition tables output
+ * by vzic.
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * test-cyrus-tz.c - test libcyrus-tz against the files output by vzic.
+ *
+ * 'make check' runs cyr_vzic on the tzdata for a few zones, with --tables,
+ * --bundle and --zone-index, into the test-zoneinfo directory, and then runs
+ * this on it. Another directory can be given on the command line. It checks
+ * the lookups against known transitions, both in the tables and far in the
+ * future where the recurring changes are used, the gaps and overlaps with
+ * each policy, that the bundle and the index give the same tables, files and
+ * zones as the separate files, that truncated or corrupted files are
+ * rejected, and that times at the very ends of the range are handled.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyrus-tz.h"
+#include "cyrus-tz-format.h"
+
+#ifndef TEST_ZONEINFO_DIR
+#define TEST_ZONEINFO_DIR       "test-zoneinfo"
+#endif
+
+/* The corrupted files are written here, in the current directory. */
+#define TEST_TMP_FILE           "test-cyrus-tz.tmp"
+
+/* The maximum size of any complete pathname. */
+#define PATHNAME_BUFFER_SIZE    1024
+
+/* The local times we resolve that aren't changed by CYRUS_TZ_REJECT are
+   set to this first. */
+#define UNSET_TIME              INT64_C (-1234567)
+
+#define CHECK(cond)     check ((cond), #cond, __LINE__)
+
+#define N_ELEMENTS(array)       (sizeof (array) / sizeof ((array)[0]))
+
+
+/* A UTC time and the local time in effect then. */
+typedef struct _TestLookup TestLookup;
+struct _TestLookup
+{
+  const char   *zone;
+  int64_t       utc_time;
+  int32_t       utoff;
+  int           is_dst;
+  const char   *abbrev;
+};
+
+/* A local time and its UTC time with each policy. For a unique local time
+   they are all the same. */
+typedef struct _TestResolve TestResolve;
+struct _TestResolve
+{
+  const char   *zone;
+  int64_t       local_time;
+  cyrus_tz_local_kind kind;
+  int64_t       earlier;
+  int64_t       later;
+  int64_t       shift_forward;
+};
+
+/* A Link alias and its zone. */
+typedef struct _TestAlias TestAlias;
+struct _TestAlias
+{
+  const char   *alias;
+  const char   *zone;
+};
+
+
+/* The zones output for the tests, in the order of their zone ids. */
+static const char *TestZones[] = {
+  "America/New_York",
+  "Asia/Kolkata",
+  "Australia/Lord_Howe",
+  "Europe/London"
+};
+
+static const TestAlias TestAliases[] = {
+  { "US/Eastern",               "America/New_York" },
+  { "Asia/Calcutta",            "Asia/Kolkata" },
+  { "Australia/LHI",            "Australia/Lord_Howe" },
+  { "GB",                       "Europe/London" },
+  { "Europe/Belfast",           "Europe/London" }
+};
+
+/* The second before and the second of each change. The 2024 changes are in
+   the tables and the 2100 ones come from the recurring changes. The first
+   times are before the zone's first change, i.e. local mean time. */
+static const TestLookup TestLookups[] = {
+  { "Europe/London",       INT64_C (-5000000000),   -75, 0, "LMT" },
+  { "Europe/London",       INT64_C (1711846799),      0, 0, "GMT" },
+  { "Europe/London",       INT64_C (1711846800),   3600, 1, "BST" },
+  { "Europe/London",       INT64_C (1729990799),   3600, 1, "BST" },
+  { "Europe/London",       INT64_C (1729990800),      0, 0, "GMT" },
+  { "Europe/London",       INT64_C (4109878799),      0, 0, "GMT" },
+  { "Europe/London",       INT64_C (4109878800),   3600, 1, "BST" },
+  { "Europe/London",       INT64_C (4128627599),   3600, 1, "BST" },
+  { "Europe/London",       INT64_C (4128627600),      0, 0, "GMT" },
+
+  { "America/New_York",    INT64_C (-5000000000), -17762, 0, "LMT" },
+  { "America/New_York",    INT64_C (1710053999), -18000, 0, "EST" },
+  { "America/New_York",    INT64_C (1710054000), -14400, 1, "EDT" },
+  { "America/New_York",    INT64_C (1730613599), -14400, 1, "EDT" },
+  { "America/New_York",    INT64_C (1730613600), -18000, 0, "EST" },
+  { "America/New_York",    INT64_C (4108690799), -18000, 0, "EST" },
+  { "America/New_York",    INT64_C (4108690800), -14400, 1, "EDT" },
+  { "America/New_York",    INT64_C (4129250399), -14400, 1, "EDT" },
+  { "America/New_York",    INT64_C (4129250400), -18000, 0, "EST" },
+
+  /* Lord Howe Island only moves its clocks by 30 minutes. */
+  { "Australia/Lord_Howe", INT64_C (1712415599),  39600, 1, "+11" },
+  { "Australia/Lord_Howe", INT64_C (1712415600),  37800, 0, "+1030" },
+  { "Australia/Lord_Howe", INT64_C (1728142199),  37800, 0, "+1030" },
+  { "Australia/Lord_Howe", INT64_C (1728142200),  39600, 1, "+11" },
+  { "Australia/Lord_Howe", INT64_C (4110447599),  39600, 1, "+11" },
+  { "Australia/Lord_Howe", INT64_C (4110447600),  37800, 0, "+1030" },
+  { "Australia/Lord_Howe", INT64_C (4126174199),  37800, 0, "+1030" },
+  { "Australia/Lord_Howe", INT64_C (4126174200),  39600, 1, "+11" },
+
+  /* No daylight-saving time, so there are no recurring changes. */
+  { "Asia/Kolkata",        INT64_C (-5000000000),  21208, 0, "LMT" },
+  { "Asia/Kolkata",        INT64_C (0),            19800, 0, "IST" },
+  { "Asia/Kolkata",        INT64_C (4110447600),   19800, 0, "IST" }
+};
+
+/* The local times are given as if they were UTC, e.g. 1711848600 is 01:30
+   on 31st March 2024. In a gap, the earlier time uses the offset after the
+   change and the later one the offset before it. */
+static const TestResolve TestResolves[] = {
+  /* 31st March 2024, 01:00 GMT to 02:00 BST. */
+  { "Europe/London", INT64_C (1711846799), CYRUS_TZ_UNIQUE,
+    INT64_C (1711846799), INT64_C (1711846799), INT64_C (1711846799) },
+  { "Europe/London", INT64_C (1711846800), CYRUS_TZ_GAP,
+    INT64_C (1711843200), INT64_C (1711846800), INT64_C (1711846800) },
+  { "Europe/London", INT64_C (1711848600), CYRUS_TZ_GAP,
+    INT64_C (1711845000), INT64_C (1711848600), INT64_C (1711846800) },
+  { "Europe/London", INT64_C (1711850400), CYRUS_TZ_UNIQUE,
+    INT64_C (1711846800), INT64_C (1711846800), INT64_C (1711846800) },
+
+  /* 1st July 2024, 12:00 BST. */
+  { "Europe/London", INT64_C (1719835200), CYRUS_TZ_UNIQUE,
+    INT64_C (1719831600), INT64_C (1719831600), INT64_C (1719831600) },
+
+  /* 27th October 2024, 02:00 BST to 01:00 GMT. */
+  { "Europe/London", INT64_C (1729990799), CYRUS_TZ_UNIQUE,
+    INT64_C (1729987199), INT64_C (1729987199), INT64_C (1729987199) },
+  { "Europe/London", INT64_C (1729990800), CYRUS_TZ_OVERLAP,
+    INT64_C (1729987200), INT64_C (1729990800), INT64_C (1729987200) },
+  { "Europe/London", INT64_C (1729992600), CYRUS_TZ_OVERLAP,
+    INT64_C (1729989000), INT64_C (1729992600), INT64_C (1729989000) },
+  { "Europe/London", INT64_C (1729994400), CYRUS_TZ_UNIQUE,
+    INT64_C (1729994400), INT64_C (1729994400), INT64_C (1729994400) },
+
+  /* 28th March and 31st October 2100. */
+  { "Europe/London", INT64_C (4109880600), CYRUS_TZ_GAP,
+    INT64_C (4109877000), INT64_C (4109880600), INT64_C (4109878800) },
+  { "Europe/London", INT64_C (4128629400), CYRUS_TZ_OVERLAP,
+    INT64_C (4128625800), INT64_C (4128629400), INT64_C (4128625800) },
+
+  /* 10th March and 3rd November 2024, and 14th March 2100. */
+  { "America/New_York", INT64_C (1710037800), CYRUS_TZ_GAP,
+    INT64_C (1710052200), INT64_C (1710055800), INT64_C (1710054000) },
+  { "America/New_York", INT64_C (1730597400), CYRUS_TZ_OVERLAP,
+    INT64_C (1730611800), INT64_C (1730615400), INT64_C (1730611800) },
+  { "America/New_York", INT64_C (4108674600), CYRUS_TZ_GAP,
+    INT64_C (4108689000), INT64_C (4108692600), INT64_C (4108690800) },
+
+  /* 7th April and 6th October 2024, and 3rd October 2100, with 30 minute
+     gaps and overlaps. */
+  { "Australia/Lord_Howe", INT64_C (1712454300), CYRUS_TZ_OVERLAP,
+    INT64_C (1712414700), INT64_C (1712416500), INT64_C (1712414700) },
+  { "Australia/Lord_Howe", INT64_C (1728180900), CYRUS_TZ_GAP,
+    INT64_C (1728141300), INT64_C (1728143100), INT64_C (1728142200) },
+  { "Australia/Lord_Howe", INT64_C (4126212900), CYRUS_TZ_GAP,
+    INT64_C (4126173300), INT64_C (4126175100), INT64_C (4126174200) },
+
+  { "Asia/Kolkata", INT64_C (-5000000000), CYRUS_TZ_UNIQUE,
+    INT64_C (-5000021208), INT64_C (-5000021208), INT64_C (-5000021208) },
+  { "Asia/Kolkata", INT64_C (1719835200), CYRUS_TZ_UNIQUE,
+    INT64_C (1719815400), INT64_C (1719815400), INT64_C (1719815400) }
+};
+
+static const cyrus_tz_policy TestPolicies[] = {
+  CYRUS_TZ_EARLIER,
+  CYRUS_TZ_LATER,
+  CYRUS_TZ_REJECT,
+  CYRUS_TZ_SHIFT_FORWARD
+};
+
+/* Names that aren't in the bundle or the index. */
+static const char *UnknownNames[] = {
+  "",
+  "Europe/Londo",
+  "Europe/London/",
+  "europe/london",
+  "Europe/Paris",
+  "ZZZ"
+};
+
+static const char *ZoneinfoDir = TEST_ZONEINFO_DIR;
+static int NumFailures = 0;
+
+
+static void     check                           (int             ok,
+                                                 const char     *what,
+                                                 int             line);
+static cyrus_tz *open_zone_table                (const char     *name);
+static unsigned char *read_file                 (const char     *filename,
+                                                 size_t         *length);
+static void     write_file                      (const char     *filename,
+                                                 const void     *data,
+                                                 size_t          length);
+static int      tables_equal                    (const cyrus_tz *tz1,
+                                                 const cyrus_tz *tz2);
+static void     set_int64                       (unsigned char  *p,
+                                                 int64_t         value);
+static int64_t  expected_utc_time               (const TestResolve *test,
+                                                 cyrus_tz_policy policy);
+static void     test_lookups                    (void);
+static void     test_resolves                   (void);
+static void     test_resolve_round_trips        (void);
+static void     test_resolve_batches            (void);
+static void     test_bundle                     (void);
+static void     test_index                      (void);
+static void     test_invalid_tables             (void);
+static void     test_invalid_bundles            (void);
+static void     test_invalid_indexes            (void);
+static void     test_far_times                  (void);
+
+
+int
+main                            (int             argc,
+                                 char           *argv[])
+{
+  if (argc > 1)
+    ZoneinfoDir = argv[1];
+
+  test_lookups ();
+  test_resolves ();
+  test_resolve_round_trips ();
+  test_resolve_batches ();
+  test_bundle ();
+  test_index ();
+  test_invalid_tables ();
+  test_invalid_bundles ();
+  test_invalid_indexes ();
+  test_far_times ();
+
+  remove (TEST_TMP_FILE);
+
+  if (NumFailures) {
+    fprintf (stderr, "%i checks failed\n", NumFailures);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static void
+check                           (int             ok,
+                                 const char     *what,
+                                 int             line)
+{
+  if (!ok) {
+    fprintf (stderr, "test-cyrus-tz.c:%i: Check failed: %s\n", line, what);
+    NumFailures++;
+  }
+}
+
+
+/* This opens the table of a zone or alias in the tables directory. */
+static cyrus_tz*
+open_zone_table                 (const char     *name)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  cyrus_tz *tz;
+
+  snprintf (filename, sizeof (filename), "%s/tables/%s.tzt", ZoneinfoDir,
+            name);
+  tz = cyrus_tz_open (filename);
+  if (!tz) {
+    fprintf (stderr, "Couldn't open table: %s (%s)\n", filename,
+             strerror (errno));
+    exit (1);
+  }
+
+  return tz;
+}
+
+
+static unsigned char*
+read_file                       (const char     *filename,
+                                 size_t         *length)
+{
+  unsigned char *data;
+  FILE *fp;
+  long size;
+
+  fp = fopen (filename, "rb");
+  if (!fp || fseek (fp, 0, SEEK_END) != 0 || (size = ftell (fp)) < 0
+      || fseek (fp, 0, SEEK_SET) != 0) {
+    fprintf (stderr, "Couldn't read file: %s\n", filename);
+    exit (1);
+  }
+
+  /* We add a nul, so the .ics files can be compared as strings. */
+  data = malloc (size + 1);
+  if (!data || fread (data, 1, size, fp) != (size_t) size) {
+    fprintf (stderr, "Couldn't read file: %s\n", filename);
+    exit (1);
+  }
+  data[size] = '\0';
+  fclose (fp);
+
+  *length = size;
+  return data;
+}
+
+
+static void
+write_file                      (const char     *filename,
+                                 const void     *data,
+                                 size_t          length)
+{
+  FILE *fp;
+
+  fp = fopen (filename, "wb");
+  if (!fp || fwrite (data, 1, length, fp) != length || fclose (fp) != 0) {
+    fprintf (stderr, "Couldn't write file: %s\n", filename);
+    exit (1);
+  }
+}
+
+
+/* This returns 1 if the two tables give the same local times, checking
+   every hour over a few years around now and around 2100. */
+static int
+tables_equal                    (const cyrus_tz *tz1,
+                                 const cyrus_tz *tz2)
+{
+  static const int64_t starts[] = {
+    INT64_C (-5000000000), INT64_C (1672531200), INT64_C (4102444800)
+  };
+  cyrus_tz_info info1, info2;
+  int64_t t;
+  size_t i;
+
+  for (i = 0; i < N_ELEMENTS (starts); i++) {
+    for (t = starts[i]; t < starts[i] + 3 * 366 * 86400; t += 3600) {
+      cyrus_tz_lookup (tz1, t, &info1);
+      cyrus_tz_lookup (tz2, t, &info2);
+      if (info1.utoff != info2.utoff || info1.is_dst != info2.is_dst
+          || strcmp (info1.abbrev, info2.abbrev))
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/* This writes a little-endian int64, like the tables use. */
+static void
+set_int64                       (unsigned char  *p,
+                                 int64_t         value)
+{
+  uint64_t v = (uint64_t) value;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = (unsigned char) (v >> (8 * i));
+}
+
+
+static int64_t
+expected_utc_time               (const TestResolve *test,
+                                 cyrus_tz_policy policy)
+{
+  if (test->kind == CYRUS_TZ_UNIQUE)
+    return test->earlier;
+
+  switch (policy) {
+  case CYRUS_TZ_EARLIER:
+    return test->earlier;
+  case CYRUS_TZ_LATER:
+    return test->later;
+  case CYRUS_TZ_SHIFT_FORWARD:
+    return test->shift_forward;
+  default:
+    return UNSET_TIME;
+  }
+}
+
+
+static void
+test_lookups                    (void)
+{
+  const TestLookup *test;
+  cyrus_tz_info info;
+  cyrus_tz *tz;
+  size_t i;
+
+  for (i = 0; i < N_ELEMENTS (TestLookups); i++) {
+    test = &TestLookups[i];
+    tz = open_zone_table (test->zone);
+
+    cyrus_tz_lookup (tz, test->utc_time, &info);
+    if (info.utoff != test->utoff || info.is_dst != test->is_dst
+        || strcmp (info.abbrev, test->abbrev)) {
+      fprintf (stderr, "%s at %" PRId64 ": got %" PRId32 " %i %s\n",
+               test->zone, test->utc_time, info.utoff, info.is_dst,
+               info.abbrev);
+      CHECK (!"lookup matches the known transition");
+    }
+
+    cyrus_tz_close (tz);
+  }
+}
+
+
+static void
+test_resolves                   (void)
+{
+  const TestResolve *test;
+  cyrus_tz_local_kind kind;
+  cyrus_tz *tz;
+  int64_t utc_time;
+  size_t i, j;
+
+  for (i = 0; i < N_ELEMENTS (TestResolves); i++) {
+    test = &TestResolves[i];
+    tz = open_zone_table (test->zone);
+
+    for (j = 0; j < N_ELEMENTS (TestPolicies); j++) {
+      utc_time = UNSET_TIME;
+      kind = cyrus_tz_resolve (tz, test->local_time, TestPolicies[j],
+                               &utc_time);
+      if (kind != test->kind
+          || utc_time != expected_utc_time (test, TestPolicies[j])) {
+        fprintf (stderr, "%s at local %" PRId64 " with policy %i: got %i %"
+                 PRId64 "\n", test->zone, test->local_time,
+                 (int) TestPolicies[j], (int) kind, utc_time);
+        CHECK (!"resolve matches the known gap or overlap");
+      }
+    }
+
+    cyrus_tz_close (tz);
+  }
+}
+
+
+/* Every local time that was in effect resolves back to its UTC time, with
+   the earlier or later policy if it is in an overlap, and never to a gap. */
+static void
+test_resolve_round_trips        (void)
+{
+  static const int64_t starts[] = { INT64_C (1672531200),
+                                    INT64_C (4102444800) };
+  cyrus_tz_local_kind kind;
+  cyrus_tz_info info;
+  cyrus_tz *tz;
+  int64_t t, local_time, earlier, later;
+  size_t i, j;
+
+  for (i = 0; i < N_ELEMENTS (TestZones); i++) {
+    tz = open_zone_table (TestZones[i]);
+
+    for (j = 0; j < N_ELEMENTS (starts); j++) {
+      for (t = starts[j]; t < starts[j] + 2 * 366 * 86400; t += 900) {
+        cyrus_tz_lookup (tz, t, &info);
+        local_time = t + info.utoff;
+
+        kind = cyrus_tz_resolve (tz, local_time, CYRUS_TZ_EARLIER, &earlier);
+        cyrus_tz_resolve (tz, local_time, CYRUS_TZ_LATER, &later);
+
+        if (kind == CYRUS_TZ_GAP
+            || (kind == CYRUS_TZ_UNIQUE && (earlier != t || later != t))
+            || (kind == CYRUS_TZ_OVERLAP && earlier != t && later != t)) {
+          fprintf (stderr, "%s at %" PRId64 ": got %i %" PRId64 " %" PRId64
+                   "\n", TestZones[i], t, (int) kind, earlier, later);
+          CHECK (!"local time resolves back to its UTC time");
+        }
+      }
+    }
+
+    cyrus_tz_close (tz);
+  }
+}
+
+
+/* The batches give the same results as resolving the times one at a time,
+   whether the times are sorted or not. */
+static void
+test_resolve_batches            (void)
+{
+  int64_t local_times[2 * N_ELEMENTS (TestResolves)];
+  int64_t utc_times[2 * N_ELEMENTS (TestResolves)], utc_time;
+  cyrus_tz_local_kind kinds[2 * N_ELEMENTS (TestResolves)], kind;
+  cyrus_tz_policy policy;
+  size_t i, j, k, count, num_resolved;
+  cyrus_tz *tz;
+
+  for (i = 0; i < N_ELEMENTS (TestZones); i++) {
+    tz = open_zone_table (TestZones[i]);
+
+    /* The zone's test times in order, then in reverse order. */
+    count = 0;
+    for (j = 0; j < N_ELEMENTS (TestResolves); j++) {
+      if (!strcmp (TestResolves[j].zone, TestZones[i]))
+        local_times[count++] = TestResolves[j].local_time;
+    }
+    for (j = count; j > 0; j--)
+      local_times[count + count - j] = local_times[j - 1];
+    count *= 2;
+
+    for (j = 0; j < N_ELEMENTS (TestPolicies); j++) {
+      policy = TestPolicies[j];
+      num_resolved = 0;
+      for (k = 0; k < count; k++) {
+        utc_time = UNSET_TIME;
+        kind = cyrus_tz_resolve (tz, local_times[k], policy, &utc_time);
+        if (kind == CYRUS_TZ_UNIQUE || policy != CYRUS_TZ_REJECT)
+          num_resolved++;
+
+        utc_times[k] = UNSET_TIME;
+        cyrus_tz_resolve_batch (tz, &local_times[k], 1, policy, &utc_times[k],
+                                &kinds[k]);
+        CHECK (kinds[k] == kind && utc_times[k] == utc_time);
+      }
+
+      for (k = 0; k < count; k++)
+        utc_times[k] = UNSET_TIME;
+      CHECK (cyrus_tz_resolve_batch (tz, local_times, count, policy,
+                                     utc_times, kinds) == num_resolved);
+      for (k = 0; k < count; k++) {
+        utc_time = UNSET_TIME;
+        CHECK (kinds[k] == cyrus_tz_resolve (tz, local_times[k], policy,
+                                             &utc_time));
+        CHECK (utc_times[k] == utc_time);
+      }
+
+      /* The kinds are optional. */
+      CHECK (cyrus_tz_resolve_batch (tz, local_times, count, policy,
+                                     utc_times, NULL) == num_resolved);
+    }
+
+    cyrus_tz_close (tz);
+  }
+}
+
+
+/* The bundle has the same tables and VTIMEZONE files as the separate
+   files, for every zone and alias. */
+static void
+test_bundle                     (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  cyrus_tz_bundle *bundle;
+  cyrus_tz *tz, *file_tz;
+  const char *name, *prev_name = NULL, *vtimezone;
+  unsigned char *ics;
+  size_t i, length, ics_length;
+
+  snprintf (filename, sizeof (filename), "%s/zones.bundle", ZoneinfoDir);
+  bundle = cyrus_tz_bundle_open (filename);
+  if (!bundle) {
+    fprintf (stderr, "Couldn't open bundle: %s (%s)\n", filename,
+             strerror (errno));
+    exit (1);
+  }
+
+  CHECK (cyrus_tz_bundle_verify (bundle) == 1);
+  CHECK (cyrus_tz_bundle_count (bundle)
+         >= N_ELEMENTS (TestZones)
+            + N_ELEMENTS (TestAliases));
+
+  for (i = 0; i < cyrus_tz_bundle_count (bundle); i++) {
+    name = cyrus_tz_bundle_name (bundle, i);
+    CHECK (!prev_name || strcmp (prev_name, name) < 0);
+    prev_name = name;
+
+    tz = cyrus_tz_bundle_get (bundle, name);
+    CHECK (tz != NULL);
+    if (tz) {
+      file_tz = open_zone_table (name);
+      CHECK (tables_equal (tz, file_tz));
+      cyrus_tz_close (file_tz);
+      cyrus_tz_close (tz);
+    }
+
+    vtimezone = cyrus_tz_bundle_get_vtimezone (bundle, name, &length);
+    snprintf (filename, sizeof (filename), "%s/%s.ics", ZoneinfoDir, name);
+    ics = read_file (filename, &ics_length);
+    CHECK (vtimezone && length == ics_length
+           && !memcmp (vtimezone, ics, length) && vtimezone[length] == '\0');
+    free (ics);
+  }
+
+  /* An alias has the table of its zone. */
+  for (i = 0; i < N_ELEMENTS (TestAliases); i++) {
+    tz = cyrus_tz_bundle_get (bundle, TestAliases[i].alias);
+    file_tz = open_zone_table (TestAliases[i].zone);
+    CHECK (tz && tables_equal (tz, file_tz));
+    cyrus_tz_close (file_tz);
+    cyrus_tz_close (tz);
+  }
+
+  for (i = 0; i < N_ELEMENTS (UnknownNames); i++) {
+    errno = 0;
+    CHECK (cyrus_tz_bundle_get (bundle, UnknownNames[i]) == NULL
+           && errno == ENOENT);
+    errno = 0;
+    CHECK (cyrus_tz_bundle_get_vtimezone (bundle, UnknownNames[i], NULL)
+           == NULL && errno == ENOENT);
+  }
+
+  CHECK (cyrus_tz_bundle_name (bundle, cyrus_tz_bundle_count (bundle))
+         == NULL);
+
+  cyrus_tz_bundle_close (bundle);
+}
+
+
+/* Every name in the bundle is in the index, and has the id of a zone with
+   the same table. */
+static void
+test_index                      (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  cyrus_tz_bundle *bundle;
+  cyrus_tz_index *index;
+  cyrus_tz *tz, *zone_tz;
+  const char *name, *zone_name;
+  size_t i, num_zones;
+  int zone_id;
+
+  snprintf (filename, sizeof (filename), "%s/zones.index", ZoneinfoDir);
+  index = cyrus_tz_index_open (filename);
+  if (!index) {
+    fprintf (stderr, "Couldn't open index: %s (%s)\n", filename,
+             strerror (errno));
+    exit (1);
+  }
+
+  num_zones = N_ELEMENTS (TestZones);
+  CHECK (cyrus_tz_index_num_zones (index) == num_zones);
+  for (i = 0; i < num_zones; i++) {
+    zone_name = cyrus_tz_index_zone_name (index, i);
+    CHECK (zone_name && !strcmp (zone_name, TestZones[i]));
+    CHECK (cyrus_tz_index_lookup (index, TestZones[i]) == (int) i);
+  }
+  CHECK (cyrus_tz_index_zone_name (index, -1) == NULL);
+  CHECK (cyrus_tz_index_zone_name (index, num_zones) == NULL);
+
+  for (i = 0; i < N_ELEMENTS (TestAliases); i++)
+    CHECK (cyrus_tz_index_lookup (index, TestAliases[i].alias)
+           == cyrus_tz_index_lookup (index, TestAliases[i].zone));
+
+  for (i = 0; i < N_ELEMENTS (UnknownNames); i++)
+    CHECK (cyrus_tz_index_lookup (index, UnknownNames[i]) == -1);
+
+  snprintf (filename, sizeof (filename), "%s/zones.bundle", ZoneinfoDir);
+  bundle = cyrus_tz_bundle_open (filename);
+  CHECK (bundle != NULL);
+  for (i = 0; bundle && i < cyrus_tz_bundle_count (bundle); i++) {
+    name = cyrus_tz_bundle_name (bundle, i);
+    zone_id = cyrus_tz_index_lookup (index, name);
+    CHECK (zone_id >= 0 && zone_id < (int) num_zones);
+    if (zone_id < 0)
+      continue;
+
+    tz = cyrus_tz_bundle_get (bundle, name);
+    zone_tz = open_zone_table (cyrus_tz_index_zone_name (index, zone_id));
+    CHECK (tz && tables_equal (tz, zone_tz));
+    cyrus_tz_close (zone_tz);
+    cyrus_tz_close (tz);
+  }
+  cyrus_tz_bundle_close (bundle);
+
+  cyrus_tz_index_close (index);
+}
+
+
+/* A table is rejected if it has been cut short anywhere, or if any of the
+   things checked when it is opened are wrong. */
+static void
+test_invalid_tables             (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  unsigned char *data, *copy;
+  size_t length, i;
+  uint32_t num_transitions;
+  cyrus_tz *tz;
+
+  snprintf (filename, sizeof (filename), "%s/tables/Europe/London.tzt",
+            ZoneinfoDir);
+  data = read_file (filename, &length);
+  copy = malloc (length);
+
+  tz = cyrus_tz_open_memory (data, length);
+  CHECK (tz != NULL);
+  cyrus_tz_close (tz);
+
+  for (i = 0; i < length; i++) {
+    errno = 0;
+    CHECK (cyrus_tz_open_memory (data, i) == NULL && errno == EINVAL);
+  }
+
+  write_file (TEST_TMP_FILE, data, length / 2);
+  errno = 0;
+  CHECK (cyrus_tz_open (TEST_TMP_FILE) == NULL && errno == EINVAL);
+
+  errno = 0;
+  CHECK (cyrus_tz_open ("no-such-file.tzt") == NULL && errno == ENOENT);
+
+  num_transitions = cyrus_tz_read_uint32 (data
+                                          + CYRUS_TZ_HEADER_NUM_TRANSITIONS);
+
+  /* The magic string and the version. */
+  memcpy (copy, data, length);
+  copy[0] = 'X';
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_HEADER_VERSION]++;
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  /* A count that doesn't match the length. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_HEADER_NUM_RECURRENCES]++;
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  /* The abbreviations don't end with a nul. */
+  memcpy (copy, data, length);
+  copy[length - 1] = 'X';
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  /* An abbreviation past the end of the abbreviations. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_ABBREV] = 0xff;
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  /* The transitions out of order. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_HEADER_SIZE + (num_transitions - 1) * CYRUS_TZ_TRANSITION_SIZE
+       + CYRUS_TZ_TRANSITION_UTC_TIME + 7] = 0x80;
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  /* A recurrence in the 13th month. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_HEADER_SIZE
+       + num_transitions * (CYRUS_TZ_TRANSITION_SIZE
+                            + CYRUS_TZ_LOCAL_TIME_SIZE)
+       + CYRUS_TZ_RECURRENCE_MONTH] = 12;
+  CHECK (cyrus_tz_open_memory (copy, length) == NULL);
+
+  free (copy);
+  free (data);
+}
+
+
+static void
+test_invalid_bundles            (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  unsigned char *data, *copy;
+  size_t length, i;
+  cyrus_tz_bundle *bundle;
+  static const size_t cuts[] = { 0, 1, CYRUS_TZ_BUNDLE_HEADER_SIZE - 1,
+                                 CYRUS_TZ_BUNDLE_HEADER_SIZE,
+                                 CYRUS_TZ_BUNDLE_HEADER_SIZE
+                                 + CYRUS_TZ_BUNDLE_ENTRY_SIZE };
+
+  snprintf (filename, sizeof (filename), "%s/zones.bundle", ZoneinfoDir);
+  data = read_file (filename, &length);
+  copy = malloc (length);
+
+  for (i = 0; i < N_ELEMENTS (cuts); i++) {
+    write_file (TEST_TMP_FILE, data, cuts[i]);
+    errno = 0;
+    CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL && errno == EINVAL);
+  }
+  for (i = 1; i < 8; i++) {
+    write_file (TEST_TMP_FILE, data, length * i / 8);
+    errno = 0;
+    CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL && errno == EINVAL);
+  }
+  write_file (TEST_TMP_FILE, data, length - 1);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  errno = 0;
+  CHECK (cyrus_tz_bundle_open ("no-such-file.bundle") == NULL
+         && errno == ENOENT);
+
+  /* The magic string and the version. */
+  memcpy (copy, data, length);
+  copy[0] = 'X';
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_BUNDLE_HEADER_VERSION]++;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  /* More entries than fit in the file. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_BUNDLE_HEADER_NUM_ENTRIES + 3] = 0x10;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  /* A name and a table past the end of the file. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_BUNDLE_HEADER_SIZE + CYRUS_TZ_BUNDLE_ENTRY_NAME + 4] = 0x10;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_BUNDLE_HEADER_SIZE + CYRUS_TZ_BUNDLE_ENTRY_TABLE + 4] = 0x10;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  /* The names out of order, by swapping the first two entries. */
+  memcpy (copy, data, length);
+  memcpy (copy + CYRUS_TZ_BUNDLE_HEADER_SIZE,
+          data + CYRUS_TZ_BUNDLE_HEADER_SIZE + CYRUS_TZ_BUNDLE_ENTRY_SIZE,
+          CYRUS_TZ_BUNDLE_ENTRY_SIZE);
+  memcpy (copy + CYRUS_TZ_BUNDLE_HEADER_SIZE + CYRUS_TZ_BUNDLE_ENTRY_SIZE,
+          data + CYRUS_TZ_BUNDLE_HEADER_SIZE, CYRUS_TZ_BUNDLE_ENTRY_SIZE);
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_bundle_open (TEST_TMP_FILE) == NULL);
+
+  /* A changed byte in the data is only found by the checksum. */
+  memcpy (copy, data, length);
+  copy[length - 2] ^= 1;
+  write_file (TEST_TMP_FILE, copy, length);
+  bundle = cyrus_tz_bundle_open (TEST_TMP_FILE);
+  CHECK (bundle && cyrus_tz_bundle_verify (bundle) == 0);
+  cyrus_tz_bundle_close (bundle);
+
+  free (copy);
+  free (data);
+}
+
+
+/* An index is rejected if it has been cut short anywhere, or if any of the
+   things checked when it is opened are wrong. */
+static void
+test_invalid_indexes            (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  unsigned char *data, *copy;
+  size_t length, i;
+  uint32_t num_names;
+
+  snprintf (filename, sizeof (filename), "%s/zones.index", ZoneinfoDir);
+  data = read_file (filename, &length);
+  copy = malloc (length);
+
+  for (i = 0; i < length; i++) {
+    write_file (TEST_TMP_FILE, data, i);
+    errno = 0;
+    CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL && errno == EINVAL);
+  }
+
+  errno = 0;
+  CHECK (cyrus_tz_index_open ("no-such-file.index") == NULL
+         && errno == ENOENT);
+
+  num_names = cyrus_tz_read_uint32 (data + CYRUS_TZ_INDEX_HEADER_NUM_NAMES);
+
+  /* The magic string and the version. */
+  memcpy (copy, data, length);
+  copy[0] = 'X';
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_INDEX_HEADER_VERSION]++;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  /* More zones than names. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_INDEX_HEADER_NUM_ZONES] = num_names + 1;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  /* A displacement to a slot past the end. */
+  memcpy (copy, data, length);
+  memset (copy + CYRUS_TZ_INDEX_HEADER_SIZE, 0x80, 4);
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  /* A slot with a name past the end of the file, and one with a zone id
+     that doesn't exist. */
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_INDEX_HEADER_SIZE + num_names * 4
+       + CYRUS_TZ_INDEX_SLOT_NAME + 3] = 0x10;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  memcpy (copy, data, length);
+  copy[CYRUS_TZ_INDEX_HEADER_SIZE + num_names * 4
+       + CYRUS_TZ_INDEX_SLOT_ZONE_ID] = num_names;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  /* A name that isn't in the slot it hashes to. */
+  memcpy (copy, data, length);
+  copy[length - 2] ^= 1;
+  write_file (TEST_TMP_FILE, copy, length);
+  CHECK (cyrus_tz_index_open (TEST_TMP_FILE) == NULL);
+
+  free (copy);
+  free (data);
+}
+
+
+/* The recurrences are only used after a last transition near 1970, so a
+   table whose only transition is at the start of time, or far in the
+   future, is rejected. With a last transition far in the past, the times at
+   the very ends of the range are still looked up and resolved. */
+static void
+test_far_times                  (void)
+{
+  static const int64_t last_times[] = {
+    INT64_MIN, -(INT64_C (1) << 60), INT64_C (1) << 60, -(INT64_C (1) << 50)
+  };
+  static const int64_t local_times[] = { INT64_MIN, INT64_MAX };
+  char filename[PATHNAME_BUFFER_SIZE];
+  unsigned char *data, *table, *p;
+  size_t length, table_length, recurrences_length;
+  uint32_t num_recurrences, abbrevs_length;
+  cyrus_tz_info info;
+  cyrus_tz *tz;
+  int64_t utc_time;
+  size_t i, j;
+
+  snprintf (filename, sizeof (filename), "%s/tables/Europe/London.tzt",
+            ZoneinfoDir);
+  data = read_file (filename, &length);
+
+  num_recurrences = cyrus_tz_read_uint32 (data
+                                          + CYRUS_TZ_HEADER_NUM_RECURRENCES);
+  abbrevs_length = cyrus_tz_read_uint32 (data
+                                         + CYRUS_TZ_HEADER_ABBREVS_LENGTH);
+  recurrences_length = (size_t) num_recurrences * CYRUS_TZ_RECURRENCE_SIZE;
+  CHECK (num_recurrences > 0);
+
+  /* The first transition of London, with its recurrences. */
+  table_length = CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_SIZE
+    + CYRUS_TZ_LOCAL_TIME_SIZE + recurrences_length + abbrevs_length;
+  table = malloc (table_length);
+  memcpy (table, data, CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_SIZE);
+  table[CYRUS_TZ_HEADER_NUM_TRANSITIONS] = 1;
+  memset (table + CYRUS_TZ_HEADER_NUM_TRANSITIONS + 1, 0, 3);
+  p = table + CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_SIZE
+    + CYRUS_TZ_LOCAL_TIME_SIZE;
+  memcpy (p, data + length - abbrevs_length - recurrences_length,
+          recurrences_length + abbrevs_length);
+
+  for (i = 0; i < N_ELEMENTS (last_times); i++) {
+    set_int64 (table + CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_UTC_TIME,
+               last_times[i]);
+    set_int64 (table + CYRUS_TZ_HEADER_SIZE + CYRUS_TZ_TRANSITION_SIZE,
+               last_times[i]);
+
+    errno = 0;
+    tz = cyrus_tz_open_memory (table, table_length);
+    if (i < N_ELEMENTS (last_times) - 1) {
+      CHECK (tz == NULL && errno == EINVAL);
+      continue;
+    }
+    CHECK (tz != NULL);
+    if (!tz)
+      continue;
+
+    cyrus_tz_lookup (tz, INT64_MAX, &info);
+    CHECK (info.utoff == 0 || info.utoff == 3600);
+
+    for (j = 0; j < N_ELEMENTS (TestPolicies); j++) {
+      utc_time = UNSET_TIME;
+      if (cyrus_tz_resolve (tz, INT64_MAX, TestPolicies[j], &utc_time)
+          == CYRUS_TZ_UNIQUE || TestPolicies[j] != CYRUS_TZ_REJECT)
+        CHECK (utc_time >= INT64_MAX - 3600);
+    }
+
+    cyrus_tz_close (tz);
+  }
+
+  /* The real table at the very ends of the range. */
+  tz = cyrus_tz_open_memory (data, length);
+  CHECK (tz != NULL);
+  for (i = 0; tz && i < N_ELEMENTS (local_times); i++) {
+    cyrus_tz_lookup (tz, local_times[i], &info);
+    CHECK (info.utoff >= -75 && info.utoff <= 3600);
+
+    for (j = 0; j < N_ELEMENTS (TestPolicies); j++) {
+      utc_time = UNSET_TIME;
+      CHECK (cyrus_tz_resolve (tz, local_times[i], TestPolicies[j],
+                               &utc_time) == CYRUS_TZ_UNIQUE);
+      CHECK (utc_time <= INT64_MIN + 75 || utc_time >= INT64_MAX - 3600);
+    }
+  }
+  cyrus_tz_close (tz);
+
+  free (table);
+  free (data);
+}
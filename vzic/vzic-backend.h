@@ -0,0 +1,174 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The output backends. The transitions of each zone are only calculated
+ * once, and then each backend outputs them in its own format, e.g. the
+ * VTIMEZONE files, the ChangesVzic files of --dump-changes, the binary
+ * transition tables of --tables, the TZif files of --tzif-dir, the
+ * --bundle file or the --zone-index file. To add another format, write a
+ * VzicBackend and add it to the Backends array in vzic-output.c. vzic.h must
+ * be included before this.
+ */
+
+#ifndef _VZIC_BACKEND_H_
+#define _VZIC_BACKEND_H_
+
+#include <glib.h>
+
+
+/* One change in the UTC offset or TZNAME of a zone. */
+typedef struct _VzicTransition VzicTransition;
+struct _VzicTransition
+{
+  /* The time of the change, in seconds since 1970 in UTC. The first
+     transition of each zone is at G_MININT64, and just gives the offsets
+     used before the first known change. */
+  gint64        utc_time;
+
+  /* The local standard time and wall clock time offsets from UTC after the
+     change, in seconds. If they are different it is daylight-saving time. */
+  int           stdoff;
+  int           walloff;
+
+  /* The abbreviated timezone name, e.g. "CEST", or NULL. It is interned. */
+  char         *tzname;
+};
+
+
+/* A change which recurs every year forever, from one of the infinite Rules
+   in effect at the end of a zone. The day and time are as given in the
+   Rule line, see output_recurrence_time(). */
+typedef struct _VzicRecurrence VzicRecurrence;
+struct _VzicRecurrence
+{
+  /* The first year of the change, which is also the last transition of the
+     change in the zone's transitions. */
+  int           first_year;
+
+  int           month;                  /* 0 (Jan) to 11 (Dec). */
+  DayCode       day_code;
+  int           day_number;             /* 1 to 31. */
+  int           day_weekday;            /* 0 (Sun) to 6 (Sat). */
+  int           time_seconds;
+  TimeCode      time_code;
+
+  /* The offsets before the change, which the time is relative to, and the
+     offsets and TZNAME after the change, as in VzicTransition. */
+  int           prev_stdoff;
+  int           prev_walloff;
+  int           stdoff;
+  int           walloff;
+  char         *tzname;
+};
+
+
+/* The transitions of a zone, which are shared by all the backends. */
+typedef struct _VzicZoneTransitions VzicZoneTransitions;
+struct _VzicZoneTransitions
+{
+  /* The transitions in time order, including the first instance of each
+     recurring change. */
+  VzicTransition *transitions;
+  int             num_transitions;
+
+  /* The changes which recur every year forever after the last transitions,
+     in time order, e.g. the start and end of daylight-saving time. There are
+     none if the last Rules of the zone end or it doesn't use Rules. */
+  VzicRecurrence *recurrences;
+  int             num_recurrences;
+};
+
+
+/* The data that vzic-output.c uses to calculate the transitions. */
+typedef struct _VzicZoneCalculation VzicZoneCalculation;
+
+/* A zone to be output in one flavor, which is passed to each backend. */
+typedef struct _VzicOutputZone VzicOutputZone;
+struct _VzicOutputZone
+{
+  VzicFlavor      *flavor;
+  ZoneData        *zone;
+  ZoneDescription *zone_desc;
+
+  /* The names of the Link aliases of the zone. */
+  GList           *links;
+
+  VzicZoneCalculation *calculation;
+};
+
+
+typedef struct _VzicBackend VzicBackend;
+struct _VzicBackend
+{
+  /* The subdirectory of the flavor's output directory that the backend
+     outputs its files into, or NULL if it uses the output directory itself.
+     The directories for the zones are created within it. */
+  char         *directory;
+
+  /* Returns TRUE if the backend outputs anything for the flavor. */
+  gboolean    (*is_enabled)     (VzicFlavor     *flavor);
+
+  /* Outputs the files of a zone and its Link aliases. This is called by
+     several threads at once, for different zones. */
+  void        (*output_zone)    (VzicOutputZone *zone);
+
+  /* If set, returns the directory the backend outputs its files into,
+     instead of the flavor's output directory, e.g. --tzif-dir. The backend
+     should then only be enabled for one flavor. */
+  char*       (*output_dir)     (VzicFlavor     *flavor);
+};
+
+
+extern VzicBackend VzicIcsBackend;
+extern VzicBackend VzicChangesBackend;
+extern VzicBackend VzicTableBackend;
+extern VzicBackend VzicTzifBackend;
+extern VzicBackend VzicBundleBackend;
+extern VzicBackend VzicIndexBackend;
+
+
+/* Returns the transitions of the zone in its flavor, calculating them if
+   they haven't been already. They are freed after the zone is output. */
+VzicZoneTransitions* output_zone_get_transitions (VzicOutputZone *zone);
+
+/* The same, but never rounds the UTC offsets to the nearest minute, for
+   formats that don't have to be Outlook-compatible. */
+VzicZoneTransitions* output_zone_get_exact_transitions (VzicOutputZone *zone);
+
+/* Sets the pathname of the backend's file for the zone or one of its Link
+   aliases, adding the suffix, e.g. ".ics". It returns FALSE if the name is
+   invalid, in which case no file should be output. */
+gboolean        output_zone_filename            (VzicOutputZone *zone,
+                                                 VzicBackend    *backend,
+                                                 char           *zone_name,
+                                                 char           *suffix,
+                                                 char           *filename);
+
+/* Returns the time of the change in the given year, in seconds since 1970
+   in UTC. */
+gint64          output_recurrence_time          (VzicRecurrence *recurrence,
+                                                 int             year);
+
+#endif /* _VZIC_BACKEND_H_ */
@@ -0,0 +1,318 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --bundle backend. It keeps the transition table and the VTIMEZONE
+ * file of each zone and Link alias of the main flavor in memory as they are
+ * output, and bundle_save() then writes them all into one file, with a
+ * sorted index of the names, for libcyrus-tz to map and search. See
+ * libcyrus-tz/cyrus-tz-format.h for the format.
+ *
+ * The VTIMEZONEs are read back from the files just output, so the bundle
+ * always holds exactly what is in the output directory, whether the files
+ * were calculated, copied from the --cache-dir cache or linked with
+ * --link-aliases. With --serve or --watch the zones that are output again
+ * replace the old ones, and the bundle is saved again after each reload.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vzic.h"
+#include "vzic-backend.h"
+#include "vzic-bundle.h"
+#include "vzic-output.h"
+#include "vzic-table.h"
+
+#include "cyrus-tz-format.h"
+
+
+/* The VTIMEZONE of a zone or alias, and the zone whose table it uses. */
+typedef struct _VzicBundleEntry VzicBundleEntry;
+struct _VzicBundleEntry
+{
+  char         *name;
+  char         *zone_name;
+  char         *vtimezone;
+  gsize         vtimezone_length;
+};
+
+
+static gboolean bundle_is_enabled               (VzicFlavor     *flavor);
+static void     bundle_output_zone              (VzicOutputZone *zone);
+static VzicBundleEntry* bundle_read_entry       (VzicOutputZone *zone,
+                                                 char           *zone_name);
+static void     bundle_entry_free               (gpointer        data);
+static void     bundle_table_free               (gpointer        data);
+static void     bundle_append_zeros             (GString        *out,
+                                                 gsize           length);
+static void     bundle_set_uint32               (GString        *out,
+                                                 gsize           pos,
+                                                 guint32         value);
+static void     bundle_set_uint64               (GString        *out,
+                                                 gsize           pos,
+                                                 guint64         value);
+
+
+/* The entries of the zones and aliases, keyed by their names, and the
+   tables of the zones, keyed by the zone names. bundle_save() is only
+   called when no zones are being output, so it doesn't need the lock. */
+static GHashTable *BundleEntries        = NULL;
+static GHashTable *BundleTables         = NULL;
+G_LOCK_DEFINE_STATIC (bundle);
+
+
+VzicBackend VzicBundleBackend = {
+  NULL,
+  bundle_is_enabled,
+  bundle_output_zone,
+  NULL
+};
+
+
+static gboolean
+bundle_is_enabled               (VzicFlavor     *flavor)
+{
+  return VzicBundleFile && flavor == &VzicFlavors[0];
+}
+
+
+static void
+bundle_output_zone              (VzicOutputZone *zone)
+{
+  GString *table;
+  GList *entries = NULL, *elem;
+  VzicBundleEntry *entry;
+
+  table = table_build (zone->zone->zone_name,
+                       output_zone_get_transitions (zone));
+
+  /* We read the files before taking the lock, since the other threads are
+     doing the same. */
+  entry = bundle_read_entry (zone, zone->zone->zone_name);
+  if (entry)
+    entries = g_list_prepend (entries, entry);
+
+  for (elem = zone->links; elem; elem = elem->next) {
+    entry = bundle_read_entry (zone, elem->data);
+    if (entry)
+      entries = g_list_prepend (entries, entry);
+  }
+
+  G_LOCK (bundle);
+
+  if (!BundleEntries) {
+    BundleEntries = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                           bundle_entry_free);
+    BundleTables = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          bundle_table_free);
+  }
+
+  g_hash_table_replace (BundleTables, g_strdup (zone->zone->zone_name),
+                        table);
+
+  for (elem = entries; elem; elem = elem->next) {
+    entry = elem->data;
+    g_hash_table_replace (BundleEntries, entry->name, entry);
+  }
+
+  G_UNLOCK (bundle);
+
+  g_list_free (entries);
+}
+
+
+/* This reads the VTIMEZONE file of the zone or alias that has just been
+   output. It returns NULL if the name is invalid, so there is no file. */
+static VzicBundleEntry*
+bundle_read_entry               (VzicOutputZone *zone,
+                                 char           *zone_name)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  VzicBundleEntry *entry;
+
+  if (!output_zone_filename (zone, &VzicIcsBackend, zone_name, ".ics",
+                             filename))
+    return NULL;
+
+  entry = g_new (VzicBundleEntry, 1);
+  entry->name = g_strdup (zone_name);
+  entry->zone_name = g_strdup (zone->zone->zone_name);
+  if (!g_file_get_contents (filename, &entry->vtimezone,
+                            &entry->vtimezone_length, NULL)) {
+    fprintf (stderr, "Couldn't read file: %s\n", filename);
+    exit (1);
+  }
+
+  return entry;
+}
+
+
+static void
+bundle_entry_free               (gpointer        data)
+{
+  VzicBundleEntry *entry = data;
+
+  g_free (entry->name);
+  g_free (entry->zone_name);
+  g_free (entry->vtimezone);
+  g_free (entry);
+}
+
+
+static void
+bundle_table_free               (gpointer        data)
+{
+  g_string_free (data, TRUE);
+}
+
+
+/* The index entries are filled in as the data is appended after them. The
+   tables of the zones are only output once, in the order of the first name
+   that uses each one, so the file is the same however the zones were
+   output. */
+void
+bundle_save                     (char           *filename)
+{
+  GString *out, *table;
+  GHashTable *table_offsets;
+  GList *names, *elem;
+  VzicBundleEntry *entry;
+  gpointer offset;
+  gsize pos, table_offset;
+  guint64 checksum;
+  int num_entries, i;
+
+  names = BundleEntries ? g_hash_table_get_keys (BundleEntries) : NULL;
+  names = g_list_sort (names, (GCompareFunc) strcmp);
+  num_entries = g_list_length (names);
+
+  out = g_string_sized_new (1024 * 1024);
+  g_string_append (out, CYRUS_TZ_BUNDLE_MAGIC);
+  g_string_append_c (out, CYRUS_TZ_BUNDLE_FORMAT_VERSION);
+  bundle_append_zeros (out, CYRUS_TZ_BUNDLE_HEADER_SIZE - out->len);
+  bundle_set_uint32 (out, CYRUS_TZ_BUNDLE_HEADER_NUM_ENTRIES, num_entries);
+  bundle_append_zeros (out, (gsize) num_entries * CYRUS_TZ_BUNDLE_ENTRY_SIZE);
+
+  for (elem = names, i = 0; elem; elem = elem->next, i++) {
+    pos = CYRUS_TZ_BUNDLE_HEADER_SIZE + i * CYRUS_TZ_BUNDLE_ENTRY_SIZE;
+    bundle_set_uint64 (out, pos + CYRUS_TZ_BUNDLE_ENTRY_NAME, out->len);
+    g_string_append_len (out, elem->data, strlen (elem->data) + 1);
+  }
+
+  table_offsets = g_hash_table_new (g_str_hash, g_str_equal);
+  for (elem = names, i = 0; elem; elem = elem->next, i++) {
+    pos = CYRUS_TZ_BUNDLE_HEADER_SIZE + i * CYRUS_TZ_BUNDLE_ENTRY_SIZE;
+    entry = g_hash_table_lookup (BundleEntries, elem->data);
+    table = g_hash_table_lookup (BundleTables, entry->zone_name);
+
+    if (g_hash_table_lookup_extended (table_offsets, entry->zone_name, NULL,
+                                      &offset)) {
+      table_offset = GPOINTER_TO_SIZE (offset);
+    } else {
+      bundle_append_zeros (out, -out->len & 7);
+      table_offset = out->len;
+      g_string_append_len (out, table->str, table->len);
+      g_hash_table_insert (table_offsets, entry->zone_name,
+                           GSIZE_TO_POINTER (table_offset));
+    }
+
+    bundle_set_uint64 (out, pos + CYRUS_TZ_BUNDLE_ENTRY_TABLE, table_offset);
+    bundle_set_uint32 (out, pos + CYRUS_TZ_BUNDLE_ENTRY_TABLE_LENGTH,
+                       table->len);
+  }
+  g_hash_table_destroy (table_offsets);
+
+  for (elem = names, i = 0; elem; elem = elem->next, i++) {
+    pos = CYRUS_TZ_BUNDLE_HEADER_SIZE + i * CYRUS_TZ_BUNDLE_ENTRY_SIZE;
+    entry = g_hash_table_lookup (BundleEntries, elem->data);
+
+    bundle_set_uint64 (out, pos + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE, out->len);
+    bundle_set_uint32 (out, pos + CYRUS_TZ_BUNDLE_ENTRY_VTIMEZONE_LENGTH,
+                       entry->vtimezone_length);
+    g_string_append_len (out, entry->vtimezone, entry->vtimezone_length);
+    g_string_append_c (out, '\0');
+  }
+
+  /* The 64-bit FNV-1a hash of everything after the header. */
+  checksum = CYRUS_TZ_FNV_OFFSET_BASIS;
+  for (pos = CYRUS_TZ_BUNDLE_HEADER_SIZE; pos < out->len; pos++) {
+    checksum ^= (guchar) out->str[pos];
+    checksum *= CYRUS_TZ_FNV_PRIME;
+  }
+
+  bundle_set_uint64 (out, CYRUS_TZ_BUNDLE_HEADER_LENGTH, out->len);
+  bundle_set_uint64 (out, CYRUS_TZ_BUNDLE_HEADER_CHECKSUM, checksum);
+
+  write_file_atomically (filename, out->str, out->len);
+
+  g_string_free (out, TRUE);
+  g_list_free (names);
+}
+
+
+void
+bundle_free                     (void)
+{
+  if (BundleEntries) {
+    g_hash_table_destroy (BundleEntries);
+    g_hash_table_destroy (BundleTables);
+    BundleEntries = NULL;
+    BundleTables = NULL;
+  }
+}
+
+
+static void
+bundle_append_zeros             (GString        *out,
+                                 gsize           length)
+{
+  while (length--)
+    g_string_append_c (out, '\0');
+}
+
+
+static void
+bundle_set_uint32               (GString        *out,
+                                 gsize           pos,
+                                 guint32         value)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    out->str[pos + i] = (value >> (i * 8)) & 0xFF;
+}
+
+
+static void
+bundle_set_uint64               (GString        *out,
+                                 gsize           pos,
+                                 guint64         value)
+{
+  bundle_set_uint32 (out, pos, value & 0xFFFFFFFF);
+  bundle_set_uint32 (out, pos + 4, value >> 32);
+}
@@ -0,0 +1,42 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --bundle file, which holds the transition table and the VTIMEZONE of
+ * every zone and Link alias, so programs can map them all from one file
+ * instead of opening hundreds of small ones. See vzic-bundle.c.
+ */
+
+#ifndef _VZIC_BUNDLE_H_
+#define _VZIC_BUNDLE_H_
+
+#include <glib.h>
+
+/* This writes the bundle of all the zones output so far, replacing the old
+   file. */
+void            bundle_save                     (char           *filename);
+
+void            bundle_free                     (void);
+
+#endif /* _VZIC_BUNDLE_H_ */
@@ -0,0 +1,359 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The cache key of a VTIMEZONE file is a SHA-256 hash of its Zone lines,
+ * the Rules they use, the zone.tab data, the TZID & TZID-ALIAS-OF names and
+ * the command-line options that affect the output. With --reproducible it
+ * also includes the time used for LAST-MODIFIED, since the output must not
+ * depend on when the cached files were made. It also includes a checksum of
+ * the vzic sources made when vzic is built (see vzic-build-id.h), so we never
+ * use files output by a different build. The cached file is stored as
+ * <cache-dir>/<key>.ics.
+ *
+ * Every time a cached file is used its modification time is updated, and at
+ * the end of each run we delete the cached files that haven't been used for
+ * CACHE_MAX_AGE_DAYS, e.g. those of old releases of the Olson files or of
+ * options that are no longer used.
+ *
+ * Since the Rule data is shared by many zones, we hash each array of Rules
+ * once and then only add that hash to the key of each zone that uses it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "vzic.h"
+#include "vzic-cache.h"
+#include "vzic-output.h"
+#include "vzic-build-id.h"
+
+
+/* The cached files that haven't been used for this many days are deleted. */
+#define CACHE_MAX_AGE_DAYS      30
+
+/* The length of the keys, i.e. a SHA-256 hash in hex. */
+#define CACHE_KEY_LENGTH        64
+
+
+static void     cache_hash_rule_array           (gpointer        key,
+                                                 gpointer        value,
+                                                 gpointer        data);
+static void     checksum_int                    (GChecksum      *checksum,
+                                                 int             value);
+static void     checksum_int64                  (GChecksum      *checksum,
+                                                 gint64          value);
+static void     checksum_string                 (GChecksum      *checksum,
+                                                 char           *value);
+static char*    cache_filename                  (char           *key);
+static gboolean cache_is_cache_file             (const char     *name);
+
+
+/* This returns a hash table mapping the name of each set of Rules to the
+   hash of its Rule data. The max_until_year is included since it determines
+   how far we expand the infinite Rules. The keys belong to rule_data. */
+GHashTable*
+cache_hash_rule_data            (GHashTable     *rule_data,
+                                 int             max_until_year)
+{
+  GHashTable *rule_hashes;
+  gpointer data[2];
+
+  rule_hashes = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+  data[0] = rule_hashes;
+  data[1] = GINT_TO_POINTER (max_until_year);
+  g_hash_table_foreach (rule_data, cache_hash_rule_array, data);
+
+  return rule_hashes;
+}
+
+
+static void
+cache_hash_rule_array           (gpointer        key,
+                                 gpointer        value,
+                                 gpointer        data)
+{
+  char *name = key;
+  GArray *rule_array = value;
+  GHashTable *rule_hashes = ((gpointer*) data)[0];
+  int max_until_year = GPOINTER_TO_INT (((gpointer*) data)[1]);
+  GChecksum *checksum;
+  RuleData *rule;
+  int i;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  checksum_string (checksum, name);
+  checksum_int (checksum, max_until_year);
+  checksum_int (checksum, rule_array->len);
+
+  for (i = 0; i < rule_array->len; i++) {
+    rule = &g_array_index (rule_array, RuleData, i);
+
+    checksum_int (checksum, rule->from_year);
+    checksum_int (checksum, rule->to_year);
+    checksum_string (checksum, rule->type);
+    checksum_int (checksum, rule->in_month);
+    checksum_int (checksum, rule->on_day_code);
+    checksum_int (checksum, rule->on_day_number);
+    checksum_int (checksum, rule->on_day_weekday);
+    checksum_int (checksum, rule->at_time_seconds);
+    checksum_int (checksum, rule->at_time_code);
+    checksum_int (checksum, rule->save_seconds);
+    checksum_string (checksum, rule->letter_s);
+  }
+
+  g_hash_table_insert (rule_hashes, name,
+                       g_strdup (g_checksum_get_string (checksum)));
+
+  g_checksum_free (checksum);
+}
+
+
+/* This returns the cache key of the VTIMEZONE file for the given zone or
+   Link. The returned string should be freed with g_free(). */
+char*
+cache_zone_key                  (VzicFlavor     *flavor,
+                                 ZoneData       *zone,
+                                 char           *zone_name,
+                                 char           *zone_aliasof,
+                                 ZoneDescription *zone_desc,
+                                 GHashTable     *rule_hashes,
+                                 char           *tzid_prefix)
+{
+  GChecksum *checksum;
+  ZoneLineData *zone_line;
+  char *key;
+  int i;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  /* The build of vzic and the options that affect the output. */
+  checksum_string (checksum, VZIC_BUILD_ID);
+  checksum_string (checksum, PRODUCT_ID);
+  checksum_string (checksum, tzid_prefix);
+  checksum_int (checksum, flavor->pure_output);
+  checksum_int (checksum, VzicNoRRules);
+  checksum_int (checksum, VzicNoRDates);
+  checksum_int (checksum, flavor->dump_tzdata_artifacts);
+  checksum_string (checksum, VzicUrlPrefix);
+
+  /* Without --reproducible we reuse the LAST-MODIFIED of the run that made
+     the cached file, as any time will do. */
+  checksum_int (checksum, VzicReproducible);
+  if (VzicReproducible)
+    checksum_int64 (checksum, VzicTimestamp);
+
+  checksum_string (checksum, zone_name);
+  checksum_string (checksum, zone_aliasof);
+
+  checksum_int (checksum, zone_desc != NULL);
+  if (zone_desc) {
+    g_checksum_update (checksum, (guchar*) zone_desc->country_code, 2);
+    for (i = 0; i < 3; i++) {
+      checksum_int (checksum, zone_desc->latitude[i]);
+      checksum_int (checksum, zone_desc->longitude[i]);
+    }
+    checksum_string (checksum, zone_desc->comment);
+  }
+
+  checksum_int (checksum, zone->zone_line_data->len);
+  for (i = 0; i < zone->zone_line_data->len; i++) {
+    zone_line = &g_array_index (zone->zone_line_data, ZoneLineData, i);
+
+    checksum_int (checksum, zone_line->stdoff_seconds);
+    checksum_string (checksum, zone_line->rules);
+    if (zone_line->rules)
+      checksum_string (checksum, g_hash_table_lookup (rule_hashes,
+                                                      zone_line->rules));
+    checksum_int (checksum, zone_line->save_seconds);
+    checksum_string (checksum, zone_line->format);
+
+    /* The UNTIL fields aren't initialized if there is no UNTIL time. */
+    checksum_int (checksum, zone_line->until_set);
+    if (zone_line->until_set) {
+      checksum_int (checksum, zone_line->until_year);
+      checksum_int (checksum, zone_line->until_month);
+      checksum_int (checksum, zone_line->until_day_code);
+      checksum_int (checksum, zone_line->until_day_number);
+      checksum_int (checksum, zone_line->until_day_weekday);
+      checksum_int (checksum, zone_line->until_time_seconds);
+      checksum_int (checksum, zone_line->until_time_code);
+    }
+  }
+
+  key = g_strdup (g_checksum_get_string (checksum));
+
+  g_checksum_free (checksum);
+
+  return key;
+}
+
+
+/* If the cache has a file with the given key, this copies it to filename and
+   returns TRUE. It also updates the modification time of the cached file, so
+   cache_prune() knows it is still used. */
+gboolean
+cache_fetch                     (char           *key,
+                                 char           *filename)
+{
+  char *cache_file, *contents;
+  gsize length;
+
+  cache_file = cache_filename (key);
+  if (!g_file_get_contents (cache_file, &contents, &length, NULL)) {
+    g_free (cache_file);
+    return FALSE;
+  }
+  utime (cache_file, NULL);
+  g_free (cache_file);
+
+  write_file_atomically (filename, contents, length);
+
+  g_free (contents);
+
+  return TRUE;
+}
+
+
+/* This stores the contents of the file we have just output in the cache. The
+   cache file is written to a temporary file and renamed, so other threads or
+   processes never see a partial file. If it fails we just output a warning,
+   since the cache is only an optimization. */
+void
+cache_store                     (char           *key,
+                                 const char     *contents,
+                                 gsize           length)
+{
+  char *cache_file;
+  GError *error = NULL;
+
+  cache_file = cache_filename (key);
+  if (!g_file_set_contents (cache_file, contents, length, &error)) {
+    fprintf (stderr, "WARNING: Couldn't write cache file: %s\n",
+             error->message);
+    g_error_free (error);
+  }
+
+  g_free (cache_file);
+}
+
+
+/* This deletes the cached files that haven't been used for
+   CACHE_MAX_AGE_DAYS. It is called at the end of each run, after the files
+   we have used have had their modification times updated. */
+void
+cache_prune                     (void)
+{
+  GDir *dir;
+  const char *name;
+  char *cache_file;
+  struct stat buf;
+  time_t min_time;
+  GError *error = NULL;
+
+  dir = g_dir_open (VzicCacheDir, 0, &error);
+  if (!dir) {
+    fprintf (stderr, "WARNING: Couldn't read cache directory: %s\n",
+             error->message);
+    g_error_free (error);
+    return;
+  }
+
+  min_time = time (NULL) - CACHE_MAX_AGE_DAYS * 24 * 60 * 60;
+
+  while ((name = g_dir_read_name (dir))) {
+    if (!cache_is_cache_file (name))
+      continue;
+
+    cache_file = g_strdup_printf ("%s/%s", VzicCacheDir, name);
+    if (stat (cache_file, &buf) == 0 && buf.st_mtime < min_time)
+      unlink (cache_file);
+    g_free (cache_file);
+  }
+
+  g_dir_close (dir);
+}
+
+
+/* The ints and strings are hashed in binary form, since the cache is never
+   shared with other machines. */
+static void
+checksum_int                    (GChecksum      *checksum,
+                                 int             value)
+{
+  g_checksum_update (checksum, (guchar*) &value, sizeof (value));
+}
+
+
+static void
+checksum_int64                  (GChecksum      *checksum,
+                                 gint64          value)
+{
+  g_checksum_update (checksum, (guchar*) &value, sizeof (value));
+}
+
+
+/* We include the terminating '\0' so that adjacent strings can't run into
+   each other, and hash NULL differently from "". */
+static void
+checksum_string                 (GChecksum      *checksum,
+                                 char           *value)
+{
+  checksum_int (checksum, value != NULL);
+  if (value)
+    g_checksum_update (checksum, (guchar*) value, strlen (value) + 1);
+}
+
+
+static char*
+cache_filename                  (char           *key)
+{
+  return g_strdup_printf ("%s/%s.ics", VzicCacheDir, key);
+}
+
+
+/* This returns TRUE if the name is that of a cached file, i.e. a key followed
+   by ".ics", so we never delete anything else in the cache directory. */
+static gboolean
+cache_is_cache_file             (const char     *name)
+{
+  int i;
+
+  for (i = 0; i < CACHE_KEY_LENGTH; i++) {
+    if (!g_ascii_isxdigit (name[i]))
+      return FALSE;
+  }
+
+  return !strcmp (name + CACHE_KEY_LENGTH, ".ics");
+}
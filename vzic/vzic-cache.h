@@ -0,0 +1,56 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * These functions implement the --cache-dir build cache. Each VTIMEZONE file
+ * we output is stored in the cache directory under a hash of everything that
+ * can affect its contents, so when we run again on a new release of the Olson
+ * files we can simply copy the files of the zones that haven't changed. The
+ * files that haven't been used for a while are deleted by cache_prune().
+ */
+
+#ifndef _VZIC_CACHE_H_
+#define _VZIC_CACHE_H_
+
+#include <glib.h>
+
+GHashTable*     cache_hash_rule_data            (GHashTable     *rule_data,
+                                                 int             max_until_year);
+
+char*           cache_zone_key                  (VzicFlavor     *flavor,
+                                                 ZoneData       *zone,
+                                                 char           *zone_name,
+                                                 char           *zone_aliasof,
+                                                 ZoneDescription *zone_desc,
+                                                 GHashTable     *rule_hashes,
+                                                 char           *tzid_prefix);
+
+gboolean        cache_fetch                     (char           *key,
+                                                 char           *filename);
+void            cache_store                     (char           *key,
+                                                 const char     *contents,
+                                                 gsize           length);
+void            cache_prune                     (void);
+
+#endif /* _VZIC_CACHE_H_ */
@@ -0,0 +1,211 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --dump-changes backend. It outputs the changes of each zone and Link
+ * alias up to MAX_CHANGES_YEAR into the ChangesVzic directory, so they can
+ * be compared with the changes calculated by test-vzic from the VTIMEZONE
+ * files. See the README.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vzic.h"
+#include "vzic-backend.h"
+#include "vzic-output.h"
+#include "vzic-time.h"
+
+
+/* The year we go up to when dumping the list of timezone changes (used
+   for testing & debugging). */
+#define MAX_CHANGES_YEAR        2030
+
+
+static gboolean changes_is_enabled              (VzicFlavor     *flavor);
+static void     changes_output_zone             (VzicOutputZone *zone);
+static void     output_changes_file             (VzicOutputZone *zone,
+                                                 char           *zone_name,
+                                                 VzicZoneTransitions *transitions);
+static void     dump_changes                    (FILE           *fp,
+                                                 char           *zone_name,
+                                                 VzicZoneTransitions *transitions);
+static gboolean dump_change                     (FILE           *fp,
+                                                 char           *zone_name,
+                                                 gint64          utc_time,
+                                                 int             walloff);
+
+
+VzicBackend VzicChangesBackend = {
+  "ChangesVzic",
+  changes_is_enabled,
+  changes_output_zone,
+  NULL
+};
+
+
+static gboolean
+changes_is_enabled              (VzicFlavor     *flavor)
+{
+  return VzicDumpChanges;
+}
+
+
+static void
+changes_output_zone             (VzicOutputZone *zone)
+{
+  VzicZoneTransitions *transitions;
+  GList *elem;
+
+  transitions = output_zone_get_transitions (zone);
+
+  output_changes_file (zone, zone->zone->zone_name, transitions);
+  for (elem = zone->links; elem; elem = elem->next)
+    output_changes_file (zone, elem->data, transitions);
+}
+
+
+/* This outputs the changes file of a zone or Link alias. */
+static void
+output_changes_file             (VzicOutputZone *zone,
+                                 char           *zone_name,
+                                 VzicZoneTransitions *transitions)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  FILE *fp;
+
+  if (!output_zone_filename (zone, &VzicChangesBackend, zone_name, "",
+                             filename))
+    return;
+
+  fp = fopen (filename, "w");
+  if (!fp) {
+    fprintf (stderr, "Couldn't create file: %s\n", filename);
+    exit (1);
+  }
+
+  dump_changes (fp, zone_name, transitions);
+
+  if (ferror (fp) || fclose (fp) != 0) {
+    fprintf (stderr, "Error writing file: %s\n", filename);
+    exit (1);
+  }
+}
+
+
+static void
+dump_changes                    (FILE           *fp,
+                                 char           *zone_name,
+                                 VzicZoneTransitions *transitions)
+{
+  VzicTransition *transition;
+  VzicRecurrence *recurrence, *recurrence2;
+  int i, year_offset, year;
+
+  for (i = 0; i < transitions->num_transitions; i++) {
+    transition = &transitions->transitions[i];
+    if (!dump_change (fp, zone_name, transition->utc_time,
+                      transition->walloff))
+      return;
+  }
+
+  /* Now see if the zone ends with a pair of recurring changes. */
+  if (transitions->num_recurrences < 2)
+    return;
+
+  recurrence = &transitions->recurrences[transitions->num_recurrences - 2];
+  recurrence2 = &transitions->recurrences[transitions->num_recurrences - 1];
+
+  year_offset = 1;
+  for (;;) {
+    year = recurrence->first_year + year_offset;
+    if (year > MAX_CHANGES_YEAR)
+      break;
+    dump_change (fp, zone_name, output_recurrence_time (recurrence, year),
+                 recurrence->walloff);
+
+    year = recurrence2->first_year + year_offset;
+    if (year > MAX_CHANGES_YEAR)
+      break;
+    dump_change (fp, zone_name, output_recurrence_time (recurrence2, year),
+                 recurrence2->walloff);
+
+    year_offset++;
+  }
+}
+
+
+/* This outputs one change, and returns FALSE if it is after
+   MAX_CHANGES_YEAR. */
+static gboolean
+dump_change                     (FILE           *fp,
+                                 char           *zone_name,
+                                 gint64          utc_time,
+                                 int             walloff)
+{
+  char offset_buffer[FORMAT_TIME_BUFFER_SIZE];
+  static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  gint64 days;
+  int year, month, day, seconds;
+
+  /* Output format is:
+
+        Zone-Name [tab] Date [tab] Time [tab] UTC-Offset
+
+     The Date and Time fields specify the time change in UTC.
+
+     The UTC Offset is for local (wall-clock) time. It is the amount of time
+     to add to UTC to get local time.
+  */
+
+  if (utc_time == G_MININT64) {
+    fprintf (fp, "%s\t 1 Jan 0001\t 0:00:00", zone_name);
+  } else if (utc_time == G_MAXINT64) {
+    fprintf (stderr, "Maximum year found in change time\n");
+    exit (1);
+  } else {
+    days = utc_time / (24 * 60 * 60);
+    seconds = utc_time % (24 * 60 * 60);
+    if (seconds < 0) {
+      days--;
+      seconds += 24 * 60 * 60;
+    }
+    time_civil_from_days (days, &year, &month, &day);
+
+    if (year > MAX_CHANGES_YEAR)
+      return FALSE;
+
+    fprintf (fp, "%s\t%2i %s %04i\t%2i:%02i:%02i", zone_name,
+             day, months[month], year, seconds / 3600, (seconds % 3600) / 60,
+             seconds % 60);
+  }
+
+  fprintf (fp, "\t%s\r\n", format_tz_offset (offset_buffer, walloff, FALSE));
+
+  return TRUE;
+}
@@ -35,6 +35,7 @@
 
 #include "vzic.h"
 #include "vzic-dump.h"
+#include "vzic-time.h"
 
 
 static void     dump_add_rule                   (char           *name,
@@ -53,7 +54,7 @@ dump_zone_data                  (GArray         *zone_data,
   FILE *fp;
   ZoneData *zone;
   ZoneLineData *zone_line;
-  int i, j;
+  int i, j, stdoff, save;
   gboolean output_month, output_day, output_time;
 
   fp = fopen (filename, "w");
@@ -73,14 +74,21 @@ dump_zone_data                  (GArray         *zone_data,
       if (j != 0)
         fprintf (fp, "\t\t\t");
 
-      fprintf (fp, "%s\t", dump_time (zone_line->stdoff_seconds, TIME_WALL,
-                                      FALSE));
+      /* We dump the offsets rounded as they are in the Outlook-compatible
+         output, unless --pure is used. */
+      stdoff = zone_line->stdoff_seconds;
+      save = zone_line->save_seconds;
+      if (!VzicPureOutput) {
+        stdoff = time_round_to_minute (stdoff);
+        save = time_round_to_minute (save);
+      }
+
+      fprintf (fp, "%s\t", dump_time (stdoff, TIME_WALL, FALSE));
 
       if (zone_line->rules)
         fprintf (fp, "%s\t", zone_line->rules);
-      else if (zone_line->save_seconds != 0)
-        fprintf (fp, "%s\t", dump_time (zone_line->save_seconds, TIME_WALL,
-                                        FALSE));
+      else if (save != 0)
+        fprintf (fp, "%s\t", dump_time (save, TIME_WALL, FALSE));
       else
         fprintf (fp, "-\t");
 
@@ -0,0 +1,363 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --zone-index backend. It records the zone of each zone and Link alias
+ * name of the main flavor as they are output, and index_save() then builds
+ * a minimal perfect hash of the names and writes it with the zone ids into
+ * one file. See libcyrus-tz/cyrus-tz-format.h for the format.
+ *
+ * The hash is built by "hash and displace": the names are hashed into as
+ * many buckets as there are names, and then, starting with the largest
+ * bucket, we try the seeds 1, 2, 3... until the names of the bucket all hash
+ * to different free slots. The buckets with one name just take the next
+ * free slot, which is stored as a negative displacement, and empty buckets
+ * are left as 0. The zone ids are given in the order of the zone names, so
+ * the file is the same however the zones were output.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vzic.h"
+#include "vzic-backend.h"
+#include "vzic-index.h"
+#include "vzic-output.h"
+
+#include "cyrus-tz-format.h"
+
+
+static gboolean index_is_enabled                (VzicFlavor     *flavor);
+static void     index_output_zone               (VzicOutputZone *zone);
+static void     index_add_name                  (char           *name,
+                                                 char           *zone_name);
+static gint32*  index_build_hash                (char          **names,
+                                                 int             num_names,
+                                                 int            *slots);
+static int      index_compare_buckets           (gconstpointer   a,
+                                                 gconstpointer   b,
+                                                 gpointer        data);
+static int      index_compare_names             (gconstpointer   a,
+                                                 gconstpointer   b);
+static void     index_add_string                (GString        *strings,
+                                                 GHashTable     *offsets,
+                                                 guint32         base,
+                                                 char           *string);
+static void     index_append_uint32             (GString        *out,
+                                                 guint32         value);
+
+
+/* The zone name of each zone and alias, keyed by their names. */
+static GHashTable *IndexNames           = NULL;
+G_LOCK_DEFINE_STATIC (index_names);
+
+
+VzicBackend VzicIndexBackend = {
+  NULL,
+  index_is_enabled,
+  index_output_zone,
+  NULL
+};
+
+
+static gboolean
+index_is_enabled                (VzicFlavor     *flavor)
+{
+  return VzicZoneIndexFile && flavor == &VzicFlavors[0];
+}
+
+
+static void
+index_output_zone               (VzicOutputZone *zone)
+{
+  GList *elem;
+
+  G_LOCK (index_names);
+
+  if (!IndexNames)
+    IndexNames = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        g_free);
+
+  index_add_name (zone->zone->zone_name, zone->zone->zone_name);
+  for (elem = zone->links; elem; elem = elem->next)
+    index_add_name (elem->data, zone->zone->zone_name);
+
+  G_UNLOCK (index_names);
+}
+
+
+/* The invalid names are skipped, as in zones.tab. With --serve or --watch
+   a reloaded alias may now belong to another zone, so this replaces it. */
+static void
+index_add_name                  (char           *name,
+                                 char           *zone_name)
+{
+  if (zone_name_is_valid (name))
+    g_hash_table_replace (IndexNames, g_strdup (name), g_strdup (zone_name));
+}
+
+
+void
+index_save                      (char           *filename)
+{
+  GString *out, *strings;
+  GHashTable *zone_ids, *offsets;
+  GPtrArray *zone_names;
+  GList *keys, *elem;
+  char **names, *name, *zone_name;
+  gpointer offset, zone_id;
+  gint32 *displacements;
+  guint32 strings_base;
+  int *slots;
+  int num_names, num_zones, i;
+
+  keys = IndexNames ? g_hash_table_get_keys (IndexNames) : NULL;
+  keys = g_list_sort (keys, (GCompareFunc) strcmp);
+  num_names = g_list_length (keys);
+
+  names = g_new (char*, num_names);
+  for (elem = keys, i = 0; elem; elem = elem->next, i++)
+    names[i] = elem->data;
+  g_list_free (keys);
+
+  /* The zones are numbered in the order of their names. */
+  zone_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  zone_names = g_ptr_array_new ();
+  for (i = 0; i < num_names; i++) {
+    zone_name = g_hash_table_lookup (IndexNames, names[i]);
+    if (!g_hash_table_contains (zone_ids, zone_name)) {
+      g_hash_table_add (zone_ids, zone_name);
+      g_ptr_array_add (zone_names, zone_name);
+    }
+  }
+  g_ptr_array_sort (zone_names, index_compare_names);
+  num_zones = zone_names->len;
+  for (i = 0; i < num_zones; i++)
+    g_hash_table_insert (zone_ids, g_ptr_array_index (zone_names, i),
+                         GINT_TO_POINTER (i));
+
+  /* The names go at the end. A zone's name is only missing from them if it
+     is invalid but one of its aliases isn't. */
+  strings_base = CYRUS_TZ_INDEX_HEADER_SIZE
+    + num_names * (4 + CYRUS_TZ_INDEX_SLOT_SIZE) + num_zones * 4;
+  strings = g_string_new (NULL);
+  offsets = g_hash_table_new (g_str_hash, g_str_equal);
+  for (i = 0; i < num_names; i++)
+    index_add_string (strings, offsets, strings_base, names[i]);
+  for (i = 0; i < num_zones; i++)
+    index_add_string (strings, offsets, strings_base,
+                      g_ptr_array_index (zone_names, i));
+
+  slots = g_new (int, num_names);
+  displacements = index_build_hash (names, num_names, slots);
+
+  out = g_string_sized_new (strings_base + strings->len);
+  g_string_append (out, CYRUS_TZ_INDEX_MAGIC);
+  g_string_append_c (out, CYRUS_TZ_INDEX_FORMAT_VERSION);
+  index_append_uint32 (out, num_names);
+  index_append_uint32 (out, num_zones);
+
+  for (i = 0; i < num_names; i++)
+    index_append_uint32 (out, displacements[i]);
+
+  for (i = 0; i < num_names; i++) {
+    name = names[slots[i]];
+    zone_name = g_hash_table_lookup (IndexNames, name);
+    offset = g_hash_table_lookup (offsets, name);
+    index_append_uint32 (out, GPOINTER_TO_UINT (offset));
+    zone_id = g_hash_table_lookup (zone_ids, zone_name);
+    index_append_uint32 (out, GPOINTER_TO_INT (zone_id));
+  }
+
+  for (i = 0; i < num_zones; i++) {
+    offset = g_hash_table_lookup (offsets, g_ptr_array_index (zone_names, i));
+    index_append_uint32 (out, GPOINTER_TO_UINT (offset));
+  }
+
+  g_string_append_len (out, strings->str, strings->len);
+
+  write_file_atomically (filename, out->str, out->len);
+
+  g_string_free (out, TRUE);
+  g_string_free (strings, TRUE);
+  g_hash_table_destroy (offsets);
+  g_hash_table_destroy (zone_ids);
+  g_ptr_array_free (zone_names, TRUE);
+  g_free (displacements);
+  g_free (slots);
+  g_free (names);
+}
+
+
+void
+index_free                      (void)
+{
+  if (IndexNames) {
+    g_hash_table_destroy (IndexNames);
+    IndexNames = NULL;
+  }
+}
+
+
+/* This builds the hash, setting slots to the index of the name in each slot
+   and returning the displacements. */
+static gint32*
+index_build_hash                (char          **names,
+                                 int             num_names,
+                                 int            *slots)
+{
+  GArray **buckets, *bucket;
+  gint32 *displacements;
+  char *name;
+  int *order, *bucket_slots;
+  guint32 seed, slot;
+  int i, j, k, b, free_slot = 0;
+
+  displacements = g_new0 (gint32, num_names);
+  buckets = g_new0 (GArray*, num_names);
+  order = g_new (int, num_names);
+  bucket_slots = g_new (int, num_names);
+
+  for (i = 0; i < num_names; i++) {
+    b = cyrus_tz_index_hash (0, names[i]) % num_names;
+    if (!buckets[b])
+      buckets[b] = g_array_new (FALSE, FALSE, sizeof (int));
+    g_array_append_val (buckets[b], i);
+    order[i] = i;
+    slots[i] = -1;
+  }
+
+  g_qsort_with_data (order, num_names, sizeof (int), index_compare_buckets,
+                     buckets);
+
+  for (k = 0; k < num_names; k++) {
+    b = order[k];
+    bucket = buckets[b];
+    if (!bucket || bucket->len == 1)
+      break;
+
+    for (seed = 1; ; seed++) {
+      if (seed > G_MAXINT32) {
+        fprintf (stderr, "Couldn't build the zone index\n");
+        exit (1);
+      }
+
+      for (i = 0; i < bucket->len; i++) {
+        name = names[g_array_index (bucket, int, i)];
+        slot = cyrus_tz_index_hash (seed, name) % num_names;
+        if (slots[slot] >= 0)
+          break;
+        for (j = 0; j < i && bucket_slots[j] != slot; j++)
+          ;
+        if (j < i)
+          break;
+        bucket_slots[i] = slot;
+      }
+      if (i == bucket->len)
+        break;
+    }
+
+    for (i = 0; i < bucket->len; i++)
+      slots[bucket_slots[i]] = g_array_index (bucket, int, i);
+    displacements[b] = seed;
+  }
+
+  /* The buckets with one name take the free slots. */
+  for (; k < num_names && buckets[order[k]]; k++) {
+    b = order[k];
+    while (slots[free_slot] >= 0)
+      free_slot++;
+    slots[free_slot] = g_array_index (buckets[b], int, 0);
+    displacements[b] = -free_slot - 1;
+  }
+
+  for (i = 0; i < num_names; i++) {
+    if (buckets[i])
+      g_array_free (buckets[i], TRUE);
+  }
+  g_free (buckets);
+  g_free (order);
+  g_free (bucket_slots);
+
+  return displacements;
+}
+
+
+/* This sorts the buckets by size, largest first, and then by index, so the
+   hash is the same each time. */
+static int
+index_compare_buckets           (gconstpointer   a,
+                                 gconstpointer   b,
+                                 gpointer        data)
+{
+  GArray **buckets = data;
+  int bucket1 = *(int*) a, bucket2 = *(int*) b;
+  int len1, len2;
+
+  len1 = buckets[bucket1] ? buckets[bucket1]->len : 0;
+  len2 = buckets[bucket2] ? buckets[bucket2]->len : 0;
+  if (len1 != len2)
+    return len1 > len2 ? -1 : 1;
+
+  return bucket1 - bucket2;
+}
+
+
+static int
+index_compare_names             (gconstpointer   a,
+                                 gconstpointer   b)
+{
+  return strcmp (*(char**) a, *(char**) b);
+}
+
+
+/* This appends the string to strings, if it isn't there already, and
+   records its offset in the file. */
+static void
+index_add_string                (GString        *strings,
+                                 GHashTable     *offsets,
+                                 guint32         base,
+                                 char           *string)
+{
+  if (g_hash_table_contains (offsets, string))
+    return;
+
+  g_hash_table_insert (offsets, string,
+                       GUINT_TO_POINTER (base + strings->len));
+  g_string_append_len (strings, string, strlen (string) + 1);
+}
+
+
+static void
+index_append_uint32             (GString        *out,
+                                 guint32         value)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    g_string_append_c (out, (value >> (i * 8)) & 0xFF);
+}
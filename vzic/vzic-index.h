@@ -0,0 +1,42 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --zone-index file, which maps the names of the zones and Link aliases
+ * to dense zone ids with a minimal perfect hash, for libcyrus-tz to look up
+ * the zone of a TZID in constant time. See vzic-index.c.
+ */
+
+#ifndef _VZIC_INDEX_H_
+#define _VZIC_INDEX_H_
+
+#include <glib.h>
+
+/* This writes the index of all the zones output so far, replacing the old
+   file. */
+void            index_save                      (char           *filename);
+
+void            index_free                      (void);
+
+#endif /* _VZIC_INDEX_H_ */
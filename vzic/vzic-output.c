@@ -24,15 +24,13 @@
 
 /* ALGORITHM:
  *
- * First we expand all the Rule arrays, so that each element only represents 1
- * year. If a Rule extends to infinity we expand it up to a few years past the
- * maximum UNTIL year used in any of the timezones. We do this to make sure
- * that the last of the expanded Rules (which may be infinite) is only used
- * in the last of the time periods (i.e. the last Zone line).
- *
- * The Rule arrays are also sorted by the start time (FROM + IN + ON + AT).
- * Doing all this makes it much easier to find which rules apply to which
- * periods.
+ * We step through the Rules as if each Rule line was expanded into one
+ * Rule for each year, sorted by the start time (FROM + IN + ON + AT). If a
+ * Rule extends to infinity we go up to a few years past the maximum UNTIL
+ * year used in any of the timezones. We do this to make sure that the last
+ * of the expanded Rules (which may be infinite) is only used in the last of
+ * the time periods (i.e. the last Zone line). See VzicRuleIter. Doing this
+ * makes it much easier to find which rules apply to which periods.
  *
  * For each timezone (i.e. ZoneData element), we step through each of the
  * time periods, the ZoneLineData elements (which represent each Zone line
@@ -55,6 +53,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -64,8 +63,11 @@
 
 #include "vzic.h"
 #include "vzic-output.h"
+#include "vzic-backend.h"
 
+#include "vzic-cache.h"
 #include "vzic-dump.h"
+#include "vzic-time.h"
 
 
 /* These come from the Makefile. See the comments there. */
@@ -83,10 +85,6 @@ char TZIDPrefixExpanded[1024];
 #define MIN_RRULE_OCCURRENCES   2
 
 
-/* The year we go up to when dumping the list of timezone changes (used
-   for testing & debugging). */
-#define MAX_CHANGES_YEAR        2030
-
 /* This is the maximum year that time_t value can typically hold on 32-bit
    systems. */
 #define MAX_TIME_T_YEAR         2038
@@ -98,12 +96,15 @@ char TZIDPrefixExpanded[1024];
 /* The year we use for RDATEs. */
 #define RDATE_YEAR              1970
 
+/* add_rule_changes() skips the Rule instances more than this many seconds
+   before the start of the Zone line. This is much more than any difference
+   between the UTC and local times. */
+#define RULE_WINDOW_MARGIN      (2 * 24 * 60 * 60)
+
 
 static char *WeekDays[] = { "SU", "MO", "TU", "WE", "TH", "FR", "SA" };
 static int DaysInMonth[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
 
-char *CurrentZoneName;
-
 
 typedef struct _VzicTime VzicTime;
 struct _VzicTime
@@ -148,37 +149,315 @@ struct _VzicTime
   int           prev_walloff;
 
   /* The abbreviated form of the timezone name. Note that this may not be
-     unique. */
+     unique. It is interned, so it can be compared with '=='. */
   char         *tzname;
 };
 
 
-static void     expand_and_sort_rule_array      (gpointer        key,
+/* This links each change in a zone to the next change that could be merged
+   with it, so we don't have to search the rest of the array for each
+   change. Each list holds the changes with the same signature, in order. */
+typedef struct _VzicChangeIndex VzicChangeIndex;
+struct _VzicChangeIndex
+{
+  /* The next change with the same month, day, time, TZOFFSETFROM,
+     TZOFFSETTO & TZNAME, which may be part of the same RRULE, or -1. */
+  int             *next_recurrence;
+
+  /* The next change with the same TZOFFSETFROM, TZOFFSETTO & TZNAME, which
+     can be output as an RDATE of the same component, or -1. */
+  int             *next_rdate;
+};
+
+
+/* This is one zone to be output, along with its Link aliases. */
+typedef struct _VzicOutputJob VzicOutputJob;
+struct _VzicOutputJob
+{
+  ZoneData        *zone;
+  ZoneDescription *zone_desc;
+
+  /* The names of the Link aliases of the zone. */
+  GList           *links;
+
+  /* A rough estimate of how much work it takes to output the zone, i.e. the
+     number of Zone lines plus the number of Rule instances during them. */
+  int              cost;
+};
+
+
+/* This holds the VTIMEZONE data of a zone, which is calculated once and
+   shared by its Link aliases. The aliases only have different TZID,
+   TZID-ALIAS-OF, TZURL and X-LIC-LOCATION properties, so we keep the other
+   properties in 2 parts, which go either side of the TZURL. See
+   output_vcalendar(). */
+typedef struct _VzicZoneOutput VzicZoneOutput;
+struct _VzicZoneOutput
+{
+  /* The TZUNTIL, COMMENT and LAST-MODIFIED properties. */
+  GString         *properties;
+
+  /* The X-PROLEPTIC-TZNAME property, the components & END:VTIMEZONE. */
+  GString         *components;
+};
+
+
+/* This holds the changes and transitions of a zone while it is output in
+   each flavor, so they are only calculated once. The Outlook-compatible
+   flavors round the UTC offsets of the Zone lines, so there is one set for
+   the flavors that round the offsets and one for those that don't. */
+struct _VzicZoneCalculation
+{
+  GHashTable      *rule_data;
+  int              max_until_year;
+
+  /* With --cache-dir, this maps each set of Rules to the hash of its data. */
+  GHashTable      *rule_hashes;
+
+  /* The changes and transitions without and with the UTC offsets rounded,
+     or NULL if they haven't been needed yet. */
+  GArray          *changes[2];
+  VzicZoneTransitions *transitions[2];
+};
+
+
+/* This is shared by all the threads outputting zones. Each thread takes the
+   next job from the array whenever it is idle, so a thread that gets a few
+   expensive zones doesn't hold up the others. */
+typedef struct _VzicOutputQueue VzicOutputQueue;
+struct _VzicOutputQueue
+{
+  GHashTable      *rule_data;
+  int              max_until_year;
+
+  /* With --cache-dir, this maps each set of Rules to the hash of its data. */
+  GHashTable      *rule_hashes;
+
+  /* An array of VzicOutputJob. */
+  GArray          *jobs;
+
+  /* The index of the next job in the array to be taken. */
+  volatile gint    next_job;
+};
+
+
+/* This is one Rule line in a VzicRuleIter. */
+typedef struct _VzicRuleCursor VzicRuleCursor;
+struct _VzicRuleCursor
+{
+  RuleData        *rule;
+
+  /* The index of the Rule line, so that if two instances have exactly the
+     same time they always come out in the same order. */
+  int              index;
+
+  /* The FROM year of the Rule, with 'min' replaced by the year before the
+     first year used in any of the Rules. */
+  int              from_year;
+
+  /* The year of the next instance of the Rule, and of the last one. */
+  int              year;
+  int              last_year;
+
+  /* The next instance, i.e. a copy of the Rule for just that year. */
+  RuleData         instance;
+
+  /* The time of the instance in seconds since 1970, used to sort them. This
+     is in UTC, except that for Rules using wall clock time the SAVE in
+     effect before the instance still has to be subtracted. */
+  gint64           key;
+};
+
+
+/* A heap of cursors, with the one holding the next instance first. */
+typedef struct _VzicRuleHeap VzicRuleHeap;
+struct _VzicRuleHeap
+{
+  VzicRuleCursor **cursors;
+  int              len;
+};
+
+
+/* This steps through the instances of a set of Rules in time order, i.e. it
+   acts as if we had made a copy of each Rule for each year it applies to
+   and sorted them, but it only creates them as they are needed. Each Rule
+   line has a cursor holding its next instance, and the cursors are kept in
+   a heap so the first one holds the next instance in time. The cursors start
+   a couple of years before the start of the Zone line, so we only step
+   through the years that matter to it.
+
+   We only know the SAVE in effect before an instance once we have found the
+   instance before it, so the UTC times of Rules using wall clock time can't
+   be calculated in advance. But they all depend on the same SAVE, so we keep
+   those Rules in a separate heap, and subtract the SAVE of the last instance
+   returned when comparing the first cursors of the 2 heaps. */
+typedef struct _VzicRuleIter VzicRuleIter;
+struct _VzicRuleIter
+{
+  char            *name;
+
+  VzicRuleCursor  *cursors;
+  VzicRuleHeap     heap;
+  VzicRuleHeap     wall_heap;
+
+  /* Infinite Rules are expanded up to this year. */
+  int              max_year;
+
+  /* The STDOFF of the Zone line, used to convert the Rule times to UTC. */
+  int              stdoff;
+
+  /* The SAVE of the last instance returned, and its key, which is used to
+     check for Rules at the same time. */
+  int              save_seconds;
+  gint64           last_key;
+  gboolean         have_last;
+};
+
+
+/* This holds all the instances of a set of Rules in time order, as returned
+   by a VzicRuleIter, for one STDOFF. The order only depends on the Rules and
+   the STDOFF, so the instances are shared by all the Zone lines using the
+   Rules with the same STDOFF, and each one only looks at the instances
+   around its own period. */
+typedef struct _VzicRuleExpansion VzicRuleExpansion;
+struct _VzicRuleExpansion
+{
+  /* The Rules and the STDOFF, which are the key in RuleExpansions. */
+  GArray          *rule_array;
+  int              stdoff;
+
+  /* The instances, and their times in seconds since 1970 in UTC. */
+  RuleData        *instances;
+  gint64          *keys;
+  int              len;
+};
+
+
+G_LOCK_DEFINE_STATIC (zone_names);
+
+/* The VzicRuleExpansions of the Olson file being output. They are freed at
+   the end of output_vtimezone_files(), since the Rules are freed then. */
+static GHashTable *RuleExpansions = NULL;
+G_LOCK_DEFINE_STATIC (rule_expansions);
+
+/* The output backends, in the order they output each zone. */
+static VzicBackend *Backends[] = {
+  &VzicIcsBackend,
+  &VzicChangesBackend,
+  &VzicTableBackend,
+  &VzicTzifBackend,
+  &VzicBundleBackend,
+  &VzicIndexBackend
+};
+
+/* The directories we know exist, so ensure_directory_exists() only has to
+   check each one once. The keys are the pathnames. */
+static GHashTable *KnownDirectories = NULL;
+G_LOCK_DEFINE_STATIC (known_directories);
+
+
+static void     check_rule_array                (gpointer        key,
                                                  gpointer        value,
                                                  gpointer        data);
-static int      rule_sort_func                  (const void     *arg1,
-                                                 const void     *arg2);
-static void     output_zone                     (char           *directory,
+static void     rule_iter_init                  (VzicRuleIter   *iter,
+                                                 char           *name,
+                                                 GArray         *rule_array,
+                                                 int             start_year,
+                                                 int             stdoff,
+                                                 int             max_until_year);
+static gboolean rule_iter_next                  (VzicRuleIter   *iter,
+                                                 RuleData       *rule);
+static void     rule_iter_free                  (VzicRuleIter   *iter);
+static void     rule_iter_set_instance          (VzicRuleIter   *iter,
+                                                 VzicRuleCursor *cursor);
+static void     rule_heap_sift_down             (VzicRuleHeap   *heap,
+                                                 int             i);
+static int      rule_cursor_compare             (VzicRuleCursor *cursor1,
+                                                 VzicRuleCursor *cursor2);
+static VzicRuleExpansion* get_rule_expansion    (char           *name,
+                                                 GArray         *rule_array,
+                                                 int             stdoff,
+                                                 int             max_until_year);
+static VzicRuleExpansion* expand_rules          (char           *name,
+                                                 GArray         *rule_array,
+                                                 int             stdoff,
+                                                 int             max_until_year);
+static int      rule_expansion_find             (VzicRuleExpansion *expansion,
+                                                 gint64          key);
+static guint    rule_expansion_hash             (gconstpointer   key);
+static gboolean rule_expansion_equal            (gconstpointer   key1,
+                                                 gconstpointer   key2);
+static void     rule_expansion_free             (gpointer        data);
+static void     add_output_job                  (GArray         *jobs,
                                                  ZoneData       *zone,
+                                                 GList          *links,
+                                                 ZoneDescription *zone_desc,
+                                                 GHashTable     *rule_data,
+                                                 int             max_until_year);
+static int      count_rule_instances            (GArray         *rule_array,
+                                                 int             start_year,
+                                                 int             end_year);
+static int      output_job_sort_func            (const void     *arg1,
+                                                 const void     *arg2);
+static void     create_output_directories       (VzicFlavor     *flavor,
+                                                 GArray         *jobs);
+static void     add_backend_directories         (GHashTable     *directories,
+                                                 VzicBackend    *backend,
+                                                 GArray         *jobs);
+static void     create_directories              (char           *directory,
+                                                 GHashTable     *directories);
+static void     add_zone_directories            (GHashTable     *directories,
+                                                 char           *prefix,
+                                                 char           *zone_name);
+static gboolean is_known_directory              (char           *directory);
+static void     add_known_directory             (char           *directory);
+static gpointer output_zones_thread             (gpointer        data);
+static void     output_zone                     (ZoneData       *zone,
+                                                 GList          *links,
+                                                 ZoneDescription *zone_desc,
+                                                 GHashTable     *rule_data,
+                                                 int             max_until_year,
+                                                 GHashTable     *rule_hashes);
+static void     add_zone_names                  (ZoneData       *zone,
+                                                 GList          *links);
+static gboolean zone_is_selected                (ZoneData       *zone,
+                                                 GList          *links);
+static void     ics_output_zone                 (VzicOutputZone *zone);
+static gboolean ics_is_enabled                  (VzicFlavor     *flavor);
+static gboolean output_zone_file                (VzicOutputZone *zone,
                                                  char           *zone_name,
                                                  char           *zone_aliasof,
-                                                 ZoneDescription *zone_desc,
-                                                 GHashTable     *rule_data);
+                                                 VzicZoneOutput *zone_output,
+                                                 char           *filename);
+static void     output_link_alias               (VzicOutputZone *zone,
+                                                 char           *zone_name,
+                                                 char           *zone_filename);
 static gboolean parse_zone_name                 (char           *name,
                                                  char          **directory,
                                                  char          **subdirectory,
                                                  char          **filename);
-static void     output_zone_to_files            (ZoneData       *zone,
+static void     calculate_zone_output           (VzicOutputZone *zone,
+                                                 VzicZoneOutput *zone_output);
+static GArray*  get_zone_changes                (VzicOutputZone *zone,
+                                                 gboolean        round_offsets);
+static VzicZoneTransitions* get_zone_transitions (VzicOutputZone *zone,
+                                                 gboolean        round_offsets);
+static GArray*  calculate_zone_changes          (ZoneData       *zone,
+                                                 GHashTable     *rule_data,
+                                                 int             max_until_year,
+                                                 gboolean        round_offsets);
+static GArray*  copy_changes                    (GArray         *changes);
+static VzicZoneTransitions* calculate_zone_transitions (GArray  *changes);
+static void     zone_transitions_free           (VzicZoneTransitions *transitions);
+static void     output_vcalendar                (GString        *out,
                                                  char           *zone_name,
                                                  char           *zone_aliasof,
-                                                 ZoneDescription *zone_desc,
-                                                 GHashTable     *rule_data,
-                                                 FILE           *fp,
-                                                 FILE           *changes_fp);
+                                                 VzicZoneOutput *zone_output);
 static gboolean add_rule_changes                (ZoneLineData   *zone_line,
                                                  char           *zone_name,
                                                  GArray         *changes,
                                                  GHashTable     *rule_data,
+                                                 int             max_until_year,
                                                  VzicTime       *start,
                                                  VzicTime       *end,
                                                  char          **start_letter_s,
@@ -200,28 +479,48 @@ static gboolean times_match                     (VzicTime       *time1,
                                                  VzicTime       *time2,
                                                  int             stdoff2,
                                                  int             walloff2);
-static void     output_zone_components          (FILE           *fp,
+static void     output_zone_components          (VzicFlavor     *flavor,
+                                                 VzicZoneOutput *zone_output,
                                                  char           *name,
-                                                 char           *zone_aliasof,
                                                  ZoneDescription *zone_desc,
                                                  GArray         *changes);
 static void     set_previous_offsets            (GArray         *changes);
-static gboolean check_for_recurrence            (FILE           *fp,
+static void     change_index_init               (VzicChangeIndex *index,
+                                                 GArray         *changes);
+static void     change_index_free               (VzicChangeIndex *index);
+static void     change_index_link               (GHashTable     *last_changes,
+                                                 int            *next,
+                                                 VzicTime       *vzictime,
+                                                 int             idx);
+static guint    recurrence_signature_hash       (gconstpointer   key);
+static gboolean recurrence_signature_equal      (gconstpointer   key1,
+                                                 gconstpointer   key2);
+static guint    rdate_signature_hash            (gconstpointer   key);
+static gboolean rdate_signature_equal           (gconstpointer   key1,
+                                                 gconstpointer   key2);
+static gboolean check_for_recurrence            (GString        *out,
                                                  GArray         *changes,
+                                                 VzicChangeIndex *index,
                                                  int             idx);
-static void     check_for_rdates                (FILE           *fp,
+static void     check_for_rdates                (GString        *out,
+                                                 VzicFlavor     *flavor,
                                                  GArray         *changes,
+                                                 VzicChangeIndex *index,
                                                  int             idx);
 static gboolean timezones_match                 (char           *tzname1,
                                                  char           *tzname2);
-static int      output_component_start          (char           *buffer,
+static int      output_component_start          (GString        *out,
+                                                 VzicFlavor     *flavor,
                                                  VzicTime       *vzictime,
                                                  gboolean        output_rdate,
                                                  gboolean        use_same_tz_offset);
-static void     output_component_end            (FILE           *fp,
+static void     output_component_end            (GString        *out,
                                                  VzicTime       *vzictime);
 
 static void     vzictime_init                   (VzicTime       *vzictime);
+static gint64   vzictime_to_seconds             (VzicTime       *vzictime,
+                                                 int             stdoff,
+                                                 int             walloff);
 static int      calculate_actual_time           (VzicTime       *vzictime,
                                                  TimeCode        time_code,
                                                  int             stdoff,
@@ -243,361 +542,1077 @@ static void     fix_time_overflow               (int            *year,
                                                  int            *day,
                                                  int             day_offset);
 
-static char*    format_time                     (int             year,
+static char*    format_time                     (char           *buffer,
+                                                 int             year,
                                                  int             month,
                                                  int             day,
                                                  int             time);
-static char*    format_tz_offset                (int             tz_offset,
-                                                 gboolean        round_seconds);
-static gboolean output_rrule                    (char           *rrule_buffer,
+static gboolean output_rrule                    (VzicFlavor     *flavor,
+                                                 char           *zone_name,
+                                                 char           *rrule_buffer,
                                                  int             month,
                                                  DayCode         day_code,
                                                  int             day_number,
                                                  int             day_weekday,
                                                  int             day_offset,
                                                  char           *until);
-static gboolean output_rrule_2                  (char           *buffer,
+static gboolean output_rrule_2                  (VzicFlavor     *flavor,
+                                                 char           *zone_name,
+                                                 char           *buffer,
                                                  int             month,
                                                  int             day_number,
                                                  int             day_weekday);
 
 static char*    format_vzictime                 (VzicTime       *vzictime);
 
-static void     dump_changes                    (FILE           *fp,
-                                                 char           *zone_name,
-                                                 GArray         *changes);
-static void     dump_change                     (FILE           *fp,
-                                                 char           *zone_name,
-                                                 VzicTime       *vzictime,
-                                                 int             year);
 
 static void     expand_tzid_prefix              (void);
 
 
 void
-output_vtimezone_files          (char           *directory,
-                                 GArray         *zone_data,
+output_vtimezone_files          (GArray         *zone_data,
                                  GHashTable     *rule_data,
                                  GHashTable     *link_data,
                                  GHashTable     *zones_hash,
-                                 int             max_until_year)
+                                 int             max_until_year,
+                                 GHashTable     *selected_zones)
 {
   ZoneData *zone;
   ZoneDescription *zone_desc;
   GList *links;
-  char *link_to;
-  int i;
+  VzicOutputQueue queue;
+  GThread **threads;
+  int i, num_threads;
 
   /* Insert today's date into the TZIDs we output. */
   expand_tzid_prefix ();
 
-  /* Expand the rule data so that each entry specifies only one year, and
-     sort it so we can easily find the rules applicable to each Zone span. */
-  g_hash_table_foreach (rule_data, expand_and_sort_rule_array,
-                        GINT_TO_POINTER (max_until_year));
+  /* With --cache-dir, hash each set of Rules. We don't use the cache with
+     --dump-changes since we'd need to cache the changes files as well. */
+  queue.rule_hashes = NULL;
+  if (VzicCacheDir && !VzicDumpChanges)
+    queue.rule_hashes = cache_hash_rule_data (rule_data, max_until_year);
+
+  g_hash_table_foreach (rule_data, check_rule_array, NULL);
+
+  /* Make a list of each timezone to output, with any links to it. */
+  queue.rule_data = rule_data;
+  queue.max_until_year = max_until_year;
+  queue.jobs = g_array_new (FALSE, FALSE, sizeof (VzicOutputJob));
+  queue.next_job = 0;
 
-  /* Output each timezone. */
   for (i = 0; i < zone_data->len; i++) {
     zone = &g_array_index (zone_data, ZoneData, i);
     zone_desc = g_hash_table_lookup (zones_hash, zone->zone_name);
-    output_zone (directory, zone, zone->zone_name, NULL, zone_desc, rule_data);
-
-    /* Look for any links from this zone. */
     links = g_hash_table_lookup (link_data, zone->zone_name);
 
-    while (links) {
-      link_to = links->data;
+    /* With --zone we skip the other zones, so their Rules are never
+       expanded, but with --full-zones-tab they are still listed in
+       zones.tab. With --serve we only output the zones affected by a change,
+       but the others have already been output so they are always listed. */
+    if (!zone_is_selected (zone, links)) {
+      if (VzicFullZonesTab && VzicDumpZoneNamesAndCoords)
+        add_zone_names (zone, links);
+      continue;
+    }
+    if (selected_zones
+        && !g_hash_table_contains (selected_zones, zone->zone_name)) {
+      if (VzicDumpZoneNamesAndCoords)
+        add_zone_names (zone, links);
+      continue;
+    }
 
-      output_zone (directory, zone, link_to, zone->zone_name, zone_desc, rule_data);
+    add_output_job (queue.jobs, zone, links, zone_desc, rule_data,
+                    max_until_year);
+  }
 
-      links = links->next;
-    }
+  for (i = 0; i < VzicNumFlavors; i++)
+    create_output_directories (&VzicFlavors[i], queue.jobs);
+
+  /* Output each timezone. With --jobs we start the most expensive zones
+     first, so we don't end up waiting for one long zone at the end. The
+     threads share the (read-only) Rule data, and the RuleExpansions, which
+     are only added to under the rule_expansions lock and never change once
+     added. Each expansion only depends on its Rules and STDOFF, so the
+     output is the same whichever thread outputs each zone. */
+  num_threads = MIN (VzicJobs, queue.jobs->len);
+  if (num_threads <= 1) {
+    output_zones_thread (&queue);
+  } else {
+    qsort (queue.jobs->data, queue.jobs->len, sizeof (VzicOutputJob),
+           output_job_sort_func);
+
+    threads = g_new (GThread*, num_threads);
+    for (i = 0; i < num_threads; i++)
+      threads[i] = g_thread_new ("vzic-output", output_zones_thread, &queue);
+    for (i = 0; i < num_threads; i++)
+      g_thread_join (threads[i]);
+    g_free (threads);
   }
+
+  g_array_free (queue.jobs, TRUE);
+  if (queue.rule_hashes)
+    g_hash_table_destroy (queue.rule_hashes);
+
+  G_LOCK (rule_expansions);
+  if (RuleExpansions) {
+    g_hash_table_destroy (RuleExpansions);
+    RuleExpansions = NULL;
+  }
+  G_UNLOCK (rule_expansions);
 }
 
 
 static void
-expand_and_sort_rule_array      (gpointer        key,
-                                 gpointer        value,
-                                 gpointer        data)
+add_output_job                  (GArray         *jobs,
+                                 ZoneData       *zone,
+                                 GList          *links,
+                                 ZoneDescription *zone_desc,
+                                 GHashTable     *rule_data,
+                                 int             max_until_year)
 {
-  char *name = key;
-  GArray *rule_array = value;
-  RuleData *rule, tmp_rule;
-  int len, max_year, i, from, to, year;
-  gboolean is_infinite;
-
-  /* We expand the rule data to a year greater than any year used in a Zone
-     UNTIL value. This is so that we can easily get parts of the array to
-     use for each Zone line. */
-  max_year = GPOINTER_TO_INT (data) + 2;
-
-  /* If any of the rules apply to several years, we turn it into a single rule
-     for each year. If the Rule is infinite we go up to max_year.
-     We change the FROM field in the copies of the Rule, setting it to each
-     of the years, and set TO to FROM, except if TO was YEAR_MAXIMUM we set
-     the last TO to YEAR_MAXIMUM, so we still know the Rule is infinite. */
-  len = rule_array->len;
-  for (i = 0; i < len; i++) {
-    rule = &g_array_index (rule_array, RuleData, i);
-
-    /* None of the Rules currently use the TYPE field, but we'd better check.
-     */
-    if (rule->type) {
-      fprintf (stderr, "Rules %s has a TYPE: %s\n", name, rule->type);
-      exit (1);
+  VzicOutputJob job;
+  ZoneLineData *zone_line;
+  GArray *rule_array;
+  int i, start_year, end_year;
+
+  job.zone = zone;
+  job.zone_desc = zone_desc;
+  job.links = links;
+
+  /* add_rule_changes() only looks at the Rule instances during each Zone
+     line, since the expansions are shared and it finds its first instance
+     with a binary search. So most of the time goes on the changes it adds,
+     which is roughly the number of instances during the Zone line. */
+  job.cost = 0;
+  start_year = YEAR_MINIMUM;
+  for (i = 0; i < zone->zone_line_data->len; i++) {
+    zone_line = &g_array_index (zone->zone_line_data, ZoneLineData, i);
+    end_year = zone_line->until_set ? zone_line->until_year
+      : max_until_year + 2;
+
+    job.cost++;
+    if (zone_line->rules) {
+      rule_array = g_hash_table_lookup (rule_data, zone_line->rules);
+      if (rule_array)
+        job.cost += count_rule_instances (rule_array, start_year, end_year);
     }
 
-    if (rule->from_year != rule->to_year) {
-      from = rule->from_year;
-      to = rule->to_year;
+    start_year = end_year;
+  }
 
-      tmp_rule = *rule;
+  g_array_append_val (jobs, job);
+}
 
-      /* Flag that this is a shallow copy so we don't free anything twice. */
-      tmp_rule.is_shallow_copy = TRUE;
 
-      /* See if it is an infinite Rule. */
-      if (to == YEAR_MAXIMUM) {
-        is_infinite = TRUE;
-        to = max_year;
-        if (from < to)
-          rule->to_year = rule->from_year;
-      } else {
-        is_infinite = FALSE;
-      }
+/* This returns the number of instances of the Rules from start_year to
+   end_year. A FROM of 'min' only counts as one instance. */
+static int
+count_rule_instances            (GArray         *rule_array,
+                                 int             start_year,
+                                 int             end_year)
+{
+  RuleData *rule;
+  int i, from_year, to_year, count = 0;
 
-      /* Create a copy of the Rule for each year. */
-      for (year = from + 1; year <= to; year++) {
-        tmp_rule.from_year = year;
+  for (i = 0; i < rule_array->len; i++) {
+    rule = &g_array_index (rule_array, RuleData, i);
 
-        /* If the Rule is infinite, mark the last copy as infinite. */
-        if (year == to && is_infinite)
-          tmp_rule.to_year = YEAR_MAXIMUM;
-        else
-          tmp_rule.to_year = year;
+    from_year = MAX (rule->from_year, start_year);
+    to_year = MIN (rule->to_year, end_year);
+    if (from_year == YEAR_MINIMUM)
+      from_year = to_year;
 
-        g_array_append_val (rule_array, tmp_rule);
-      }
-    }
+    if (from_year <= to_year)
+      count += to_year - from_year + 1;
   }
 
-  /* Now sort the rules. */
-  qsort (rule_array->data, rule_array->len, sizeof (RuleData), rule_sort_func);
-
-#if 0
-  dump_rule_array (name, rule_array, stdout);
-#endif
+  return count;
 }
 
 
-/* This is used to sort the rules, after the rules have all been expanded so
-   that each one is only for one year. */
+/* This sorts the jobs so the most expensive ones come first. */
 static int
-rule_sort_func                  (const void     *arg1,
+output_job_sort_func            (const void     *arg1,
                                  const void     *arg2)
 {
-  RuleData *rule1, *rule2;
-  int time1_year, time1_month, time1_day;
-  int time2_year, time2_month, time2_day;
-  int month_diff, result;
-  VzicTime t1, t2;
-
-  rule1 = (RuleData*) arg1;
-  rule2 = (RuleData*) arg2;
-
-  time1_year = rule1->from_year;
-  time1_month = rule1->in_month;
-  time2_year = rule2->from_year;
-  time2_month = rule2->in_month;
-
-  /* If there is more that one month difference we don't need to calculate
-     the day or time. */
-  month_diff = (time1_year - time2_year) * 12 + time1_month - time2_month;
-
-  if (month_diff > 1)
-    return 1;
-  if (month_diff < -1)
-    return -1;
-
-  /* Now we have to calculate the day and time of the Rule start and the
-     VzicTime, using the given offsets. */
-  t1.year = time1_year;
-  t1.month = time1_month;
-  t1.day_code = rule1->on_day_code;
-  t1.day_number = rule1->on_day_number;
-  t1.day_weekday = rule1->on_day_weekday;
-  t1.time_code = rule1->at_time_code;
-  t1.time_seconds = rule1->at_time_seconds;
-
-  t2.year = time2_year;
-  t2.month = time2_month;
-  t2.day_code = rule2->on_day_code;
-  t2.day_number = rule2->on_day_number;
-  t2.day_weekday = rule2->on_day_weekday;
-  t2.time_code = rule2->at_time_code;
-  t2.time_seconds = rule2->at_time_seconds;
-
-  /* FIXME: We don't know the offsets yet, but I don't think any Rules are
-     close enough together that the offsets can make a difference. Should
-     check this. */
-  calculate_actual_time (&t1, TIME_WALL, 0, 0);
-  calculate_actual_time (&t2, TIME_WALL, 0, 0);
-
-  /* Now we can compare the entire time. */
-  if (t1.year > t2.year)
-    result = 1;
-  else if (t1.year < t2.year)
-    result = -1;
+  VzicOutputJob *job1, *job2;
 
-  else if (t1.month > t2.month)
-    result = 1;
-  else if (t1.month < t2.month)
-    result = -1;
+  job1 = (VzicOutputJob*) arg1;
+  job2 = (VzicOutputJob*) arg2;
 
-  else if (t1.day_number > t2.day_number)
-    result = 1;
-  else if (t1.day_number < t2.day_number)
-    result = -1;
+  if (job1->cost != job2->cost)
+    return job1->cost > job2->cost ? -1 : 1;
 
-  else if (t1.time_seconds > t2.time_seconds)
-    result = 1;
-  else if (t1.time_seconds < t2.time_seconds)
-    result = -1;
+  return strcmp (job1->zone->zone_name, job2->zone->zone_name);
+}
 
-  else {
-    printf ("WARNING: Rule dates matched.\n");
-    result = 0;
+
+/* This creates all the directories that the backends output the zones and
+   their Link aliases into before we start, so outputting each zone only has
+   to look them up in KnownDirectories. They are created relative to the
+   flavor's output directory, or the backend's own output directory, so the
+   kernel doesn't have to look up the whole path each time. */
+static void
+create_output_directories       (VzicFlavor     *flavor,
+                                 GArray         *jobs)
+{
+  GHashTable *directories, *backend_directories;
+  VzicBackend *backend;
+  int j;
+
+  directories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (j = 0; j < G_N_ELEMENTS (Backends); j++) {
+    backend = Backends[j];
+    if (!backend->is_enabled (flavor))
+      continue;
+
+    if (backend->output_dir) {
+      backend_directories = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free, NULL);
+      add_backend_directories (backend_directories, backend, jobs);
+      create_directories (backend->output_dir (flavor), backend_directories);
+      g_hash_table_destroy (backend_directories);
+    } else {
+      add_backend_directories (directories, backend, jobs);
+    }
   }
 
-  return result;
+  create_directories (flavor->output_dir, directories);
+  g_hash_table_destroy (directories);
 }
 
 
+/* This adds the directories that a backend outputs the zones into, relative
+   to its output directory, to the directories hash table. */
 static void
-output_zone                     (char           *directory,
-                                 ZoneData       *zone,
-                                 char           *zone_name,
-                                 char           *zone_aliasof,
-                                 ZoneDescription *zone_desc,
-                                 GHashTable     *rule_data)
+add_backend_directories         (GHashTable     *directories,
+                                 VzicBackend    *backend,
+                                 GArray         *jobs)
 {
-  FILE *fp, *changes_fp = NULL;
-  char output_directory[PATHNAME_BUFFER_SIZE];
-  char filename[PATHNAME_BUFFER_SIZE];
-  char changes_filename[PATHNAME_BUFFER_SIZE];
-  char *zone_directory, *zone_subdirectory, *zone_filename;
+  VzicOutputJob *job;
+  GList *elem;
+  int i;
 
-  /* Set a global for the zone_name, to be used only for debug messages. */
-  CurrentZoneName = zone_name;
+  if (backend->directory)
+    g_hash_table_insert (directories, g_strdup (backend->directory), NULL);
 
-  /* Use this to only output a particular zone. */
-#if 0
-  if (strcmp (zone_name, "Atlantic/Azores"))
-    return;
-#endif
+  for (i = 0; i < jobs->len; i++) {
+    job = &g_array_index (jobs, VzicOutputJob, i);
+    add_zone_directories (directories, backend->directory,
+                          job->zone->zone_name);
+    for (elem = job->links; elem; elem = elem->next)
+      add_zone_directories (directories, backend->directory, elem->data);
+  }
+}
 
-#if 0
-  printf ("Outputting Zone: %s\n", zone_name);
-#endif
 
-  if (!parse_zone_name (zone_name, &zone_directory, &zone_subdirectory,
-                        &zone_filename))
-    return;
+/* This creates the directories, which are relative to directory. */
+static void
+create_directories              (char           *directory,
+                                 GHashTable     *directories)
+{
+  GList *names, *elem;
+  char path[PATHNAME_BUFFER_SIZE];
+  struct stat filestat;
+  char *name;
+  int dirfd;
 
-  if (VzicDumpZoneNamesAndCoords) {
-    VzicTimeZoneNames = g_list_prepend (VzicTimeZoneNames,
-                                        g_strdup (zone_name));
+  dirfd = open (directory, O_RDONLY | O_DIRECTORY);
+  if (dirfd == -1) {
+    fprintf (stderr, "Can't open directory: %s\n", directory);
+    exit (1);
   }
 
-  if (zone_subdirectory) {
-    sprintf (output_directory, "%s/%s/%s", directory, zone_directory,
-             zone_subdirectory);
-    ensure_directory_exists (output_directory);
-    sprintf (filename, "%s/%s.ics", output_directory, zone_filename);
-
-    if (VzicDumpChanges) {
-      sprintf (output_directory, "%s/ChangesVzic/%s/%s", directory,
-               zone_directory, zone_subdirectory);
-      ensure_directory_exists (output_directory);
-      sprintf (changes_filename, "%s/%s", output_directory, zone_filename);
+  /* Sorting the names means each directory comes before its subdirectories. */
+  names = g_list_sort (g_hash_table_get_keys (directories),
+                       (GCompareFunc) strcmp);
+  for (elem = names; elem; elem = elem->next) {
+    name = elem->data;
+    if (mkdirat (dirfd, name, 0777) != 0
+        && (errno != EEXIST || fstatat (dirfd, name, &filestat, 0) != 0
+            || !S_ISDIR (filestat.st_mode))) {
+      fprintf (stderr, "Can't create directory: %s/%s\n", directory, name);
+      exit (1);
     }
+
+    sprintf (path, "%s/%s", directory, name);
+    add_known_directory (path);
   }
-  else if (zone_directory) {
-    sprintf (output_directory, "%s/%s", directory, zone_directory);
-    ensure_directory_exists (output_directory);
-    sprintf (filename, "%s/%s.ics", output_directory, zone_filename);
 
-    if (VzicDumpChanges) {
-      sprintf (output_directory, "%s/ChangesVzic/%s", directory, zone_directory);
-      ensure_directory_exists (output_directory);
-      sprintf (changes_filename, "%s/%s", output_directory, zone_filename);
-    }
+  close (dirfd);
+  g_list_free (names);
+}
+
+
+/* This adds the directories that a zone is output into, relative to the
+   output directory, to the directories hash table. prefix is the backend's
+   subdirectory, or NULL. Invalid names are output into the 'Invalid'
+   directory, which is left to output_zone_filename(), since
+   parse_zone_name() outputs the warnings. */
+static void
+add_zone_directories            (GHashTable     *directories,
+                                 char           *prefix,
+                                 char           *zone_name)
+{
+  char *p;
+
+  if (!zone_name_is_valid (zone_name))
+    return;
+
+  for (p = zone_name; *p; p++) {
+    if (*p != '/')
+      continue;
+
+    /* If the directory is already in the hash table this frees the copy. */
+    if (prefix)
+      g_hash_table_insert (directories,
+                           g_strdup_printf ("%s/%.*s", prefix,
+                                            (int) (p - zone_name), zone_name),
+                           NULL);
+    else
+      g_hash_table_insert (directories, g_strndup (zone_name, p - zone_name),
+                           NULL);
   }
-  else {
-    sprintf (output_directory, "%s", directory);
-    ensure_directory_exists (output_directory);
-    sprintf (filename, "%s/%s.ics", output_directory, zone_filename);
+}
 
-    if (VzicDumpChanges) {
-      sprintf (output_directory, "%s/ChangesVzic", directory);
-      ensure_directory_exists (output_directory);
-      sprintf (changes_filename, "%s/%s", output_directory, zone_filename);
-    }
+
+/* This is the same check as parse_zone_name(), without the warnings. */
+gboolean
+zone_name_is_valid              (char           *zone_name)
+{
+  char *p, ch;
+  int num_slashes = 0;
+
+  for (p = zone_name; (ch = *p) != 0; p++) {
+    if ((ch < 'a' || ch > 'z') && (ch < 'A' || ch > 'Z')
+        && (ch < '0' || ch > '9') && ch != '/' && ch != '_'
+        && ch != '-' && ch != '+')
+      return FALSE;
+    if (ch == '/')
+      num_slashes++;
   }
 
+  return num_slashes <= 2 ? TRUE : FALSE;
+}
+
 
-  /* Create the files. */
-  fp = fopen (filename, "w");
-  if (!fp) {
-    fprintf (stderr, "Couldn't create file: %s\n", filename);
-    exit (1);
+/* This outputs jobs from the queue until there are none left. */
+static gpointer
+output_zones_thread             (gpointer        data)
+{
+  VzicOutputQueue *queue = data;
+  VzicOutputJob *job;
+  gint i;
+
+  for (;;) {
+    i = g_atomic_int_add (&queue->next_job, 1);
+    if (i >= queue->jobs->len)
+      break;
+
+    job = &g_array_index (queue->jobs, VzicOutputJob, i);
+    output_zone (job->zone, job->links, job->zone_desc, queue->rule_data,
+                 queue->max_until_year, queue->rule_hashes);
   }
 
-  if (VzicDumpChanges) {
-    changes_fp = fopen (changes_filename, "w");
-    if (!changes_fp) {
-      fprintf (stderr, "Couldn't create file: %s\n", changes_filename);
+  return NULL;
+}
+
+
+/* None of the Rules currently use the TYPE field, but we'd better check. */
+static void
+check_rule_array                (gpointer        key,
+                                 gpointer        value,
+                                 gpointer        data)
+{
+  char *name = key;
+  GArray *rule_array = value;
+  RuleData *rule;
+  int i;
+
+  for (i = 0; i < rule_array->len; i++) {
+    rule = &g_array_index (rule_array, RuleData, i);
+
+    if (rule->type) {
+      fprintf (stderr, "Rules %s has a TYPE: %s\n", name, rule->type);
       exit (1);
     }
   }
+}
 
-  fprintf (fp, "BEGIN:VCALENDAR\r\nPRODID:");
-  fprintf (fp, ProductID, PACKAGE_VERSION);
-  fprintf (fp, "\r\nVERSION:2.0\r\n");
 
+/* This sets up the iterator to step through the instances of the Rules
+   that matter to a Zone line starting in start_year, with the given STDOFF. */
+static void
+rule_iter_init                  (VzicRuleIter   *iter,
+                                 char           *name,
+                                 GArray         *rule_array,
+                                 int             start_year,
+                                 int             stdoff,
+                                 int             max_until_year)
+{
+  VzicRuleCursor *cursor;
+  VzicRuleHeap *heap;
+  RuleData *rule;
+  int i, min_year;
+
+  iter->name = name;
+  iter->cursors = g_new (VzicRuleCursor, rule_array->len);
+  iter->heap.cursors = g_new (VzicRuleCursor*, rule_array->len);
+  iter->heap.len = 0;
+  iter->wall_heap.cursors = g_new (VzicRuleCursor*, rule_array->len);
+  iter->wall_heap.len = 0;
+  iter->stdoff = stdoff;
+  iter->have_last = FALSE;
+
+  /* We don't know which Rule is in effect before the first instance, so we
+     assume standard time. */
+  iter->save_seconds = 0;
+
+  /* We expand the infinite Rules to a year greater than any year used in a
+     Zone UNTIL value, so the last of them is only used by the last Zone
+     line. */
+  iter->max_year = max_until_year + 2;
+
+  /* Find the first year used in any of the Rules. A FROM of 'min' is taken
+     to be the year before this, which is enough to know which Rule is in
+     effect when the others start. */
+  min_year = iter->max_year;
+  for (i = 0; i < rule_array->len; i++) {
+    rule = &g_array_index (rule_array, RuleData, i);
+    if (rule->from_year != YEAR_MINIMUM)
+      min_year = MIN (min_year, rule->from_year);
+    if (rule->to_year != YEAR_MAXIMUM)
+      min_year = MIN (min_year, rule->to_year);
+  }
 
-  output_zone_to_files (zone, zone_name, zone_aliasof, zone_desc, rule_data, fp, changes_fp);
+  for (i = 0; i < rule_array->len; i++) {
+    rule = &g_array_index (rule_array, RuleData, i);
+    cursor = &iter->cursors[i];
 
-  if (ferror (fp)) {
-    fprintf (stderr, "Error writing file: %s\n", filename);
-    exit (1);
-  }
+    cursor->rule = rule;
+    cursor->index = i;
+    cursor->from_year = rule->from_year;
+    if (cursor->from_year == YEAR_MINIMUM)
+      cursor->from_year = min_year - 1;
 
-  fprintf (fp, "END:VCALENDAR\r\n");
+    if (rule->to_year == YEAR_MAXIMUM)
+      cursor->last_year = MAX (cursor->from_year, iter->max_year);
+    else
+      cursor->last_year = rule->to_year;
 
-  fclose (fp);
+    /* Skip the years well before the start of the Zone line. We only need
+       the last instance of each Rule before the Zone line starts, and any
+       which may be at the same time as the start. */
+    cursor->year = cursor->from_year;
+    if (start_year != YEAR_MINIMUM)
+      cursor->year = CLAMP (start_year - 2, cursor->from_year,
+                            cursor->last_year);
 
-  g_free (zone_directory);
-  g_free (zone_subdirectory);
-  g_free (zone_filename);
+    rule_iter_set_instance (iter, cursor);
+
+    heap = (rule->at_time_code == TIME_WALL) ? &iter->wall_heap : &iter->heap;
+    heap->cursors[heap->len++] = cursor;
+  }
+
+  for (i = iter->heap.len / 2 - 1; i >= 0; i--)
+    rule_heap_sift_down (&iter->heap, i);
+  for (i = iter->wall_heap.len / 2 - 1; i >= 0; i--)
+    rule_heap_sift_down (&iter->wall_heap, i);
 }
 
 
-/* This checks that the Zone name only uses the characters in [-+_/a-zA-Z0-9],
-   and outputs a warning if it isn't. */
+/* This copies the next instance into rule, returning FALSE if there are no
+   more. */
 static gboolean
-parse_zone_name                 (char           *name,
-                                 char          **directory,
-                                 char          **subdirectory,
-                                 char          **filename)
+rule_iter_next                  (VzicRuleIter   *iter,
+                                 RuleData       *rule)
 {
-  static int invalid_zone_num = 1;
+  VzicRuleHeap *heap;
+  VzicRuleCursor *cursor, *wall_cursor;
+  gint64 key, wall_key;
 
-  char *p, ch, *first_slash_pos = NULL, *second_slash_pos = NULL;
-  gboolean invalid = FALSE;
+  /* Find which heap has the next instance. */
+  if (iter->wall_heap.len == 0) {
+    if (iter->heap.len == 0)
+      return FALSE;
+    heap = &iter->heap;
+  } else if (iter->heap.len == 0) {
+    heap = &iter->wall_heap;
+  } else {
+    cursor = iter->heap.cursors[0];
+    wall_cursor = iter->wall_heap.cursors[0];
+    wall_key = wall_cursor->key - iter->save_seconds;
 
-  for (p = name; (ch = *p) != 0; p++) {
+    if (cursor->key < wall_key
+        || (cursor->key == wall_key && cursor->index < wall_cursor->index))
+      heap = &iter->heap;
+    else
+      heap = &iter->wall_heap;
+  }
+
+  cursor = heap->cursors[0];
+  *rule = cursor->instance;
+  key = cursor->key;
+  if (heap == &iter->wall_heap)
+    key -= iter->save_seconds;
+
+  /* Move the cursor on to the next year, or drop it if it is finished. */
+  if (cursor->year < cursor->last_year) {
+    cursor->year++;
+    rule_iter_set_instance (iter, cursor);
+  } else {
+    heap->cursors[0] = heap->cursors[--heap->len];
+  }
+  rule_heap_sift_down (heap, 0);
+
+  if (iter->have_last && iter->last_key == key)
+    printf ("WARNING: Rule dates matched.\n");
+  iter->last_key = key;
+  iter->have_last = TRUE;
+  iter->save_seconds = rule->save_seconds;
+
+  return TRUE;
+}
+
+
+static void
+rule_iter_free                  (VzicRuleIter   *iter)
+{
+  g_free (iter->cursors);
+  g_free (iter->heap.cursors);
+  g_free (iter->wall_heap.cursors);
+}
+
+
+/* This sets the instance of the Rule for the cursor's current year. The FROM
+   and TO fields are set as if we had created a Rule for each year: FROM and
+   TO are both the year, except that the first year keeps the original TO,
+   and if the Rule is infinite only the last year has a TO of YEAR_MAXIMUM,
+   so we still know the Rule is infinite. It also calculates the instance's
+   sort key, so we only have to work out its date once. */
+static void
+rule_iter_set_instance          (VzicRuleIter   *iter,
+                                 VzicRuleCursor *cursor)
+{
+  RuleData *rule = cursor->rule, *instance = &cursor->instance;
+  VzicTime t;
+
+  *instance = *rule;
+  instance->from_year = cursor->year;
+
+  if (rule->to_year == YEAR_MAXIMUM)
+    instance->to_year = (cursor->year == cursor->last_year)
+      ? YEAR_MAXIMUM : cursor->year;
+  else if (cursor->year != cursor->from_year)
+    instance->to_year = cursor->year;
+
+  /* Find the time of the instance in UTC. The wall clock times are
+     converted using the STDOFF, and the SAVE is subtracted from them in
+     rule_iter_next(). */
+  t.year = instance->from_year;
+  t.month = instance->in_month;
+  t.day_code = instance->on_day_code;
+  t.day_number = instance->on_day_number;
+  t.day_weekday = instance->on_day_weekday;
+  t.time_code = instance->at_time_code;
+  t.time_seconds = instance->at_time_seconds;
+
+  cursor->key = vzictime_to_seconds (&t, iter->stdoff, iter->stdoff);
+}
+
+
+static void
+rule_heap_sift_down             (VzicRuleHeap   *heap,
+                                 int             i)
+{
+  VzicRuleCursor *tmp;
+  int child;
+
+  for (;;) {
+    child = i * 2 + 1;
+    if (child >= heap->len)
+      break;
+
+    if (child + 1 < heap->len
+        && rule_cursor_compare (heap->cursors[child + 1],
+                                heap->cursors[child]) < 0)
+      child++;
+
+    if (rule_cursor_compare (heap->cursors[child], heap->cursors[i]) >= 0)
+      break;
+
+    tmp = heap->cursors[i];
+    heap->cursors[i] = heap->cursors[child];
+    heap->cursors[child] = tmp;
+    i = child;
+  }
+}
+
+
+static int
+rule_cursor_compare             (VzicRuleCursor *cursor1,
+                                 VzicRuleCursor *cursor2)
+{
+  if (cursor1->key != cursor2->key)
+    return (cursor1->key > cursor2->key) ? 1 : -1;
+
+  return cursor1->index - cursor2->index;
+}
+
+
+/* This returns the expansion of the Rules for the STDOFF, expanding them if
+   no other Zone line has used them with the same STDOFF yet. */
+static VzicRuleExpansion*
+get_rule_expansion              (char           *name,
+                                 GArray         *rule_array,
+                                 int             stdoff,
+                                 int             max_until_year)
+{
+  VzicRuleExpansion tmp_expansion, *expansion, *new_expansion;
+
+  tmp_expansion.rule_array = rule_array;
+  tmp_expansion.stdoff = stdoff;
+
+  G_LOCK (rule_expansions);
+  if (!RuleExpansions)
+    RuleExpansions = g_hash_table_new_full (rule_expansion_hash,
+                                            rule_expansion_equal,
+                                            NULL, rule_expansion_free);
+  expansion = g_hash_table_lookup (RuleExpansions, &tmp_expansion);
+  G_UNLOCK (rule_expansions);
+
+  if (expansion)
+    return expansion;
+
+  /* We expand the Rules without holding the lock, so the other threads can
+     carry on. If another thread has expanded the same Rules in the meantime
+     we use its expansion, so every Zone line uses the same one. */
+  new_expansion = expand_rules (name, rule_array, stdoff, max_until_year);
+
+  G_LOCK (rule_expansions);
+  expansion = g_hash_table_lookup (RuleExpansions, &tmp_expansion);
+  if (!expansion) {
+    expansion = new_expansion;
+    g_hash_table_insert (RuleExpansions, expansion, expansion);
+    new_expansion = NULL;
+  }
+  G_UNLOCK (rule_expansions);
+
+  if (new_expansion)
+    rule_expansion_free (new_expansion);
+
+  return expansion;
+}
+
+
+static VzicRuleExpansion*
+expand_rules                    (char           *name,
+                                 GArray         *rule_array,
+                                 int             stdoff,
+                                 int             max_until_year)
+{
+  VzicRuleExpansion *expansion;
+  VzicRuleIter iter;
+  GArray *instances, *keys;
+  RuleData rule;
+
+  instances = g_array_new (FALSE, FALSE, sizeof (RuleData));
+  keys = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  rule_iter_init (&iter, name, rule_array, YEAR_MINIMUM, stdoff,
+                  max_until_year);
+  while (rule_iter_next (&iter, &rule)) {
+    g_array_append_val (instances, rule);
+    g_array_append_val (keys, iter.last_key);
+  }
+  rule_iter_free (&iter);
+
+  expansion = g_new (VzicRuleExpansion, 1);
+  expansion->rule_array = rule_array;
+  expansion->stdoff = stdoff;
+  expansion->len = instances->len;
+  expansion->instances = (RuleData*) g_array_free (instances, FALSE);
+  expansion->keys = (gint64*) g_array_free (keys, FALSE);
+
+  return expansion;
+}
+
+
+/* This returns the index of the first instance at or after the given time,
+   or the number of instances if there are none. */
+static int
+rule_expansion_find             (VzicRuleExpansion *expansion,
+                                 gint64          key)
+{
+  int lower = 0, upper = expansion->len, middle;
+
+  while (lower < upper) {
+    middle = lower + (upper - lower) / 2;
+    if (expansion->keys[middle] < key)
+      lower = middle + 1;
+    else
+      upper = middle;
+  }
+
+  return lower;
+}
+
+
+static guint
+rule_expansion_hash             (gconstpointer   key)
+{
+  const VzicRuleExpansion *expansion = key;
+
+  return g_direct_hash (expansion->rule_array) ^ (guint) expansion->stdoff;
+}
+
+
+static gboolean
+rule_expansion_equal            (gconstpointer   key1,
+                                 gconstpointer   key2)
+{
+  const VzicRuleExpansion *expansion1 = key1, *expansion2 = key2;
+
+  return expansion1->rule_array == expansion2->rule_array
+    && expansion1->stdoff == expansion2->stdoff;
+}
+
+
+static void
+rule_expansion_free             (gpointer        data)
+{
+  VzicRuleExpansion *expansion = data;
+
+  g_free (expansion->instances);
+  g_free (expansion->keys);
+  g_free (expansion);
+}
+
+
+/* This outputs a zone and its Link aliases with each backend, in each
+   flavor. The changes and transitions of the zone are only calculated once,
+   when they are first needed (if all the files are in the cache they aren't
+   needed at all), and are shared by the flavors and backends, so the Rules
+   are only expanded once for the flavors that round the UTC offsets and once
+   for those that don't. */
+static void
+output_zone                     (ZoneData       *zone,
+                                 GList          *links,
+                                 ZoneDescription *zone_desc,
+                                 GHashTable     *rule_data,
+                                 int             max_until_year,
+                                 GHashTable     *rule_hashes)
+{
+  VzicZoneCalculation calculation;
+  VzicOutputZone output_zone;
+  VzicBackend *backend;
+  int i, j;
+
+#if 0
+  printf ("Outputting Zone: %s\n", zone->zone_name);
+#endif
+
+  calculation.rule_data = rule_data;
+  calculation.max_until_year = max_until_year;
+  calculation.rule_hashes = rule_hashes;
+  for (i = 0; i < 2; i++) {
+    calculation.changes[i] = NULL;
+    calculation.transitions[i] = NULL;
+  }
+
+  output_zone.zone = zone;
+  output_zone.zone_desc = zone_desc;
+  output_zone.links = links;
+  output_zone.calculation = &calculation;
+
+  for (i = 0; i < VzicNumFlavors; i++) {
+    output_zone.flavor = &VzicFlavors[i];
+
+    for (j = 0; j < G_N_ELEMENTS (Backends); j++) {
+      backend = Backends[j];
+      if (backend->is_enabled (output_zone.flavor))
+        backend->output_zone (&output_zone);
+    }
+  }
+
+  if (VzicDumpZoneNamesAndCoords)
+    add_zone_names (zone, links);
+
+  for (i = 0; i < 2; i++) {
+    if (calculation.changes[i])
+      g_array_free (calculation.changes[i], TRUE);
+    if (calculation.transitions[i])
+      zone_transitions_free (calculation.transitions[i]);
+  }
+}
+
+
+/* This adds a zone and its Link aliases to VzicTimeZoneNames, for the
+   zones.tab file, skipping any invalid names. */
+static void
+add_zone_names                  (ZoneData       *zone,
+                                 GList          *links)
+{
+  GList *elem;
+
+  G_LOCK (zone_names);
+
+  if (zone_name_is_valid (zone->zone_name))
+    VzicTimeZoneNames = g_list_prepend (VzicTimeZoneNames, zone->zone_name);
+
+  for (elem = links; elem; elem = elem->next) {
+    if (zone_name_is_valid (elem->data))
+      VzicTimeZoneNames = g_list_prepend (VzicTimeZoneNames, elem->data);
+  }
+
+  G_UNLOCK (zone_names);
+}
+
+
+/* With --zone, this returns TRUE if the zone or any of its Link aliases
+   matches one of the patterns. The zone is then output with all its
+   aliases, since they share its data. */
+static gboolean
+zone_is_selected                (ZoneData       *zone,
+                                 GList          *links)
+{
+  GList *elem;
+
+  if (zone_name_is_selected (zone->zone_name))
+    return TRUE;
+
+  for (elem = links; elem; elem = elem->next) {
+    if (zone_name_is_selected (elem->data))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/*
+ * The iCalendar backend, which outputs the VTIMEZONE files.
+ */
+
+VzicBackend VzicIcsBackend = {
+  NULL,
+  ics_is_enabled,
+  ics_output_zone,
+  NULL
+};
+
+
+static gboolean
+ics_is_enabled                  (VzicFlavor     *flavor)
+{
+  return TRUE;
+}
+
+
+/* This outputs the VTIMEZONE files of a zone and its Link aliases. The
+   VTIMEZONE data is only calculated once, when it is first needed, and then
+   copied into each file. */
+static void
+ics_output_zone                 (VzicOutputZone *zone)
+{
+  VzicZoneOutput zone_output;
+  char zone_filename[PATHNAME_BUFFER_SIZE];
+  gboolean output_zone_ok;
+  GList *elem;
+
+  zone_output.properties = NULL;
+  zone_output.components = NULL;
+
+  output_zone_ok = output_zone_file (zone, zone->zone->zone_name, NULL,
+                                     &zone_output, zone_filename);
+
+  for (elem = zone->links; elem; elem = elem->next) {
+    if (VzicLinkAliases == LINK_ALIASES_COPY || !output_zone_ok)
+      output_zone_file (zone, elem->data, zone->zone->zone_name,
+                        &zone_output, NULL);
+    else
+      output_link_alias (zone, elem->data, zone_filename);
+  }
+
+  if (zone_output.components) {
+    g_string_free (zone_output.properties, TRUE);
+    g_string_free (zone_output.components, TRUE);
+  }
+}
+
+
+/* This outputs the VTIMEZONE file of a zone or Link alias, calculating the
+   VTIMEZONE data if it hasn't been done already. If filename isn't NULL the
+   name of the file is copied into it. It returns FALSE if the zone name is
+   invalid. */
+static gboolean
+output_zone_file                (VzicOutputZone *zone,
+                                 char           *zone_name,
+                                 char           *zone_aliasof,
+                                 VzicZoneOutput *zone_output,
+                                 char           *filename)
+{
+  char output_filename[PATHNAME_BUFFER_SIZE];
+  GHashTable *rule_hashes = zone->calculation->rule_hashes;
+  char *cache_key = NULL;
+  GString *out;
+
+  if (!output_zone_filename (zone, &VzicIcsBackend, zone_name, ".ics",
+                             output_filename))
+    return FALSE;
+
+  if (filename)
+    strcpy (filename, output_filename);
+
+  /* If the zone hasn't changed since it was cached, just copy the file. */
+  if (rule_hashes) {
+    cache_key = cache_zone_key (zone->flavor, zone->zone, zone_name,
+                                zone_aliasof, zone->zone_desc, rule_hashes,
+                                TZIDPrefixExpanded);
+    if (cache_fetch (cache_key, output_filename)) {
+      g_free (cache_key);
+      return TRUE;
+    }
+  }
+
+  if (!zone_output->components)
+    calculate_zone_output (zone, zone_output);
+
+  /* We output the entire VCALENDAR into a buffer, and then write it out in
+     one go. */
+  out = g_string_sized_new (zone_output->properties->len
+                            + zone_output->components->len + 1024);
+
+  output_vcalendar (out, zone_name, zone_aliasof, zone_output);
+
+  write_file_atomically (output_filename, out->str, out->len);
+
+  if (cache_key) {
+    cache_store (cache_key, out->str, out->len);
+    g_free (cache_key);
+  }
+
+  g_string_free (out, TRUE);
+
+  return TRUE;
+}
+
+
+/* With --link-aliases, this outputs a Link alias as a hard or symbolic link
+   to the zone's file, rather than a copy with its own TZID. Like the files,
+   the link is created with a temporary name and then renamed. */
+static void
+output_link_alias               (VzicOutputZone *zone,
+                                 char           *zone_name,
+                                 char           *zone_filename)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  char *tmp_filename, *p;
+  GString *target;
+  int result;
+
+  if (!output_zone_filename (zone, &VzicIcsBackend, zone_name, ".ics",
+                             filename))
+    return;
+
+  tmp_filename = g_strdup_printf ("%s.%i.tmp", filename, (int) getpid ());
+
+  /* A link left behind by a crashed run with the same process ID would make
+     link() and symlink() fail, so we remove it first. */
+  unlink (tmp_filename);
+
+  if (VzicLinkAliases == LINK_ALIASES_HARD) {
+    result = link (zone_filename, tmp_filename);
+  } else {
+    /* We use a relative path, so the output directory can be moved. */
+    target = g_string_new (NULL);
+    for (p = zone_name; *p; p++) {
+      if (*p == '/')
+        g_string_append (target, "../");
+    }
+    g_string_append (target,
+                     zone_filename + strlen (zone->flavor->output_dir) + 1);
+
+    result = symlink (target->str, tmp_filename);
+
+    g_string_free (target, TRUE);
+  }
+
+  if (result != 0) {
+    fprintf (stderr, "Couldn't create link: %s (%s)\n", tmp_filename,
+             strerror (errno));
+    exit (1);
+  }
+
+  if (rename (tmp_filename, filename) != 0) {
+    fprintf (stderr, "Couldn't rename file: %s\n", tmp_filename);
+    exit (1);
+  }
+
+  /* If the alias was already a hard link to the zone's file, rename() does
+     nothing, so we have to remove the temporary link ourselves. */
+  unlink (tmp_filename);
+
+  g_free (tmp_filename);
+}
+
+
+gboolean
+output_zone_filename            (VzicOutputZone *zone,
+                                 VzicBackend    *backend,
+                                 char           *zone_name,
+                                 char           *suffix,
+                                 char           *filename)
+{
+  char output_directory[PATHNAME_BUFFER_SIZE];
+  char *directory = zone->flavor->output_dir;
+  char *zone_directory, *zone_subdirectory, *zone_filename;
+  int len;
+
+  if (!parse_zone_name (zone_name, &zone_directory, &zone_subdirectory,
+                        &zone_filename))
+    return FALSE;
+
+  if (backend->output_dir)
+    directory = backend->output_dir (zone->flavor);
+
+  if (backend->directory)
+    len = sprintf (output_directory, "%s/%s", directory, backend->directory);
+  else
+    len = sprintf (output_directory, "%s", directory);
+
+  if (zone_subdirectory)
+    sprintf (output_directory + len, "/%s/%s", zone_directory,
+             zone_subdirectory);
+  else if (zone_directory)
+    sprintf (output_directory + len, "/%s", zone_directory);
+
+  ensure_directory_exists (output_directory);
+  sprintf (filename, "%s/%s%s", output_directory, zone_filename, suffix);
+
+  g_free (zone_directory);
+  g_free (zone_subdirectory);
+  g_free (zone_filename);
+
+  return TRUE;
+}
+
+
+/* This checks that the Zone name only uses the characters in [-+_/a-zA-Z0-9],
+   and outputs a warning if it isn't. */
+static gboolean
+parse_zone_name                 (char           *name,
+                                 char          **directory,
+                                 char          **subdirectory,
+                                 char          **filename)
+{
+  static int invalid_zone_num = 1;
+
+  char *p, ch, *first_slash_pos = NULL, *second_slash_pos = NULL;
+  gboolean invalid = FALSE;
+
+  for (p = name; (ch = *p) != 0; p++) {
     if ((ch < 'a' || ch > 'z') && (ch < 'A' || ch > 'Z')
         && (ch < '0' || ch > '9') && ch != '/' && ch != '_'
         && ch != '-' && ch != '+') {
@@ -628,20 +1643,20 @@ parse_zone_name                 (char           *name,
 #endif
   if (invalid) {
     *directory = g_strdup ("Invalid");
-    *filename = g_strdup_printf ("Zone%i", invalid_zone_num++);
+    *filename = g_strdup_printf ("Zone%i",
+                                 g_atomic_int_add (&invalid_zone_num, 1));
   } else if (!first_slash_pos) {
       *directory = NULL;
       *subdirectory = NULL;
       *filename = g_strdup (name);
   } else {
-    *first_slash_pos = '\0';
-    *directory = g_strdup (name);
-    *first_slash_pos = '/';
+    /* Note that we don't modify the name, since other threads may be
+       outputting the same name as the TZID-ALIAS-OF of a Link. */
+    *directory = g_strndup (name, first_slash_pos - name);
 
     if (second_slash_pos) {
-      *second_slash_pos = '\0';
-      *subdirectory = g_strdup (first_slash_pos + 1);
-      *second_slash_pos = '/';
+      *subdirectory = g_strndup (first_slash_pos + 1,
+                                 second_slash_pos - first_slash_pos - 1);
 
       *filename = g_strdup (second_slash_pos + 1);
     } else {
@@ -654,19 +1669,177 @@ parse_zone_name                 (char           *name,
 }
 
 
+/* This outputs the VTIMEZONE data of the zone in its flavor into
+   zone_output. */
 static void
-output_zone_to_files            (ZoneData       *zone,
-                                 char           *zone_name,
-                                 char           *zone_aliasof,
-                                 ZoneDescription *zone_desc,
+calculate_zone_output           (VzicOutputZone *zone,
+                                 VzicZoneOutput *zone_output)
+{
+  GArray *changes;
+
+  zone_output->properties = g_string_new (NULL);
+  zone_output->components = g_string_new (NULL);
+
+  /* output_zone_components() marks the changes as it outputs them, so each
+     flavor needs its own copy. */
+  changes = copy_changes (get_zone_changes (zone,
+                                            !zone->flavor->pure_output));
+
+  output_zone_components (zone->flavor, zone_output, zone->zone->zone_name,
+                          zone->zone_desc, changes);
+
+  g_array_free (changes, TRUE);
+}
+
+
+/* This returns the changes of the zone, with the UTC offsets rounded to the
+   nearest minute or not, calculating them if they haven't been already. The
+   Outlook-compatible flavors round them, since Outlook doesn't like seconds
+   in them. */
+static GArray*
+get_zone_changes                (VzicOutputZone *zone,
+                                 gboolean        round_offsets)
+{
+  VzicZoneCalculation *calculation = zone->calculation;
+
+  if (!calculation->changes[round_offsets])
+    calculation->changes[round_offsets]
+      = calculate_zone_changes (zone->zone, calculation->rule_data,
+                                calculation->max_until_year, round_offsets);
+
+  return calculation->changes[round_offsets];
+}
+
+
+VzicZoneTransitions*
+output_zone_get_transitions     (VzicOutputZone *zone)
+{
+  return get_zone_transitions (zone, !zone->flavor->pure_output);
+}
+
+
+VzicZoneTransitions*
+output_zone_get_exact_transitions (VzicOutputZone *zone)
+{
+  return get_zone_transitions (zone, FALSE);
+}
+
+
+static VzicZoneTransitions*
+get_zone_transitions            (VzicOutputZone *zone,
+                                 gboolean        round_offsets)
+{
+  VzicZoneCalculation *calculation = zone->calculation;
+
+  if (!calculation->transitions[round_offsets])
+    calculation->transitions[round_offsets]
+      = calculate_zone_transitions (get_zone_changes (zone, round_offsets));
+
+  return calculation->transitions[round_offsets];
+}
+
+
+/* This converts the changes into the transitions passed to the backends. */
+static VzicZoneTransitions*
+calculate_zone_transitions      (GArray         *changes)
+{
+  VzicZoneTransitions *transitions;
+  VzicTransition *transition;
+  VzicRecurrence *recurrence;
+  VzicTime *vzictime;
+  int i, first_recurrence;
+
+  transitions = g_new (VzicZoneTransitions, 1);
+
+  transitions->num_transitions = changes->len;
+  transitions->transitions = g_new (VzicTransition, changes->len);
+  for (i = 0; i < changes->len; i++) {
+    vzictime = &g_array_index (changes, VzicTime, i);
+    transition = &transitions->transitions[i];
+
+    transition->utc_time = vzictime_to_seconds (vzictime,
+                                                vzictime->prev_stdoff,
+                                                vzictime->prev_walloff);
+    transition->stdoff = vzictime->stdoff;
+    transition->walloff = vzictime->walloff;
+    transition->tzname = vzictime->tzname;
+  }
+
+  /* The infinite changes are always at the end. We skip the first change,
+     since its is_infinite flag means it has no start. */
+  first_recurrence = changes->len;
+  while (first_recurrence > 1
+         && g_array_index (changes, VzicTime, first_recurrence - 1).is_infinite)
+    first_recurrence--;
+
+  transitions->num_recurrences = changes->len - first_recurrence;
+  transitions->recurrences = g_new (VzicRecurrence,
+                                    transitions->num_recurrences);
+  for (i = first_recurrence; i < changes->len; i++) {
+    vzictime = &g_array_index (changes, VzicTime, i);
+    recurrence = &transitions->recurrences[i - first_recurrence];
+
+    recurrence->first_year = vzictime->year;
+    recurrence->month = vzictime->month;
+    recurrence->day_code = vzictime->day_code;
+    recurrence->day_number = vzictime->day_number;
+    recurrence->day_weekday = vzictime->day_weekday;
+    recurrence->time_seconds = vzictime->time_seconds;
+    recurrence->time_code = vzictime->time_code;
+    recurrence->prev_stdoff = vzictime->prev_stdoff;
+    recurrence->prev_walloff = vzictime->prev_walloff;
+    recurrence->stdoff = vzictime->stdoff;
+    recurrence->walloff = vzictime->walloff;
+    recurrence->tzname = vzictime->tzname;
+  }
+
+  return transitions;
+}
+
+
+static void
+zone_transitions_free           (VzicZoneTransitions *transitions)
+{
+  g_free (transitions->transitions);
+  g_free (transitions->recurrences);
+  g_free (transitions);
+}
+
+
+gint64
+output_recurrence_time          (VzicRecurrence *recurrence,
+                                 int             year)
+{
+  VzicTime vzictime;
+
+  vzictime_init (&vzictime);
+  vzictime.year = year;
+  vzictime.month = recurrence->month;
+  vzictime.day_code = recurrence->day_code;
+  vzictime.day_number = recurrence->day_number;
+  vzictime.day_weekday = recurrence->day_weekday;
+  vzictime.time_seconds = recurrence->time_seconds;
+  vzictime.time_code = recurrence->time_code;
+
+  return vzictime_to_seconds (&vzictime, recurrence->prev_stdoff,
+                              recurrence->prev_walloff);
+}
+
+
+/* This calculates the changes of the zone, from the Zone lines and the Rules
+   they use. */
+static GArray*
+calculate_zone_changes          (ZoneData       *zone,
                                  GHashTable     *rule_data,
-                                 FILE           *fp,
-                                 FILE           *changes_fp)
+                                 int             max_until_year,
+                                 gboolean        round_offsets)
 {
+  char *zone_name = zone->zone_name;
   ZoneLineData *zone_line;
   GArray *changes;
   int i, stdoff, walloff, start_index, save_seconds;
-  VzicTime start, end, *vzictime_start, *vzictime, *vzictime_first_rule_change;
+  int zone_stdoff, zone_save_seconds;
+  VzicTime start, end, *vzictime_start, *vzictime_first_rule_change;
   gboolean is_daylight, found_letter_s;
   char *start_letter_s;
 
@@ -683,9 +1856,16 @@ output_zone_to_files            (ZoneData       *zone,
 
     if (i == 0) start.is_infinite = (zone_line->rules == NULL);
 
+    zone_stdoff = zone_line->stdoff_seconds;
+    zone_save_seconds = zone_line->save_seconds;
+    if (round_offsets) {
+      zone_stdoff = time_round_to_minute (zone_stdoff);
+      zone_save_seconds = time_round_to_minute (zone_save_seconds);
+    }
+
     /* This is the local standard time offset from GMT for this period. */
-    start.stdoff = stdoff = zone_line->stdoff_seconds;
-    start.walloff = walloff = stdoff + zone_line->save_seconds;
+    start.stdoff = stdoff = zone_stdoff;
+    start.walloff = walloff = stdoff + zone_save_seconds;
 
     if (zone_line->until_set) {
       end.year = zone_line->until_year;
@@ -710,7 +1890,8 @@ output_zone_to_files            (ZoneData       *zone,
     save_seconds = 0;
     if (zone_line->rules)
       found_letter_s = add_rule_changes (zone_line, zone_name, changes,
-                                         rule_data, &start, &end,
+                                         rule_data, max_until_year,
+                                         &start, &end,
                                          &start_letter_s, &save_seconds);
     else
       found_letter_s = FALSE;
@@ -719,8 +1900,8 @@ output_zone_to_files            (ZoneData       *zone,
        first part of the period (i.e. before the first Rule comes into effect).
        Currently we try to use the same LETTER_S as the first Rule of the
        period which is in local standard time. */
-    if (zone_line->save_seconds)
-      save_seconds = zone_line->save_seconds;
+    if (zone_save_seconds)
+      save_seconds = zone_save_seconds;
     is_daylight = save_seconds ? TRUE : FALSE;
     vzictime_start = &g_array_index (changes, VzicTime, start_index);
     walloff = vzictime_start->walloff = stdoff + save_seconds;
@@ -764,24 +1945,71 @@ output_zone_to_files            (ZoneData       *zone,
                                               start_letter_s, is_daylight);
     }
 
-    /* The start of the next Zone line is the end time of this one. */
-    start = end;
-  }
+    /* The start of the next Zone line is the end time of this one. */
+    start = end;
+  }
+
+  set_previous_offsets (changes);
+
+  return changes;
+}
+
+
+/* This copies the changes, pointing the until fields of the copies at the
+   copied changes. */
+static GArray*
+copy_changes                    (GArray         *changes)
+{
+  GArray *copy;
+  VzicTime *vzictime, *first_change;
+  int i;
+
+  copy = g_array_sized_new (FALSE, FALSE, sizeof (VzicTime), changes->len);
+  g_array_append_vals (copy, changes->data, changes->len);
+
+  first_change = (VzicTime*) changes->data;
+  for (i = 0; i < copy->len; i++) {
+    vzictime = &g_array_index (copy, VzicTime, i);
+    if (vzictime->until)
+      vzictime->until = &g_array_index (copy, VzicTime,
+                                        vzictime->until - first_change);
+  }
+
+  return copy;
+}
+
+
+/* This outputs the VCALENDAR of a zone or Link alias, using the VTIMEZONE
+   data calculated by calculate_zone_output(). */
+static void
+output_vcalendar                (GString        *out,
+                                 char           *zone_name,
+                                 char           *zone_aliasof,
+                                 VzicZoneOutput *zone_output)
+{
+  g_string_append (out, "BEGIN:VCALENDAR\r\nPRODID:");
+  g_string_append_printf (out, ProductID, PACKAGE_VERSION);
+  g_string_append (out, "\r\nVERSION:2.0\r\n");
+
+  g_string_append_printf (out, "BEGIN:VTIMEZONE\r\nTZID:%s%s\r\n",
+                          TZIDPrefixExpanded, zone_name);
 
-  set_previous_offsets (changes);
+  if (zone_aliasof)
+    g_string_append_printf (out, "TZID-ALIAS-OF:%s\r\n", zone_aliasof);
 
-  output_zone_components (fp, zone_name, zone_aliasof, zone_desc, changes);
+  g_string_append_len (out, zone_output->properties->str,
+                       zone_output->properties->len);
 
-  if (VzicDumpChanges)
-    dump_changes (changes_fp, zone_name, changes);
+  if (VzicUrlPrefix != NULL)
+    g_string_append_printf (out, "TZURL:%s/%s\r\n", VzicUrlPrefix, zone_name);
 
-  /* Free all the TZNAME fields. */
-  for (i = 0; i < changes->len; i++) {
-    vzictime = &g_array_index (changes, VzicTime, i);
-    g_free (vzictime->tzname);
-  }
+  /* We use an 'X-' property to place the city name in. */
+  g_string_append_printf (out, "X-LIC-LOCATION:%s\r\n", zone_name);
 
-  g_array_free (changes, TRUE);
+  g_string_append_len (out, zone_output->components->str,
+                       zone_output->components->len);
+
+  g_string_append (out, "END:VCALENDAR\r\n");
 }
 
 
@@ -795,14 +2023,16 @@ add_rule_changes                        (ZoneLineData   *zone_line,
                                          char           *zone_name,
                                          GArray         *changes,
                                          GHashTable     *rule_data,
+                                         int             max_until_year,
                                          VzicTime       *start,
                                          VzicTime       *end,
                                          char          **start_letter_s,
                                          int            *save_seconds)
 {
   GArray *rule_array;
-  RuleData *rule, *prev_rule = NULL;
-  int stdoff, walloff, i, prev_stdoff, prev_walloff;
+  VzicRuleExpansion *expansion;
+  RuleData rule = { 0 }, prev_rule = { 0 };
+  int stdoff, walloff, i, first, prev_stdoff, prev_walloff;
   VzicTime vzictime;
   gboolean is_daylight, found_start_letter_s = FALSE;
   gboolean checked_for_previous = FALSE;
@@ -831,24 +2061,43 @@ add_rule_changes                        (ZoneLineData   *zone_line,
   }
 
 
-  for (i = 0; i < rule_array->len; i++) {
+  expansion = get_rule_expansion (zone_line->rules, rule_array, stdoff,
+                                  max_until_year);
+
+  /* Skip the instances well before the start of the period, except for the
+     last one, since it may be the Rule in effect when the period starts. */
+  first = 0;
+  if (start->year != YEAR_MINIMUM) {
+    first = rule_expansion_find (expansion,
+                                 vzictime_to_seconds (start, prev_stdoff,
+                                                      prev_walloff)
+                                 - RULE_WINDOW_MARGIN);
+    if (first > 0)
+      first--;
+  }
+
+  for (i = 0; ; i++) {
     int r;
 
-    rule = &g_array_index (rule_array, RuleData, i);
+    if (i > 0)
+      prev_rule = rule;
+    if (first + i >= expansion->len)
+      break;
+    rule = expansion->instances[first + i];
 
-    is_daylight = rule->save_seconds != 0 ? TRUE : FALSE;
+    is_daylight = rule.save_seconds != 0 ? TRUE : FALSE;
 
     vzictime_init (&vzictime);
-    vzictime.year = rule->from_year;
-    vzictime.month = rule->in_month;
-    vzictime.day_code = rule->on_day_code;
-    vzictime.day_number = rule->on_day_number;
-    vzictime.day_weekday = rule->on_day_weekday;
-    vzictime.time_seconds = rule->at_time_seconds;
-    vzictime.time_code = rule->at_time_code;
+    vzictime.year = rule.from_year;
+    vzictime.month = rule.in_month;
+    vzictime.day_code = rule.on_day_code;
+    vzictime.day_number = rule.on_day_number;
+    vzictime.day_weekday = rule.on_day_weekday;
+    vzictime.time_seconds = rule.at_time_seconds;
+    vzictime.time_code = rule.at_time_code;
     vzictime.stdoff = stdoff;
-    vzictime.walloff = stdoff + rule->save_seconds;
-    vzictime.is_infinite = (rule->to_year == YEAR_MAXIMUM) ? TRUE : FALSE;
+    vzictime.walloff = stdoff + rule.save_seconds;
+    vzictime.is_infinite = (rule.to_year == YEAR_MAXIMUM) ? TRUE : FALSE;
 
     /* If the rule time is before or on the given start time, skip it. */
     r = compare_times (&vzictime, stdoff, walloff,
@@ -860,7 +2109,7 @@ add_rule_changes                        (ZoneLineData   *zone_line,
          This seems to eliminate the need to guess in expand_tzname()
          but hasn't had enough testing to prove foolproof as of yet. */
       found_start_letter_s = TRUE;
-      *start_letter_s = rule->letter_s;
+      *start_letter_s = rule.letter_s;
 
       if (r == 0 && vzictime.time_code != start->time_code) {
         /* Rule time is on the given start time.
@@ -883,12 +2132,11 @@ add_rule_changes                        (ZoneLineData   *zone_line,
     if (!checked_for_previous) {
       checked_for_previous = TRUE;
       if (i > 0) {
-        prev_rule = &g_array_index (rule_array, RuleData, i - 1);
-        if (prev_rule->save_seconds) {
-          walloff = start->walloff = stdoff + prev_rule->save_seconds;
-          *save_seconds = prev_rule->save_seconds;
+        if (prev_rule.save_seconds) {
+          walloff = start->walloff = stdoff + prev_rule.save_seconds;
+          *save_seconds = prev_rule.save_seconds;
           found_start_letter_s = TRUE;
-          *start_letter_s = prev_rule->letter_s;
+          *start_letter_s = prev_rule.letter_s;
 #if 0
           printf ("Could use save_seconds from previous Rule: %s\n",
                   zone_name);
@@ -905,14 +2153,14 @@ add_rule_changes                        (ZoneLineData   *zone_line,
       break;
 
     vzictime.tzname = expand_tzname (zone_name, zone_line->format, TRUE,
-                                     rule->letter_s, is_daylight);
+                                     rule.letter_s, is_daylight);
 
     g_array_append_val (changes, vzictime);
 
     /* When we find the first STANDARD time we set letter_s. */
     if (!found_start_letter_s && !is_daylight) {
       found_start_letter_s = TRUE;
-      *start_letter_s = rule->letter_s;
+      *start_letter_s = rule.letter_s;
     }
 
     /* Now that we have added the Rule, the new walloff comes into effect
@@ -922,7 +2170,7 @@ add_rule_changes                        (ZoneLineData   *zone_line,
 
   /* If last Rule is terminating, flag it */
   if (end->year == YEAR_MAXIMUM &&
-      rule->to_year >= 2037 && rule->to_year < YEAR_MAXIMUM) {
+      rule.to_year >= 2037 && rule.to_year < YEAR_MAXIMUM) {
     VzicTime *v = &g_array_index (changes, VzicTime, changes->len - 1);
     v->until = v;
   }
@@ -1005,7 +2253,7 @@ expand_tzname                           (char           *zone_name,
                  "WARNING: Couldn't find a LETTER_S to use in FORMAT: %s in Zone: %s Guessing: %s\n",
                  format, zone_name, guess);
 #endif
-        return g_strdup (guess);
+        return intern_string (guess);
       }
 
 #if 1
@@ -1017,7 +2265,7 @@ expand_tzname                           (char           *zone_name,
 #if 0
       /* This is useful to spot exactly which component had a problem. */
       sprintf (buffer, "FIXME: %s", format);
-      return g_strdup (buffer);
+      return intern_string (buffer);
 #else
       /* We give up and don't output a TZNAME. */
       return NULL;
@@ -1025,24 +2273,24 @@ expand_tzname                           (char           *zone_name,
     }
 
     sprintf (buffer, format, letter_s ? letter_s : "");
-    return g_strdup (buffer);
+    return intern_string (buffer);
   }
 
   /* 2. Look for a "/". */
   p = strchr (format, '/');
   if (p) {
     if (is_daylight) {
-      return g_strdup (p + 1);
+      return intern_string (p + 1);
     } else {
       len = p - format;
       strncpy (buffer, format, len);
       buffer[len] = '\0';
-      return g_strdup (buffer);
+      return intern_string (buffer);
     }
   }
 
   /* 3. Just use format as it is. */
-  return g_strdup (format);
+  return format;
 }
 
 
@@ -1056,52 +2304,30 @@ compare_times                           (VzicTime       *time1,
                                          int             stdoff2,
                                          int             walloff2)
 {
-  VzicTime t1, t2;
+  gint64 t1, t2;
   int result;
 
-  t1 = *time1;
-  t2 = *time2;
-
-  calculate_actual_time (&t1, TIME_UNIVERSAL, stdoff1, walloff1);
-  calculate_actual_time (&t2, TIME_UNIVERSAL, stdoff2, walloff2);
-
-  /* Now we can compare the entire time. */
-  if (t1.year > t2.year)
-    result = 1;
-  else if (t1.year < t2.year)
-    result = -1;
-
-  else if (t1.month > t2.month)
-    result = 1;
-  else if (t1.month < t2.month)
-    result = -1;
-
-  else if (t1.day_number > t2.day_number)
-    result = 1;
-  else if (t1.day_number < t2.day_number)
-    result = -1;
+  t1 = vzictime_to_seconds (time1, stdoff1, walloff1);
+  t2 = vzictime_to_seconds (time2, stdoff2, walloff2);
 
-  else if (t1.time_seconds > t2.time_seconds)
+  if (t1 > t2)
     result = 1;
-  else if (t1.time_seconds < t2.time_seconds)
+  else if (t1 < t2)
     result = -1;
-
   else
     result = 0;
 
 #if 0
-  printf ("%i/%i/%i %i <=> %i/%i/%i %i  -> %i\n",
-          t1.day_number, t1.month + 1, t1.year, t1.time_seconds,
-          t2.day_number, t2.month + 1, t2.year, t2.time_seconds,
-          result);
+  printf ("%" G_GINT64_FORMAT " <=> %" G_GINT64_FORMAT "  -> %i\n",
+          t1, t2, result);
 #endif
 
   return result;
 }
 
 
-/* Returns TRUE if the 2 times are exactly the same. It will calculate the
-   actual day, but doesn't convert times. */
+/* Returns TRUE if the 2 times are exactly the same, after converting them
+   to UTC. */
 static gboolean
 times_match                             (VzicTime       *time1,
                                          int             stdoff1,
@@ -1110,21 +2336,8 @@ times_match                             (VzicTime       *time1,
                                          int             stdoff2,
                                          int             walloff2)
 {
-  VzicTime t1, t2;
-
-  t1 = *time1;
-  t2 = *time2;
-
-  calculate_actual_time (&t1, TIME_UNIVERSAL, stdoff1, walloff1);
-  calculate_actual_time (&t2, TIME_UNIVERSAL, stdoff2, walloff2);
-
-  if (t1.year == t2.year
-      && t1.month == t2.month
-      && t1.day_number == t2.day_number
-      && t1.time_seconds == t2.time_seconds)
-    return TRUE;
-
-  return FALSE;
+  return vzictime_to_seconds (time1, stdoff1, walloff1)
+    == vzictime_to_seconds (time2, stdoff2, walloff2) ? TRUE : FALSE;
 }
 
 
@@ -1137,23 +2350,23 @@ dms_to_dd                               (int dms[])
 
 
 static void
-output_zone_components                  (FILE           *fp,
+output_zone_components                  (VzicFlavor     *flavor,
+                                         VzicZoneOutput *zone_output,
                                          char           *name,
-                                         char           *aliasof,
                                          ZoneDescription *zone_desc,
                                          GArray         *changes)
 {
+  GString *out = zone_output->properties;
   VzicTime *vzictime;
+  VzicChangeIndex index;
   int i, start_index = 0;
   gboolean only_one_change = FALSE;
-  char start_buffer[1024];
-  time_t now = time(0);
-  struct tm *tm = gmtime(&now);
-
-  fprintf (fp, "BEGIN:VTIMEZONE\r\nTZID:%s%s\r\n", TZIDPrefixExpanded, name);
-
-  if (aliasof) fprintf (fp, "TZID-ALIAS-OF:%s\r\n", aliasof);
+  char time_buffer[FORMAT_TIME_BUFFER_SIZE];
+  time_t now = VzicTimestamp;
+  struct tm tm_buf, *tm = gmtime_r(&now, &tm_buf);
 
+  /* The BEGIN:VTIMEZONE, TZID & TZID-ALIAS-OF are output by
+     output_vcalendar(), since they are different for each Link alias. */
   vzictime = &g_array_index (changes, VzicTime, changes->len - 1);
   if (vzictime->until) {
     /* Add TZUNTIL */
@@ -1162,15 +2375,16 @@ output_zone_components                  (FILE           *fp,
     until.time_seconds++;  /* TZUNTIL is exclusive */
     calculate_actual_time(&until, TIME_UNIVERSAL,
                           until.prev_stdoff, until.prev_walloff);
-    fprintf (fp, "TZUNTIL:%sZ\r\n", format_time(until.year, until.month,
-                                                until.day_number,
-                                                until.time_seconds));
+    g_string_append_printf (out, "TZUNTIL:%sZ\r\n",
+                            format_time (time_buffer, until.year, until.month,
+                                         until.day_number,
+                                         until.time_seconds));
     vzictime->until = NULL;
   }
 
   if (zone_desc) {
     /* Add COMMENT */
-    fprintf (fp, "COMMENT:[%.2s] ", zone_desc->country_code);
+    g_string_append_printf (out, "COMMENT:[%.2s] ", zone_desc->country_code);
     if (zone_desc->comment) {
       const char *p;
 
@@ -1179,62 +2393,65 @@ output_zone_components                  (FILE           *fp,
         case '\\':
         case ',':
         case ';':
-          fprintf (fp, "\\");
+          g_string_append_c (out, '\\');
           break;
         }
 
-        fprintf (fp, "%c", *p);
+        g_string_append_c (out, *p);
       }
     }
-    fprintf (fp, "\r\n");
+    g_string_append (out, "\r\n");
 
 #if 0
     /* Add GEO */
-    fprintf (fp, "GEO:%+.6f,%+.6f\r\n",
-             dms_to_dd(zone_desc->latitude), dms_to_dd(zone_desc->longitude));
+    g_string_append_printf (out, "GEO:%+.6f,%+.6f\r\n",
+                            dms_to_dd(zone_desc->latitude),
+                            dms_to_dd(zone_desc->longitude));
 #endif
   }
 
-  /* Use current time as LAST-MODIFIED */
-  fprintf (fp, "LAST-MODIFIED:%04i%02i%02iT%02i%02i%02iZ\r\n",
-           tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-           tm->tm_hour, tm->tm_min, tm->tm_sec);
-
-  if (VzicUrlPrefix != NULL)
-      fprintf (fp, "TZURL:%s/%s\r\n", VzicUrlPrefix, name);
+  /* Use the current time (or the --reproducible time) as LAST-MODIFIED */
+  g_string_append_printf (out,
+                          "LAST-MODIFIED:%04i%02i%02iT%02i%02i%02iZ\r\n",
+                          tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+                          tm->tm_hour, tm->tm_min, tm->tm_sec);
 
-  /* We use an 'X-' property to place the city name in. */
-  fprintf (fp, "X-LIC-LOCATION:%s\r\n", name);
+  /* The TZURL & X-LIC-LOCATION come next, which are also output by
+     output_vcalendar(), so we output the rest of the VTIMEZONE separately. */
+  out = zone_output->components;
 
   /* We use an 'X-' property to place the proleptic tzname in. */
   vzictime = &g_array_index (changes, VzicTime, 0);
   if (vzictime->tzname) {
-    fputs("X-PROLEPTIC-TZNAME", fp);
-    if (!vzictime->is_infinite) fputs(";X-NO-BIG-BANG=TRUE", fp);
-    fprintf(fp, ":%s\r\n", vzictime->tzname);
+    g_string_append (out, "X-PROLEPTIC-TZNAME");
+    if (!vzictime->is_infinite) g_string_append (out, ";X-NO-BIG-BANG=TRUE");
+    g_string_append_printf (out, ":%s\r\n", vzictime->tzname);
   }
 
+  change_index_init (&index, changes);
+
   /* We try to find any recurring components first, or they may get output
      as lots of RDATES instead. */
   if (!VzicNoRRules) {
     int num_rrules_output = 0;
 
     for (i = 1; i < changes->len; i++) {
-      if (check_for_recurrence (fp, changes, i)) {
+      if (check_for_recurrence (out, changes, &index, i)) {
         num_rrules_output++;
       }
     }
 
 #if 0
-    printf ("Zone: %s had %i infinite RRULEs\n", CurrentZoneName,
+    printf ("Zone: %s had %i infinite RRULEs\n", name,
             num_rrules_output);
 #endif
 
-    if (!VzicPureOutput && num_rrules_output == 2) {
+    if (!flavor->pure_output && num_rrules_output == 2) {
 #if 0
-      printf ("Zone: %s using 2 RRULEs\n", CurrentZoneName);
+      printf ("Zone: %s using 2 RRULEs\n", name);
 #endif
-      fprintf (fp, "END:VTIMEZONE\r\n");
+      g_string_append (out, "END:VTIMEZONE\r\n");
+      change_index_free (&index);
       return;
     }
   }
@@ -1249,18 +2466,18 @@ output_zone_components                  (FILE           *fp,
   /* For pure output, we start at the start of the array and step through it
      outputting RDATEs. For Outlook-compatible output we start at the end
      and step backwards to find the first STANDARD time to output. */
-  if (VzicPureOutput)
+  if (flavor->pure_output)
     i = start_index - 1;
   else
     i = changes->len;
 
   for (;;) {
-    if (VzicPureOutput)
+    if (flavor->pure_output)
       i++;
     else
       i--;
 
-    if (VzicPureOutput) {
+    if (flavor->pure_output) {
       if (i >= changes->len)
         break;
     } else {
@@ -1285,28 +2502,28 @@ output_zone_components                  (FILE           *fp,
                                vzictime->prev_walloff);
 
         /* Output UNTIL, in UTC. */
-        sprintf (until, ";UNTIL=%sZ", format_time (t1.year, t1.month,
+        sprintf (until, ";UNTIL=%sZ", format_time (time_buffer,
+                                                   t1.year, t1.month,
                                                    t1.day_number,
                                                    t1.time_seconds));
       }
 
       /* Change the year to our minimum start year. */
       vzictime_start_copy = *vzictime;
-      if (!VzicPureOutput)
+      if (!flavor->pure_output)
         vzictime_start_copy.year = RRULE_START_YEAR;
 
-      day_offset = output_component_start (start_buffer, &vzictime_start_copy,
+      day_offset = output_component_start (out, flavor, &vzictime_start_copy,
                                            FALSE, FALSE);
-      fprintf (fp, "%s", start_buffer);
 
-      if (output_rrule (rrule_buffer, vzictime_start_copy.month,
+      if (output_rrule (flavor, name, rrule_buffer, vzictime_start_copy.month,
                         vzictime_start_copy.day_code,
                         vzictime_start_copy.day_number,
                         vzictime_start_copy.day_weekday, day_offset, until)) {
-        fprintf (fp, "%s", rrule_buffer);
+        g_string_append (out, rrule_buffer);
       }
 
-      output_component_end (fp, vzictime);
+      output_component_end (out, vzictime);
 
       continue;
     }
@@ -1318,18 +2535,18 @@ output_zone_components                  (FILE           *fp,
 
     /* For Outlook-compatible output we only want to output the last STANDARD
        time as a DTSTART, so skip any DAYLIGHT changes. */
-    if (!VzicPureOutput && vzictime->stdoff != vzictime->walloff) {
+    if (!flavor->pure_output && vzictime->stdoff != vzictime->walloff) {
       printf ("Skipping DAYLIGHT change\n");
       continue;
     }
 
 #if 0
-    printf ("Zone: %s using DTSTART Year: %i\n", CurrentZoneName,
+    printf ("Zone: %s using DTSTART Year: %i\n", name,
             vzictime->year);
 #endif
 
-    if (VzicPureOutput) {
-      output_component_start (start_buffer, vzictime, TRUE, only_one_change);
+    if (flavor->pure_output) {
+      output_component_start (out, flavor, vzictime, TRUE, only_one_change);
     } else {
     /* For Outlook compatability we don't output the RDATE and use the same
        TZOFFSET for TZOFFSETFROM and TZOFFSETTO. */
@@ -1340,25 +2557,25 @@ output_zone_components                  (FILE           *fp,
       vzictime->time_code    = TIME_WALL;
       vzictime->time_seconds = 0;
 
-      output_component_start (start_buffer, vzictime, FALSE, TRUE);
+      output_component_start (out, flavor, vzictime, FALSE, TRUE);
     }
 
-    fprintf (fp, "%s", start_buffer);
-
     /* This will look for matching components and output them as RDATEs
        instead of separate components. */
-    if (VzicPureOutput && !VzicNoRDates)
-      check_for_rdates (fp, changes, i);
+    if (flavor->pure_output && !VzicNoRDates)
+      check_for_rdates (out, flavor, changes, &index, i);
 
-    output_component_end (fp, vzictime);
+    output_component_end (out, vzictime);
 
     vzictime->output = TRUE;
 
-    if (!VzicPureOutput)
+    if (!flavor->pure_output)
       break;
   }
 
-  fprintf (fp, "END:VTIMEZONE\r\n");
+  g_string_append (out, "END:VTIMEZONE\r\n");
+
+  change_index_free (&index);
 }
 
 
@@ -1381,7 +2598,7 @@ set_previous_offsets            (GArray         *changes)
     if (vzictime->stdoff == prev_vzictime->stdoff &&
         vzictime->walloff == prev_vzictime->walloff &&
         vzictime->time_code == prev_vzictime->time_code &&
-        !strcmp(vzictime->tzname, prev_vzictime->tzname)) {
+        vzictime->tzname == prev_vzictime->tzname) {
       /* Ignore no-op transitions */
       vzictime->output = TRUE;
       continue;
@@ -1395,16 +2612,148 @@ set_previous_offsets            (GArray         *changes)
 }
 
 
+/* This links together the changes with the same signatures, in one pass
+   through the array. It must be called after set_previous_offsets(). */
+static void
+change_index_init               (VzicChangeIndex *index,
+                                 GArray         *changes)
+{
+  GHashTable *last_recurrences, *last_rdates;
+  VzicTime *vzictime;
+  int i;
+
+  index->next_recurrence = g_new (int, changes->len);
+  index->next_rdate = g_new (int, changes->len);
+
+  /* These map each signature to the last change found with it so far. */
+  last_recurrences = g_hash_table_new (recurrence_signature_hash,
+                                       recurrence_signature_equal);
+  last_rdates = g_hash_table_new (rdate_signature_hash,
+                                  rdate_signature_equal);
+
+  for (i = 0; i < changes->len; i++) {
+    vzictime = &g_array_index (changes, VzicTime, i);
+
+    index->next_recurrence[i] = -1;
+    index->next_rdate[i] = -1;
+
+    change_index_link (last_recurrences, index->next_recurrence, vzictime, i);
+    change_index_link (last_rdates, index->next_rdate, vzictime, i);
+  }
+
+  g_hash_table_destroy (last_recurrences);
+  g_hash_table_destroy (last_rdates);
+}
+
+
+static void
+change_index_free               (VzicChangeIndex *index)
+{
+  g_free (index->next_recurrence);
+  g_free (index->next_rdate);
+}
+
+
+/* This adds the change at idx to the end of the list of changes with the
+   same signature. */
+static void
+change_index_link               (GHashTable     *last_changes,
+                                 int            *next,
+                                 VzicTime       *vzictime,
+                                 int             idx)
+{
+  gpointer last_vzictime, last_idx;
+
+  if (g_hash_table_lookup_extended (last_changes, vzictime,
+                                    &last_vzictime, &last_idx))
+    next[GPOINTER_TO_INT (last_idx)] = idx;
+
+  g_hash_table_insert (last_changes, vzictime, GINT_TO_POINTER (idx));
+}
+
+
+/* The signature of a change for RRULEs is everything that must match for
+   changes in consecutive years to be output as one RRULE. See
+   check_for_recurrence(). */
+static guint
+recurrence_signature_hash       (gconstpointer   key)
+{
+  const VzicTime *vzictime = key;
+  guint hash;
+
+  hash = rdate_signature_hash (key);
+  hash = hash * 31 + vzictime->month;
+  hash = hash * 31 + vzictime->day_code;
+  hash = hash * 31 + vzictime->day_number;
+  hash = hash * 31 + vzictime->day_weekday;
+  hash = hash * 31 + vzictime->time_seconds;
+  hash = hash * 31 + vzictime->time_code;
+
+  return hash;
+}
+
+
+static gboolean
+recurrence_signature_equal      (gconstpointer   key1,
+                                 gconstpointer   key2)
+{
+  const VzicTime *vzictime1 = key1, *vzictime2 = key2;
+
+  /* It is possible that the time has a different code but does in fact
+     match when normalized, but we don't care (for now at least). */
+  return vzictime1->month == vzictime2->month
+    && vzictime1->day_code == vzictime2->day_code
+    && vzictime1->day_number == vzictime2->day_number
+    && vzictime1->day_weekday == vzictime2->day_weekday
+    && vzictime1->time_seconds == vzictime2->time_seconds
+    && vzictime1->time_code == vzictime2->time_code
+    && rdate_signature_equal (key1, key2);
+}
+
+
+/* The signature of a change for RDATEs is the type of component (STANDARD or
+   DAYLIGHT), the TZOFFSETFROM, TZOFFSETTO and TZNAME. */
+static guint
+rdate_signature_hash            (gconstpointer   key)
+{
+  const VzicTime *vzictime = key;
+  guint hash;
+
+  hash = (vzictime->stdoff != vzictime->walloff) ? 1 : 0;
+  hash = hash * 31 + vzictime->prev_walloff;
+  hash = hash * 31 + vzictime->walloff;
+  hash = hash * 31 + g_direct_hash (vzictime->tzname);
+
+  return hash;
+}
+
+
+static gboolean
+rdate_signature_equal           (gconstpointer   key1,
+                                 gconstpointer   key2)
+{
+  const VzicTime *vzictime1 = key1, *vzictime2 = key2;
+  gboolean is_daylight1, is_daylight2;
+
+  is_daylight1 = (vzictime1->stdoff != vzictime1->walloff) ? TRUE : FALSE;
+  is_daylight2 = (vzictime2->stdoff != vzictime2->walloff) ? TRUE : FALSE;
+
+  return is_daylight1 == is_daylight2
+    && vzictime1->prev_walloff == vzictime2->prev_walloff
+    && vzictime1->walloff == vzictime2->walloff
+    && timezones_match (vzictime1->tzname, vzictime2->tzname);
+}
+
+
 /* Returns TRUE if we output an infinite recurrence. */
 static gboolean
-check_for_recurrence            (FILE           *fp,
+check_for_recurrence            (GString        *out,
                                  GArray         *changes,
+                                 VzicChangeIndex *index,
                                  int             idx)
 {
   VzicTime *vzictime_start, *vzictime;
-  gboolean is_daylight_start, is_daylight;
   int last_match, i, next_year;
-  GList *matching_elements = NULL, *elem;
 
   vzictime_start = &g_array_index (changes, VzicTime, idx);
 
@@ -1416,13 +2765,11 @@ check_for_recurrence            (FILE           *fp,
   if (vzictime_start->year == YEAR_MINIMUM)
     return FALSE;
 
-  is_daylight_start = (vzictime_start->stdoff != vzictime_start->walloff)
-    ? TRUE : FALSE;
-
 #if 0
   printf ("\nChecking: %s OFFSETFROM: %i %s\n",
           format_vzictime (vzictime_start), vzictime_start->prev_walloff,
-          is_daylight_start ? "DAYLIGHT" : "");
+          (vzictime_start->stdoff != vzictime_start->walloff)
+          ? "DAYLIGHT" : "");
 #endif
 
   /* If this is an infinitely recurring change, output the RRULE and return.
@@ -1433,65 +2780,32 @@ check_for_recurrence            (FILE           *fp,
     return TRUE;
   }
 
+  /* We only need to look at the changes with the same signature. Since the
+     changes are in time order, we can stop when we get past the next year,
+     as we want consecutive years. */
   last_match = idx;
   next_year = vzictime_start->year + 1;
-  for (i = idx + 1; i < changes->len; i++) {
+  for (i = index->next_recurrence[idx]; i != -1;
+       i = index->next_recurrence[i]) {
     vzictime = &g_array_index (changes, VzicTime, i);
 
-    is_daylight = (vzictime->stdoff != vzictime->walloff) ? TRUE : FALSE;
-
     if (vzictime->output)
       continue;
 
 #if 0
     printf ("          %s OFFSETFROM: %i %s\n",
             format_vzictime (vzictime), vzictime->prev_walloff,
-            is_daylight ? "DAYLIGHT" : "");
+            (vzictime->stdoff != vzictime->walloff) ? "DAYLIGHT" : "");
 #endif
 
-    /* If it is more than one year ahead, we are finished, since we want
-       consecutive years. */
-    if (vzictime->year > next_year) {
+    if (vzictime->year > next_year)
       break;
-    }
-
-    /* It must be the same type of component - STANDARD or DAYLIGHT. */
-    if (is_daylight != is_daylight_start) {
-      continue;
-    }
-
-    /* It must be the following year, with the same month, day & time.
-       It is possible that the time has a different code but does in fact
-       match when normalized, but we don't care (for now at least). */
-    if (vzictime->year != next_year
-        || vzictime->month != vzictime_start->month
-        || vzictime->day_code != vzictime_start->day_code
-        || vzictime->day_number != vzictime_start->day_number
-        || vzictime->day_weekday != vzictime_start->day_weekday
-        || vzictime->time_seconds != vzictime_start->time_seconds
-        || vzictime->time_code != vzictime_start->time_code) {
-      continue;
-    }
-
-    /* The TZOFFSETFROM and TZOFFSETTO must match. */
-    if (vzictime->prev_walloff != vzictime_start->prev_walloff) {
-      continue;
-    }
-
-    if (vzictime->walloff != vzictime_start->walloff) {
-      continue;
-    }
-
-    /* TZNAME must match. */
-    if (!timezones_match (vzictime->tzname, vzictime_start->tzname)) {
-      continue;
-    }
 
     /* We have a match. */
-    last_match = i;
-    next_year = vzictime->year + 1;
-
-    matching_elements = g_list_prepend (matching_elements, vzictime);
+    if (vzictime->year == next_year) {
+      last_match = i;
+      next_year++;
+    }
   }
 
   if (last_match == idx)
@@ -1517,85 +2831,61 @@ check_for_recurrence            (FILE           *fp,
 
   vzictime_start->until = vzictime;
 
-  /* Mark all the changes as output. */
+  /* Mark all the changes as output, stepping through the matches again. */
   vzictime_start->output = TRUE;
-  for (elem = matching_elements; elem; elem = elem->next) {
-    vzictime = elem->data;
-    vzictime->output = TRUE;
-  }
+  next_year = vzictime_start->year + 1;
+  for (i = index->next_recurrence[idx]; i != -1 && i <= last_match;
+       i = index->next_recurrence[i]) {
+    vzictime = &g_array_index (changes, VzicTime, i);
 
-  g_list_free (matching_elements);
+    if (!vzictime->output && vzictime->year == next_year) {
+      vzictime->output = TRUE;
+      next_year++;
+    }
+  }
 
   return TRUE;
 }
 
 
 static void
-check_for_rdates                (FILE           *fp,
+check_for_rdates                (GString        *out,
+                                 VzicFlavor     *flavor,
                                  GArray         *changes,
+                                 VzicChangeIndex *index,
                                  int             idx)
 {
-  VzicTime *vzictime_start, *vzictime, tmp_vzictime;
-  gboolean is_daylight_start, is_daylight;
+  VzicTime *vzictime, tmp_vzictime;
   int i, year, month, day, time;
+  char time_buffer[FORMAT_TIME_BUFFER_SIZE];
 
-  vzictime_start = &g_array_index (changes, VzicTime, idx);
-
-  is_daylight_start = (vzictime_start->stdoff != vzictime_start->walloff)
-    ? TRUE : FALSE;
-
-#if 0
-  printf ("\nChecking: %s OFFSETFROM: %i %s\n",
-          format_vzictime (vzictime_start), vzictime_start->prev_walloff,
-          is_daylight_start ? "DAYLIGHT" : "");
-#endif
-
-  /* We want to go backwards through the array now, for Outlook compatability.
-     (It only looks at the first DTSTART/RDATE.) */
-  for (i = idx + 1; i < changes->len; i++) {
+  /* We only need to look at the changes with the same signature. */
+  for (i = index->next_rdate[idx]; i != -1; i = index->next_rdate[i]) {
     vzictime = &g_array_index (changes, VzicTime, i);
 
-    is_daylight = (vzictime->stdoff != vzictime->walloff) ? TRUE : FALSE;
-
     if (vzictime->output)
       continue;
 
 #if 0
     printf ("          %s OFFSETFROM: %i %s\n", format_vzictime (vzictime),
-            vzictime->prev_walloff, is_daylight ? "DAYLIGHT" : "");
+            vzictime->prev_walloff,
+            (vzictime->stdoff != vzictime->walloff) ? "DAYLIGHT" : "");
 #endif
 
-    /* It must be the same type of component - STANDARD or DAYLIGHT. */
-    if (is_daylight != is_daylight_start) {
-      continue;
-    }
-
-    /* The TZOFFSETFROM and TZOFFSETTO must match. */
-    if (vzictime->prev_walloff != vzictime_start->prev_walloff) {
-      continue;
-    }
-
-    if (vzictime->walloff != vzictime_start->walloff) {
-      continue;
-    }
-
-    /* TZNAME must match. */
-    if (!timezones_match (vzictime->tzname, vzictime_start->tzname)) {
-      continue;
-    }
-
     /* We have a match. */
 
     tmp_vzictime = *vzictime;
     calculate_actual_time (&tmp_vzictime, TIME_WALL, vzictime->prev_stdoff,
                            vzictime->prev_walloff);
 
-    fputs ("RDATE", fp);
-    if (VzicDumpTzDataArtifacts && (vzictime->time_code != TIME_WALL)) {
-      fprintf (fp, ";X-OBSERVED-AT=%c",
-               vzictime->time_code == TIME_UNIVERSAL ? 'Z' : 'S');
+    g_string_append (out, "RDATE");
+    if (flavor->dump_tzdata_artifacts && (vzictime->time_code != TIME_WALL)) {
+      g_string_append_printf (out, ";X-OBSERVED-AT=%c",
+                              vzictime->time_code == TIME_UNIVERSAL
+                              ? 'Z' : 'S');
     }
-    fprintf (fp, ":%s\r\n", format_time (tmp_vzictime.year,
+    g_string_append_printf (out, ":%s\r\n",
+                            format_time (time_buffer, tmp_vzictime.year,
                                          tmp_vzictime.month,
                                          tmp_vzictime.day_number,
                                          tmp_vzictime.time_seconds));
@@ -1609,32 +2899,25 @@ static gboolean
 timezones_match                         (char           *tzname1,
                                          char           *tzname2)
 {
-  if (tzname1 && tzname2 && !strcmp (tzname1, tzname2))
-    return TRUE;
-
-  if (!tzname1 && !tzname2)
-    return TRUE;
-
-  return FALSE;
+  /* The TZNAMEs are interned, so we just compare the pointers. */
+  return tzname1 == tzname2 ? TRUE : FALSE;
 }
 
 
 /* Outputs the start of a VTIMEZONE component, with the BEGIN line,
    the DTSTART, TZOFFSETFROM, TZOFFSETTO & TZNAME properties. */
 static int
-output_component_start                  (char           *buffer,
+output_component_start                  (GString        *out,
+                                         VzicFlavor     *flavor,
                                          VzicTime       *vzictime,
                                          gboolean        output_rdate,
                                          gboolean        use_same_tz_offset)
 {
   gboolean is_daylight, skip_day_offset = FALSE;
   gint year, month, day, time, day_offset = 0;
-  GDate old_date, new_date;
-  char *formatted_time;
-  char line1[1024], line2[1024], line3[1024];
-  char line4[1024], line5[1024], line6[1024];
+  char *formatted_time, time_buffer[FORMAT_TIME_BUFFER_SIZE];
   VzicTime tmp_vzictime;
-  int prev_walloff, n;
+  int prev_walloff;
 
   is_daylight = (vzictime->stdoff != vzictime->walloff) ? TRUE : FALSE;
 
@@ -1643,7 +2926,8 @@ output_component_start                  (char           *buffer,
                                       vzictime->prev_stdoff,
                                       vzictime->prev_walloff);
 
-  sprintf (line1, "BEGIN:%s\r\n", is_daylight ? "DAYLIGHT" : "STANDARD");
+  g_string_append_printf (out, "BEGIN:%s\r\n",
+                          is_daylight ? "DAYLIGHT" : "STANDARD");
 
   /* If the timezone only has one change, that means it uses the same offset
      forever, so we use the same TZOFFSETFROM as the TZOFFSETTO. (If the zone
@@ -1654,33 +2938,31 @@ output_component_start                  (char           *buffer,
     prev_walloff = vzictime->prev_walloff;
 
   if (vzictime->tzname)
-    sprintf (line2, "TZNAME:%s\r\n", vzictime->tzname);
-  else
-    line2[0] = '\0';
+    g_string_append_printf (out, "TZNAME:%s\r\n", vzictime->tzname);
 
-  sprintf (line3, "TZOFFSETFROM:%s\r\n",
-           format_tz_offset (prev_walloff, !VzicPureOutput));
+  g_string_append_printf (out, "TZOFFSETFROM:%s\r\n",
+                          format_tz_offset (time_buffer, prev_walloff,
+                                            !flavor->pure_output));
 
-  sprintf (line4, "TZOFFSETTO:%s\r\n",
-           format_tz_offset (vzictime->walloff, !VzicPureOutput));
+  g_string_append_printf (out, "TZOFFSETTO:%s\r\n",
+                          format_tz_offset (time_buffer, vzictime->walloff,
+                                            !flavor->pure_output));
 
-  formatted_time = format_time (tmp_vzictime.year, tmp_vzictime.month,
+  formatted_time = format_time (time_buffer,
+                                tmp_vzictime.year, tmp_vzictime.month,
                                 tmp_vzictime.day_number,
                                 tmp_vzictime.time_seconds);
-  n = sprintf (line5, "DTSTART");
-  if (VzicDumpTzDataArtifacts && (vzictime->time_code != TIME_WALL)) {
-    n += sprintf (line5+n, ";X-OBSERVED-AT=%c",
-                  vzictime->time_code == TIME_UNIVERSAL ? 'Z' : 'S');
+  g_string_append (out, "DTSTART");
+  if (flavor->dump_tzdata_artifacts && (vzictime->time_code != TIME_WALL)) {
+    g_string_append_printf (out, ";X-OBSERVED-AT=%c",
+                            vzictime->time_code == TIME_UNIVERSAL
+                            ? 'Z' : 'S');
   }
-  sprintf (line5+n, ":%s\r\n", formatted_time);
+  g_string_append_printf (out, ":%s\r\n", formatted_time);
 #if 0  /* The RDATE matching DTSTART is unnecessary */
   if (output_rdate)
-    sprintf (line6, "RDATE:%s\r\n", formatted_time);
-  else
+    g_string_append_printf (out, "RDATE:%s\r\n", formatted_time);
 #endif
-    line6[0] = '\0';
-
-  sprintf (buffer, "%s%s%s%s%s%s", line1, line2, line3, line4, line5, line6);
 
   return day_offset;
 }
@@ -1688,14 +2970,15 @@ output_component_start                  (char           *buffer,
 
 /* Outputs the END line of the VTIMEZONE component. */
 static void
-output_component_end                    (FILE           *fp,
+output_component_end                    (GString        *out,
                                          VzicTime       *vzictime)
 {
   gboolean is_daylight;
 
   is_daylight = (vzictime->stdoff != vzictime->walloff) ? TRUE : FALSE;
 
-  fprintf (fp, "END:%s\r\n", is_daylight ? "DAYLIGHT" : "STANDARD");
+  g_string_append_printf (out, "END:%s\r\n",
+                          is_daylight ? "DAYLIGHT" : "STANDARD");
 }
 
 
@@ -1722,6 +3005,46 @@ vzictime_init                           (VzicTime       *vzictime)
 }
 
 
+/* This returns the time of the change in UTC, as the number of seconds since
+   1st Jan 1970, given the offsets from standard and wall-clock time. Times
+   in YEAR_MINIMUM and YEAR_MAXIMUM are returned as G_MININT64 and
+   G_MAXINT64. */
+static gint64
+vzictime_to_seconds             (VzicTime       *vzictime,
+                                 int             stdoff,
+                                 int             walloff)
+{
+  int day, offset;
+
+  if (vzictime->year == YEAR_MINIMUM)
+    return G_MININT64;
+  if (vzictime->year == YEAR_MAXIMUM)
+    return G_MAXINT64;
+
+  day = time_resolve_day (vzictime->year, vzictime->month,
+                          vzictime->day_code, vzictime->day_number,
+                          vzictime->day_weekday);
+
+  switch (vzictime->time_code) {
+  case TIME_WALL:
+    offset = walloff;
+    break;
+  case TIME_STANDARD:
+    offset = stdoff;
+    break;
+  case TIME_UNIVERSAL:
+    offset = 0;
+    break;
+  default:
+    fprintf (stderr, "Invalid time code\n");
+    exit (1);
+  }
+
+  return time_to_seconds (vzictime->year, vzictime->month, day,
+                          vzictime->time_seconds) - offset;
+}
+
+
 /* This calculates the actual local time that a change will occur, given
    the offsets from standard and wall-clock time. It returns -1 or 1 if it
    had to move backwards or forwards one day while converting to local time.
@@ -1732,8 +3055,7 @@ calculate_actual_time           (VzicTime       *vzictime,
                                  int             stdoff,
                                  int             walloff)
 {
-  GDate date;
-  gint day_offset, days_in_month, weekday, offset, result;
+  gint day_offset, days_in_month;
 
   vzictime->time_seconds = calculate_wall_time (vzictime->time_seconds,
                                                 vzictime->time_code,
@@ -1745,36 +3067,15 @@ calculate_actual_time           (VzicTime       *vzictime,
       exit (0);
     }
 
-    g_date_clear (&date, 1);
-    days_in_month = g_date_days_in_month (vzictime->month + 1, vzictime->year);
+    days_in_month = time_days_in_month (vzictime->year, vzictime->month);
 
   /* Note that the day_code refers to the date before we convert it to
      a wall-clock date and time. So we find the day it was referring to,
      then make any adjustments needed due to converting the time. */
-    if (vzictime->day_code == DAY_LAST_WEEKDAY) {
-      /* Find out what day the last day of the month is. */
-      g_date_set_dmy (&date, days_in_month, vzictime->month + 1,
-                      vzictime->year);
-      weekday = g_date_weekday (&date) % 7;
-
-      /* Calculate how many days we have to go back to get to day_weekday. */
-      offset = (weekday + 7 - vzictime->day_weekday) % 7;
-
-      vzictime->day_number = days_in_month - offset;
-    } else {
-      /* Find out what day day_number actually is. */
-      g_date_set_dmy (&date, vzictime->day_number, vzictime->month + 1,
-                      vzictime->year);
-      weekday = g_date_weekday (&date) % 7;
-
-      if (vzictime->day_code == DAY_WEEKDAY_ON_OR_AFTER)
-        offset = (vzictime->day_weekday + 7 - weekday) % 7;
-      else
-        offset = - ((weekday + 7 - vzictime->day_weekday) % 7);
-
-      vzictime->day_number = vzictime->day_number + offset;
-    }
-
+    vzictime->day_number = time_resolve_day (vzictime->year, vzictime->month,
+                                             vzictime->day_code,
+                                             vzictime->day_number,
+                                             vzictime->day_weekday);
     vzictime->day_code = DAY_SIMPLE;
 
     if (vzictime->day_number > days_in_month) {
@@ -1920,39 +3221,25 @@ fix_time_overflow                       (int            *year,
                                          int            *day,
                                          int             day_offset)
 {
-  if (day_offset == -1) {
-    *day = *day - 1;
+  /* YEAR_MINIMUM and YEAR_MAXIMUM stand for -infinity and infinity, so we
+     leave them alone. */
+  if (day_offset == 0 || *year == YEAR_MINIMUM || *year == YEAR_MAXIMUM)
+    return;
 
-    if (*day == 0) {
-      *month = *month - 1;
-      if (*month == -1) {
-        *month = 11;
-        *year = *year - 1;
-      }
-      *day = g_date_days_in_month (*month + 1, *year);
-    }
-  } else if (day_offset == 1) {
-    *day = *day + 1;
-
-    if (*day > g_date_days_in_month (*month + 1, *year)) {
-      *month = *month + 1;
-      if (*month == 12) {
-        *month = 0;
-        *year = *year + 1;
-      }
-      *day = 1;
-    }
-  }
+  time_civil_from_days (time_days_from_civil (*year, *month, *day)
+                        + day_offset, year, month, day);
 }
 
 
+/* Formats the date & time into the given buffer, which must be at least
+   FORMAT_TIME_BUFFER_SIZE bytes, and returns it. */
 static char*
-format_time                             (int             year,
+format_time                             (char           *buffer,
+                                         int             year,
                                          int             month,
                                          int             day,
                                          int             time)
 {
-  static char buffer[128];
   int hour, minute, second;
 
   /* When we are outputting the first component year will be YEAR_MINIMUM.
@@ -1983,11 +3270,11 @@ format_time                             (int             year,
 /* Outlook doesn't support 6-digit values, i.e. including the seconds, so
    we round to the nearest minute. No current offsets use the seconds value,
    so we aren't losing much. */
-static char*
-format_tz_offset                        (int             tz_offset,
+char*
+format_tz_offset                        (char           *buffer,
+                                         int             tz_offset,
                                          gboolean        round_seconds)
 {
-  static char buffer[128];
   char *sign = "+";
   int hours, minutes, seconds;
 
@@ -2025,7 +3312,9 @@ format_tz_offset                        (int             tz_offset,
 
 
 static gboolean
-output_rrule                            (char           *rrule_buffer,
+output_rrule                            (VzicFlavor     *flavor,
+                                         char           *zone_name,
+                                         char           *rrule_buffer,
                                          int             month,
                                          DayCode         day_code,
                                          int             day_number,
@@ -2080,21 +3369,21 @@ output_rrule                            (char           *rrule_buffer,
        at times. This only affects Asia/Baghdad, Asia/Gaza, Asia/Jerusalem &
        Asia/Damascus at present (and Jerusalem doesn't have specific rules
        at the moment anyway, so that isn't a big loss). */
-    if (!VzicPureOutput) {
+    if (!flavor->pure_output) {
       if (day_number < 8) {
-        printf ("WARNING: %s: Outputting BYDAY=1SU instead of BYMONTHDAY=1-7 for Outlook compatability\n", CurrentZoneName);
+        printf ("WARNING: %s: Outputting BYDAY=1SU instead of BYMONTHDAY=1-7 for Outlook compatability\n", zone_name);
         sprintf (buffer, "RRULE:FREQ=YEARLY;BYMONTH=%i;BYDAY=1SU",
                  month + 1);
       } else if (day_number < 15) {
-        printf ("WARNING: %s: Outputting BYDAY=2SU instead of BYMONTHDAY=8-14 for Outlook compatability\n", CurrentZoneName);
+        printf ("WARNING: %s: Outputting BYDAY=2SU instead of BYMONTHDAY=8-14 for Outlook compatability\n", zone_name);
         sprintf (buffer, "RRULE:FREQ=YEARLY;BYMONTH=%i;BYDAY=2SU",
                  month + 1);
       } else if (day_number < 22) {
-        printf ("WARNING: %s: Outputting BYDAY=3SU instead of BYMONTHDAY=15-21 for Outlook compatability\n", CurrentZoneName);
+        printf ("WARNING: %s: Outputting BYDAY=3SU instead of BYMONTHDAY=15-21 for Outlook compatability\n", zone_name);
         sprintf (buffer, "RRULE:FREQ=YEARLY;BYMONTH=%i;BYDAY=3SU",
                  month + 1);
       } else {
-        printf ("ERROR: %s: Couldn't output RRULE (day=%i) compatible with Outlook\n", CurrentZoneName, day_number);
+        printf ("ERROR: %s: Couldn't output RRULE (day=%i) compatible with Outlook\n", zone_name, day_number);
         exit (1);
       }
     } else {
@@ -2110,8 +3399,8 @@ output_rrule                            (char           *rrule_buffer,
                month + 1);
 #endif
 
-      if (!VzicPureOutput) {
-        printf ("ERROR: %s: Couldn't output RRULE (day>=x) compatible with Outlook\n", CurrentZoneName);
+      if (!flavor->pure_output) {
+        printf ("ERROR: %s: Couldn't output RRULE (day>=x) compatible with Outlook\n", zone_name);
         exit (1);
       } else {
         /* We do 6 days at the end of this month, and 1 at the start of the
@@ -2148,7 +3437,7 @@ output_rrule                            (char           *rrule_buffer,
       }
     }
 
-    if (!output_rrule_2 (buffer, month, day_number, day_weekday))
+    if (!output_rrule_2 (flavor, zone_name, buffer, month, day_number, day_weekday))
       return FALSE;
 
     break;
@@ -2160,7 +3449,7 @@ output_rrule                            (char           *rrule_buffer,
       exit (0);
     }
 
-    if (!output_rrule_2 (buffer, month, day_number - 6, day_weekday))
+    if (!output_rrule_2 (flavor, zone_name, buffer, month, day_number - 6, day_weekday))
       return FALSE;
 
     break;
@@ -2177,8 +3466,8 @@ output_rrule                            (char           *rrule_buffer,
       fprintf (stderr, "DAY_LAST_WEEKDAY - day moved\n");
 #endif
 
-      if (!VzicPureOutput) {
-        printf ("WARNING: %s: Modifying RRULE (last weekday) for Outlook compatability\n", CurrentZoneName);
+      if (!flavor->pure_output) {
+        printf ("WARNING: %s: Modifying RRULE (last weekday) for Outlook compatability\n", zone_name);
         sprintf (buffer,
                  "RRULE:FREQ=YEARLY;BYMONTH=%i;BYDAY=-1%s",
                  month + 1, WeekDays[day_weekday]);
@@ -2222,7 +3511,7 @@ output_rrule                            (char           *rrule_buffer,
       /* We do 7 days 1 day before the end of this month. */
       day_number = DaysInMonth[month];
 
-      if (!output_rrule_2 (buffer, month, day_number - 7, day_weekday))
+      if (!output_rrule_2 (flavor, zone_name, buffer, month, day_number - 7, day_weekday))
         return FALSE;
 
       sprintf (rrule_buffer, "%s%s\r\n", buffer, until);
@@ -2248,7 +3537,9 @@ output_rrule                            (char           *rrule_buffer,
    into 'BYDAY=2FR'. We need this since Outlook doesn't accept BYMONTHDAY.
    It returns FALSE if conversion is not possible. */
 static gboolean
-output_rrule_2                          (char           *buffer,
+output_rrule_2                          (VzicFlavor     *flavor,
+                                         char           *zone_name,
+                                         char           *buffer,
                                          int             month,
                                          int             day_number,
                                          int             day_weekday)
@@ -2285,8 +3576,8 @@ output_rrule_2                          (char           *buffer,
        week out every 7 or so years. Alternatively we could possibly move the
        change by an hour or so so we would always be 1 or 2 hours out, but
        never 1 week out. Yes, that sounds a better idea. */
-    if (!VzicPureOutput) {
-      printf ("WARNING: %s: Modifying RRULE to be compatible with Outlook (day >= %i, month = %i)\n", CurrentZoneName, day_number, month + 1);
+    if (!flavor->pure_output) {
+      printf ("WARNING: %s: Modifying RRULE to be compatible with Outlook (day >= %i, month = %i)\n", zone_name, day_number, month + 1);
 
       if (day_number == 2) {
         /* Convert it to a BYDAY=1SU type of RRULE.
@@ -2304,7 +3595,7 @@ output_rrule_2                          (char           *buffer,
         sprintf (buffer, "RRULE:FREQ=YEARLY;BYMONTH=%i;BYDAY=-1%s",
                  month + 1, WeekDays[day_weekday]);
       } else {
-        printf ("ERROR: %s: Couldn't modify RRULE to be compatible with Outlook (day >= %i, month = %i)\n", CurrentZoneName, day_number, month + 1);
+        printf ("ERROR: %s: Couldn't modify RRULE to be compatible with Outlook (day >= %i, month = %i)\n", zone_name, day_number, month + 1);
         exit (1);
       }
 
@@ -2339,119 +3630,129 @@ format_vzictime                         (VzicTime       *vzictime)
 }
 
 
-static void
-dump_changes                            (FILE           *fp,
-                                         char           *zone_name,
-                                         GArray         *changes)
+void
+ensure_directory_exists         (char           *directory)
 {
-  VzicTime *vzictime, *vzictime2 = NULL;
-  int i, year_offset, year;
-
-  for (i = 0; i < changes->len; i++) {
-    vzictime = &g_array_index (changes, VzicTime, i);
+  struct stat filestat;
 
-    if (vzictime->year > MAX_CHANGES_YEAR)
-      return;
+  if (is_known_directory (directory))
+    return;
 
-    dump_change (fp, zone_name, vzictime, vzictime->year);
+  if (stat (directory, &filestat) != 0) {
+    /* If the directory doesn't exist, try to create it. */
+    if (errno == ENOENT) {
+      /* Another thread may have just created it, which is fine. */
+      if (mkdir (directory, 0777) != 0 && errno != EEXIST) {
+        fprintf (stderr, "Can't create directory: %s\n", directory);
+        exit (1);
+      }
+    } else {
+      fprintf (stderr, "Error calling stat() on directory: %s\n", directory);
+      exit (1);
+    }
+  } else if (!S_ISDIR (filestat.st_mode)) {
+    fprintf (stderr, "Can't create directory, already exists: %s\n",
+             directory);
+    exit (1);
   }
 
-  if (changes->len < 2)
-    return;
+  add_known_directory (directory);
+}
 
-  /* Now see if the changes array ends with a pair of recurring changes. */
-  vzictime = &g_array_index (changes, VzicTime, changes->len - 2);
-  vzictime2 = &g_array_index (changes, VzicTime, changes->len - 1);
-  if (!vzictime->is_infinite || !vzictime2->is_infinite)
-    return;
 
-  year_offset = 1;
-  for (;;) {
-    year = vzictime->year + year_offset;
-    if (year > MAX_CHANGES_YEAR)
-      break;
-    dump_change (fp, zone_name, vzictime, year);
+static gboolean
+is_known_directory              (char           *directory)
+{
+  gboolean known;
 
-    year = vzictime2->year + year_offset;
-    if (year > MAX_CHANGES_YEAR)
-      break;
-    dump_change (fp, zone_name, vzictime2, year);
+  G_LOCK (known_directories);
+  known = KnownDirectories
+    && g_hash_table_lookup (KnownDirectories, directory) != NULL;
+  G_UNLOCK (known_directories);
 
-    year_offset++;
-  }
+  return known;
 }
 
 
 static void
-dump_change                             (FILE           *fp,
-                                         char           *zone_name,
-                                         VzicTime       *vzictime,
-                                         int             year)
+add_known_directory             (char           *directory)
 {
-  int hour, minute, second;
-  VzicTime tmp_vzictime;
-  static char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-                            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-  /* Output format is:
-
-        Zone-Name [tab] Date [tab] Time [tab] UTC-Offset
+  char *key;
+
+  G_LOCK (known_directories);
+  if (!KnownDirectories)
+    KnownDirectories = g_hash_table_new (g_str_hash, g_str_equal);
+  if (!g_hash_table_lookup (KnownDirectories, directory)) {
+    key = g_strdup (directory);
+    g_hash_table_insert (KnownDirectories, key, key);
+  }
+  G_UNLOCK (known_directories);
+}
 
-     The Date and Time fields specify the time change in UTC.
 
-     The UTC Offset is for local (wall-clock) time. It is the amount of time
-     to add to UTC to get local time.
-  */
+/* This writes the contents to a temporary file in the same directory, and
+   then renames it to filename, so anything reading the files (e.g. Cyrus
+   while we regenerate them) never sees a partly-written file. The temporary
+   file gets a unique name from g_mkstemp_full(), so separate vzic processes
+   don't clash and a file left behind by a crashed run is never in the way.
+   It is created with the usual permissions, as fopen() would. */
+void
+write_file_atomically           (char           *filename,
+                                 const char     *contents,
+                                 gsize           length)
+{
+  char *tmp_filename;
 
-  fprintf (fp, "%s\t", zone_name);
+  tmp_filename = write_temp_file (filename, contents, length);
 
-  if (year == YEAR_MINIMUM) {
-    fprintf (fp, " 1 Jan 0001\t 0:00:00");
-  } else if (year == YEAR_MAXIMUM) {
-    fprintf (stderr, "Maximum year found in change time\n");
+  if (rename (tmp_filename, filename) != 0) {
+    fprintf (stderr, "Couldn't rename file: %s\n", tmp_filename);
     exit (1);
-  } else {
-    tmp_vzictime = *vzictime;
-    tmp_vzictime.year = year;
-    calculate_actual_time (&tmp_vzictime, TIME_UNIVERSAL,
-                           vzictime->prev_stdoff, vzictime->prev_walloff);
-
-    hour = tmp_vzictime.time_seconds / 3600;
-    minute = (tmp_vzictime.time_seconds % 3600) / 60;
-    second = tmp_vzictime.time_seconds % 60;
-
-    fprintf (fp, "%2i %s %04i\t%2i:%02i:%02i",
-             tmp_vzictime.day_number, months[tmp_vzictime.month],
-             tmp_vzictime.year, hour, minute, second);
   }
 
-  fprintf (fp, "\t%s", format_tz_offset (vzictime->walloff, FALSE));
-
-  fprintf (fp, "\r\n");
+  g_free (tmp_filename);
 }
 
 
-void
-ensure_directory_exists         (char           *directory)
+/* This writes the contents to a new temporary file next to filename, and
+   returns its name, which should be freed with g_free(). */
+char*
+write_temp_file                 (char           *filename,
+                                 const char     *contents,
+                                 gsize           length)
 {
-  struct stat filestat;
+  char *tmp_filename;
+  ssize_t bytes_written;
+  int fd;
 
-  if (stat (directory, &filestat) != 0) {
-    /* If the directory doesn't exist, try to create it. */
-    if (errno == ENOENT) {
-      if (mkdir (directory, 0777) != 0) {
-        fprintf (stderr, "Can't create directory: %s\n", directory);
-        exit (1);
-      }
-    } else {
-      fprintf (stderr, "Error calling stat() on directory: %s\n", directory);
+  tmp_filename = g_strdup_printf ("%s.XXXXXX", filename);
+
+  fd = g_mkstemp_full (tmp_filename, O_WRONLY, 0666);
+  if (fd == -1) {
+    fprintf (stderr, "Couldn't create file: %s (%s)\n", tmp_filename,
+             strerror (errno));
+    exit (1);
+  }
+
+  /* This is normally a single write, but it may be interrupted. */
+  while (length > 0) {
+    bytes_written = write (fd, contents, length);
+    if (bytes_written == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Error writing file: %s\n", tmp_filename);
       exit (1);
     }
-  } else if (!S_ISDIR (filestat.st_mode)) {
-    fprintf (stderr, "Can't create directory, already exists: %s\n",
-             directory);
+    contents += bytes_written;
+    length -= bytes_written;
+  }
+
+  if (close (fd) != 0) {
+    fprintf (stderr, "Error writing file: %s\n", tmp_filename);
     exit (1);
   }
+
+  return tmp_filename;
 }
 
 
@@ -2464,9 +3765,11 @@ expand_tzid_prefix              (void)
   time_t t;
   struct tm *tm;
 
-  /* Get today's date as a string in the format "YYYYMMDD". */
-  t = time (NULL);
-  tm = localtime (&t);
+  /* Get today's date as a string in the format "YYYYMMDD". With
+     --reproducible we use the date in UTC, so it doesn't depend on the
+     local timezone either. */
+  t = VzicTimestamp;
+  tm = VzicReproducible ? gmtime (&t) : localtime (&t);
   sprintf (date_buf, "%4i%02i%02i", tm->tm_year + 1900,
            tm->tm_mon + 1, tm->tm_mday);
 
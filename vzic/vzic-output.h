@@ -27,13 +27,35 @@
 
 #include <glib.h>
 
-void            output_vtimezone_files          (char           *directory,
-                                                 GArray         *zone_data,
+/* The size of the buffers used to format times and UTC offsets. */
+#define FORMAT_TIME_BUFFER_SIZE 128
+
+/* This outputs the zones of one Olson file. If selected_zones isn't NULL
+   only the zones whose names are in it are output. */
+void            output_vtimezone_files          (GArray         *zone_data,
                                                  GHashTable     *rule_data,
                                                  GHashTable     *link_data,
                                                  GHashTable     *zones_hash,
-                                                 int             max_until_year);
+                                                 int             max_until_year,
+                                                 GHashTable     *selected_zones);
 
 void            ensure_directory_exists         (char           *directory);
 
+/* Returns TRUE if the zone or Link alias name is valid, i.e. it is output
+   and listed in zones.tab. */
+gboolean        zone_name_is_valid              (char           *zone_name);
+
+void            write_file_atomically           (char           *filename,
+                                                 const char     *contents,
+                                                 gsize           length);
+char*           write_temp_file                 (char           *filename,
+                                                 const char     *contents,
+                                                 gsize           length);
+
+/* Formats a UTC offset in seconds as e.g. "+0100" or "-043912" into buffer,
+   rounding it to the nearest minute if round_seconds is TRUE. */
+char*           format_tz_offset                (char           *buffer,
+                                                 int             tz_offset,
+                                                 gboolean        round_seconds);
+
 #endif /* _VZIC_OUTPUT_H_ */
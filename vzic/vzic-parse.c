@@ -23,25 +23,23 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <libgen.h>
 
 #include "vzic.h"
 #include "vzic-parse.h"
-#include "vzic-output.h"
-
-/* This is the maximum line length we allow. */
-#define MAX_LINE_LEN    1024
 
 /* The maximum number of fields on a line. */
 #define MAX_FIELDS      12
 
-#define CREATE_SYMLINK  0
-
 typedef enum
 {
   ZONE_ID               = 0,    /* The 'Zone' at the start of the line. */
@@ -84,10 +82,13 @@ typedef enum
 typedef struct _ParsingData ParsingData;
 struct _ParsingData
 {
-  /* This is the line being parsed. buffer is a copy that we break into fields
-     and sub-fields as it is parsed. */
-  char  line[MAX_LINE_LEN];
-  char  buffer[MAX_LINE_LEN];
+  /* This is the line being parsed, in the original text of the file, and its
+     length without the newline. It is only used for error messages.
+     buffer is the same line in our private, writable mapping of the file,
+     which we break into fields and sub-fields in place as it is parsed. */
+  char *line;
+  int   line_len;
+  char *buffer;
 
   /* These are pointers to the start of each field in buffer. */
   char *fields[MAX_FIELDS];
@@ -113,12 +114,34 @@ struct _ParsingData
   GHashTable *link_data;
 
   int   max_until_year;
+
+  /* Where parse_error() jumps back to in parse_olson_file(). */
+  jmp_buf error_jump;
+};
+
+
+/* These are the classes of characters used when breaking a line into fields.
+   Any other character is part of a field. */
+#define CHAR_END        1       /* The end of the line or a comment. */
+#define CHAR_SPACE      2
+#define CHAR_QUOTE      3
+
+static const unsigned char CharClasses[256] = {
+  ['\0'] = CHAR_END,   ['#'] = CHAR_END,
+  [' '] = CHAR_SPACE,   ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+  ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+  ['"'] = CHAR_QUOTE
 };
 
 
 /*
  * Parsing functions, used when reading the Olson timezone data file.
  */
+static void     unmap_olson_file                (char           *contents,
+                                                 char           *text,
+                                                 off_t           size);
+static void     parse_error                     (ParsingData    *data)
+                                                G_GNUC_NORETURN;
 static void     parse_fields                    (ParsingData    *data);
 static gboolean parse_zone_line                 (ParsingData    *data);
 static gboolean parse_zone_continuation_line    (ParsingData    *data);
@@ -152,7 +175,10 @@ static void     parse_coord                     (char           *coord,
                                                  int             len,
                                                  int            *result);
 
-void
+/* This returns FALSE if the file can't be read or has an error, after
+   outputting a message. The tables are still set, holding what was parsed
+   before the error, so the caller can free them. */
+gboolean
 parse_olson_file                (char           *filename,
                                  GArray        **zone_data,
                                  GHashTable    **rule_data,
@@ -160,29 +186,81 @@ parse_olson_file                (char           *filename,
                                  int            *max_until_year)
 {
   ParsingData data;
-  FILE *fp;
-  int zone_continues = 0;
+  struct stat st;
+  char *contents = NULL, *text = NULL, *p, *end, *line_end;
+  char * volatile last_line = NULL;
+  int fd, zone_continues = 0;
 
   *zone_data = g_array_new (FALSE, FALSE, sizeof (ZoneData));
-  *rule_data = g_hash_table_new (g_str_hash, g_str_equal);
-
-  fp = fopen (filename, "r");
-  if (!fp) {
-    fprintf (stderr, "Couldn't open file: %s\n", filename);
-    exit (1);
+  *rule_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* We map the file twice. We break the lines into fields in place in the
+     first mapping, which is private and copy-on-write, so the file is only
+     opened for reading and the changes never reach it. The second one is
+     only used to output the original lines in error messages. An empty file
+     can't be mapped, but has no lines anyway. */
+  fd = open (filename, O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) != 0) {
+    fprintf (stderr, "Couldn't open file: %s (%s)\n", filename,
+             strerror (errno));
+    if (fd >= 0)
+      close (fd);
+    return FALSE;
+  }
+
+  if (st.st_size > 0) {
+    contents = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    text = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (contents == MAP_FAILED || text == MAP_FAILED) {
+      fprintf (stderr, "Couldn't map file: %s (%s)\n", filename,
+               strerror (errno));
+      if (contents != MAP_FAILED)
+        munmap (contents, st.st_size);
+      if (text != MAP_FAILED)
+        munmap (text, st.st_size);
+      close (fd);
+      return FALSE;
+    }
   }
+  close (fd);
+
+  end = st.st_size > 0 ? contents + st.st_size : contents;
 
   data.filename = filename;
+  data.line = "";
+  data.line_len = 0;
   data.zone_data = *zone_data;
   data.rule_data = *rule_data;
   data.link_data = *link_data;
   data.max_until_year = 0;
 
-  for (data.line_number = 0; ; data.line_number++) {
-    if (fgets (data.line, sizeof (data.line), fp) != data.line)
-      break;
-
-    strcpy (data.buffer, data.line);
+  /* An invalid line gives up on the file, rather than exiting, so a bad
+     file sent to the --serve or --watch daemon doesn't stop it. */
+  if (setjmp (data.error_jump) != 0) {
+    g_free (last_line);
+    unmap_olson_file (contents, text, st.st_size);
+    return FALSE;
+  }
+
+  for (p = contents, data.line_number = 0; p < end;
+       p = line_end + 1, data.line_number++) {
+    /* memchr() is vectorized in most C libraries, so this skips over the
+       comments, which make up most of the Olson files, very quickly. */
+    line_end = memchr (p, '\n', end - p);
+
+    data.line = text + (p - contents);
+    if (line_end) {
+      data.line_len = line_end - p;
+      *line_end = '\0';
+      data.buffer = p;
+    } else {
+      /* The last line has no newline, so we can't terminate it in place. */
+      data.line_len = end - p;
+      last_line = g_strndup (p, end - p);
+      data.buffer = last_line;
+      line_end = end;
+    }
 
     parse_fields (&data);
     if (data.num_fields == 0)
@@ -199,37 +277,56 @@ parse_olson_file                (char           *filename,
     } else if (!strcmp (data.fields[0], "Leap")) {
       /* We don't care about Leap lines. */
     } else {
-      fprintf (stderr, "%s:%i: Invalid line.\n%s\n", filename,
-               data.line_number, data.line);
-      exit (1);
+      fprintf (stderr, "%s:%i: Invalid line.\n%.*s\n", filename,
+               data.line_number, data.line_len, data.line);
+      parse_error (&data);
     }
   }
 
-  if (ferror (fp)) {
-    fprintf (stderr, "Error reading file: %s\n", filename);
-    exit (1);
-  }
-
   if (zone_continues) {
-    fprintf (stderr, "%s:%i: Zone continuation line expected.\n%s\n",
-             filename, data.line_number, data.line);
-    exit (1);
+    fprintf (stderr, "%s:%i: Zone continuation line expected.\n%.*s\n",
+             filename, data.line_number, data.line_len, data.line);
+    parse_error (&data);
   }
 
-  fclose (fp);
+  g_free (last_line);
+  unmap_olson_file (contents, text, st.st_size);
 
 #if 0
   printf ("Max UNTIL year: %i\n", data.max_until_year);
 #endif
   *max_until_year = data.max_until_year;
+
+  return TRUE;
+}
+
+
+static void
+unmap_olson_file                (char           *contents,
+                                 char           *text,
+                                 off_t           size)
+{
+  if (size > 0) {
+    munmap (contents, size);
+    munmap (text, size);
+  }
+}
+
+
+/* The error message has already been output. */
+static void
+parse_error                     (ParsingData    *data)
+{
+  longjmp (data->error_jump, 1);
 }
 
 
-/* Converts the line into fields. */
+/* Converts the line into fields. The fields are left in the buffer, so we
+   don't have to copy the line or the fields. */
 static void
 parse_fields                    (ParsingData    *data)
 {
-  int i;
+  int i, class;
   char *p, *s, ch;
 
   /* Reset all fields to NULL. */
@@ -241,11 +338,11 @@ parse_fields                    (ParsingData    *data)
 
   for (;;) {
     /* Skip whitespace. */
-    while (isspace (*p))
+    while (CharClasses[(unsigned char) *p] == CHAR_SPACE)
       p++;
 
     /* See if we have reached the end of the line or a comment. */
-    if (*p == '\0' || *p == '#')
+    if (CharClasses[(unsigned char) *p] == CHAR_END)
       break;
 
     /* We must have another field, so save the start position. */
@@ -256,33 +353,36 @@ parse_fields                    (ParsingData    *data)
     s = p;
     for (;;) {
       ch = *p;
-      if (ch == '\0' || ch == '#') {
+      class = CharClasses[(unsigned char) ch];
+      if (class == 0) {
+        *s++ = ch;
+      } else if (class == CHAR_END) {
         /* Don't move p on since this is the end of the line. */
         *s = '\0';
         break;
-      } else if (isspace (ch)) {
+      } else if (class == CHAR_SPACE) {
         *s = '\0';
         p++;
         break;
-      } else if (ch == '"') {
+      } else {
+        /* A quoted part of the field. We stop at the closing quote, and the
+           p++ below steps over it. */
         p++;
         for (;;) {
           ch = *p;
           if (ch == '\0') {
             fprintf (stderr,
-                     "%s:%i: Closing quote character ('\"') missing.\n%s\n",
-                     data->filename, data->line_number, data->line);
-            exit (1);
+                     "%s:%i: Closing quote character ('\"') missing.\n%.*s\n",
+                     data->filename, data->line_number, data->line_len,
+                     data->line);
+            parse_error (data);
           } else if (ch == '"') {
-            p++;
             break;
           } else {
             *s++ = ch;
           }
           p++;
         }
-      } else {
-        *s++ = ch;
       }
       p++;
     }
@@ -304,13 +404,13 @@ parse_zone_line                 (ParsingData    *data)
 
   /* All 5 fields up to FORMAT must be present. */
   if (data->num_fields < 5 || data->num_fields > 9) {
-        fprintf (stderr, "%s:%i: Invalid Zone line - %i fields.\n%s\n",
+        fprintf (stderr, "%s:%i: Invalid Zone line - %i fields.\n%.*s\n",
                  data->filename, data->line_number, data->num_fields,
-                 data->line);
-        exit (1);
+                 data->line_len, data->line);
+        parse_error (data);
   }
 
-  zone.zone_name = g_strdup (data->fields[ZONE_NAME]);
+  zone.zone_name = intern_string (data->fields[ZONE_NAME]);
   zone.zone_line_data = g_array_new (FALSE, FALSE, sizeof (ZoneLineData));
 
   g_array_append_val (data->zone_data, zone);
@@ -325,10 +425,10 @@ parse_zone_continuation_line    (ParsingData    *data)
   /* All 3 fields up to FORMAT must be present. */
   if (data->num_fields < 3 || data->num_fields > 7) {
         fprintf (stderr,
-                 "%s:%i: Invalid Zone continuation line - %i fields.\n%s\n",
+                 "%s:%i: Invalid Zone continuation line - %i fields.\n%.*s\n",
                  data->filename, data->line_number, data->num_fields,
-                 data->line);
-        exit (1);
+                 data->line_len, data->line);
+        parse_error (data);
   }
 
   return parse_zone_common (data, -2);
@@ -350,24 +450,11 @@ parse_zone_common               (ParsingData    *data,
                                              data->fields[ZONE_RULES_SAVE + offset],
                                              &zone_line.rules);
 
-  if (!VzicPureOutput) {
-    /* We round the UTC offsets to the nearest minute, to be compatible with
-       Outlook. This also works with -ve numbers, I think.
-       -56 % 60 = -59. -61 % 60 = -1. */
-    if (zone_line.stdoff_seconds >= 0)
-      zone_line.stdoff_seconds += 30;
-    else
-      zone_line.stdoff_seconds -= 29;
-    zone_line.stdoff_seconds -= zone_line.stdoff_seconds % 60;
+  /* The Outlook-compatible output rounds these to the nearest minute, but
+     that is done when the zone is output, since with --flavor we may output
+     both. See calculate_zone_changes() in vzic-output.c. */
 
-    if (zone_line.save_seconds >= 0)
-      zone_line.save_seconds += 30;
-    else
-      zone_line.save_seconds -= 29;
-    zone_line.save_seconds -= zone_line.save_seconds % 60;
-  }
-
-  zone_line.format = g_strdup (data->fields[ZONE_FORMAT + offset]);
+  zone_line.format = intern_string (data->fields[ZONE_FORMAT + offset]);
 
   if (data->num_fields - offset >= 6) {
     zone_line.until_set = TRUE;
@@ -413,27 +500,27 @@ parse_rule_line                 (ParsingData    *data)
 
   /* All 10 fields must be present. */
   if (data->num_fields != 10) {
-        fprintf (stderr, "%s:%i: Invalid Rule line - %i fields.\n%s\n",
+        fprintf (stderr, "%s:%i: Invalid Rule line - %i fields.\n%.*s\n",
                  data->filename, data->line_number, data->num_fields,
-                 data->line);
-        exit (1);
+                 data->line_len, data->line);
+        parse_error (data);
   }
 
-  name = data->fields[RULE_NAME];
+  name = intern_string (data->fields[RULE_NAME]);
 
   /* Create the GArray and add it to the hash table if it doesn't already
      exist. */
   rule_array = g_hash_table_lookup (data->rule_data, name);
   if (!rule_array) {
     rule_array = g_array_new (FALSE, FALSE, sizeof (RuleData));
-    g_hash_table_insert (data->rule_data, g_strdup (name), rule_array);
+    g_hash_table_insert (data->rule_data, name, rule_array);
   }
 
   rule.from_year = parse_year (data, data->fields[RULE_FROM], FALSE, 0);
   if (rule.from_year == YEAR_MAXIMUM) {
     fprintf (stderr, "%s:%i: Invalid Rule FROM value: '%s'\n",
              data->filename, data->line_number, data->fields[RULE_FROM]);
-    exit (1);
+    parse_error (data);
   }
 
   rule.to_year = parse_year (data, data->fields[RULE_TO], TRUE,
@@ -441,7 +528,7 @@ parse_rule_line                 (ParsingData    *data)
   if (rule.to_year == YEAR_MINIMUM) {
     fprintf (stderr, "%s:%i: Invalid Rule TO value: %s\n",
              data->filename, data->line_number, data->fields[RULE_TO]);
-    exit (1);
+    parse_error (data);
   }
 
   /* We also want to know the maximum year used in any TO/FROM value, so we
@@ -455,7 +542,7 @@ parse_rule_line                 (ParsingData    *data)
     rule.type = NULL;
   else {
     printf ("Type: %s\n", data->fields[RULE_TYPE]);
-    rule.type = g_strdup (data->fields[RULE_TYPE]);
+    rule.type = intern_string (data->fields[RULE_TYPE]);
   }
 
   rule.in_month = parse_month (data, data->fields[RULE_IN]);
@@ -468,11 +555,9 @@ parse_rule_line                 (ParsingData    *data)
   if (!strcmp (data->fields[RULE_LETTER_S], "-")) {
     rule.letter_s = NULL;
   } else {
-    rule.letter_s = g_strdup (data->fields[RULE_LETTER_S]);
+    rule.letter_s = intern_string (data->fields[RULE_LETTER_S]);
   }
 
-  rule.is_shallow_copy = FALSE;
-
   g_array_append_val (rule_array, rule);
 }
 
@@ -480,15 +565,15 @@ parse_rule_line                 (ParsingData    *data)
 static void
 parse_link_line                 (ParsingData    *data)
 {
-  char *from, *to, *old_from;
+  char *from, *to;
   GList *zone_list;
 
   /* We must have 3 fields for a Link. */
   if (data->num_fields != 3) {
-        fprintf (stderr, "%s:%i: Invalid Rule line - %i fields.\n%s\n",
+        fprintf (stderr, "%s:%i: Invalid Rule line - %i fields.\n%.*s\n",
                  data->filename, data->line_number, data->num_fields,
-                 data->line);
-        exit (1);
+                 data->line_len, data->line);
+        parse_error (data);
   }
 
   from = data->fields[LINK_FROM];
@@ -498,48 +583,11 @@ parse_link_line                 (ParsingData    *data)
   printf ("LINK FROM: %s\tTO: %s\n", from, to);
 #endif
 
-#if CREATE_SYMLINK
-  {
-      int len = strnlen(to,254);
-      int dirs = 0;
-      int i;
-      for (i = 0; i < len; i++) {
-          dirs += to[i] == '/' ? 1 : 0;
-      }
-      if (dirs >= 0) {
-          char rel_from[255];
-          char to_dir[255];
-          char to_path[255];
-          if (dirs == 0) {
-              sprintf(rel_from, "%s.ics", from);
-          } else if (dirs == 1) {
-              sprintf(rel_from, "../%s.ics", from);
-          } else if (dirs == 2) {
-              sprintf(rel_from, "../../%s.ics", from);
-          } else {
-              return;
-          }
-          sprintf(to_path, "%s/%s.ics", VzicOutputDir, to);
-          strncpy(to_dir, to_path, 254);
-          ensure_directory_exists(dirname(to_dir));
-          //printf("Creating symlink from %s to %s\n", rel_from, to_path);
-          symlink(rel_from, to_path);
-      }
-  }
-#else
-  if (g_hash_table_lookup_extended (data->link_data, from,
-                                    (gpointer) &old_from,
-                                    (gpointer) &zone_list)) {
-    from = old_from;
-  } else {
-    from = g_strdup (from);
-    zone_list = NULL;
-  }
-
-  zone_list = g_list_prepend (zone_list, g_strdup (to));
+  from = intern_string (from);
+  zone_list = g_hash_table_lookup (data->link_data, from);
+  zone_list = g_list_prepend (zone_list, intern_string (to));
 
   g_hash_table_insert (data->link_data, from, zone_list);
-#endif
 }
 
 
@@ -553,9 +601,9 @@ parse_year                      (ParsingData    *data,
   char *p;
 
   if (!field) {
-    fprintf (stderr, "%s:%i: Missing year.\n%s\n", data->filename,
-             data->line_number, data->line);
-    exit (1);
+    fprintf (stderr, "%s:%i: Missing year.\n%.*s\n", data->filename,
+             data->line_number, data->line_len, data->line);
+    parse_error (data);
   }
 
   len = strlen (field);
@@ -570,18 +618,18 @@ parse_year                      (ParsingData    *data,
 
   for (p = field; *p; p++) {
     if (*p < '0' || *p > '9') {
-        fprintf (stderr, "%s:%i: Invalid year: %s\n%s\n", data->filename,
-                 data->line_number, field, data->line);
-        exit (1);
+        fprintf (stderr, "%s:%i: Invalid year: %s\n%.*s\n", data->filename,
+                 data->line_number, field, data->line_len, data->line);
+        parse_error (data);
     }
 
     year = year * 10 + *p - '0';
   }
 
   if (year < 1000 || year > 2100) {
-        fprintf (stderr, "%s:%i: Strange year: %s\n%s\n", data->filename,
-                 data->line_number, field, data->line);
-        exit (1);
+        fprintf (stderr, "%s:%i: Strange year: %s\n%.*s\n", data->filename,
+                 data->line_number, field, data->line_len, data->line);
+        parse_error (data);
   }
 
   return year;
@@ -613,9 +661,9 @@ parse_month                     (ParsingData    *data,
       return i;
   }
 
-  fprintf (stderr, "%s:%i: Invalid month: %s\n%s\n", data->filename,
-           data->line_number, field, data->line);
-  exit (1);
+  fprintf (stderr, "%s:%i: Invalid month: %s\n%.*s\n", data->filename,
+           data->line_number, field, data->line_len, data->line);
+  parse_error (data);
 }
 
 
@@ -632,6 +680,7 @@ parse_day                       (ParsingData    *data,
 
   if (!field) {
     *day = 1;
+    *weekday = 0;
     return DAY_SIMPLE;
   }
 
@@ -658,26 +707,26 @@ parse_day                       (ParsingData    *data,
         break;
       }
 
-      fprintf (stderr, "%s:%i: Invalid day: %s\n%s\n", data->filename,
-               data->line_number, field, data->line);
-      exit (1);
+      fprintf (stderr, "%s:%i: Invalid day: %s\n%.*s\n", data->filename,
+               data->line_number, field, data->line_len, data->line);
+      parse_error (data);
     }
   }
 
   for (p = day_part; *p; p++) {
     if (*p < '0' || *p > '9') {
-        fprintf (stderr, "%s:%i: Invalid day: %s\n%s\n", data->filename,
-                 data->line_number, field, data->line);
-        exit (1);
+        fprintf (stderr, "%s:%i: Invalid day: %s\n%.*s\n", data->filename,
+                 data->line_number, field, data->line_len, data->line);
+        parse_error (data);
     }
 
     *day = *day * 10 + *p - '0';
   }
 
   if (*day < 1 || *day > 31) {
-    fprintf (stderr, "%s:%i: Invalid day: %s\n%s\n", data->filename,
-             data->line_number, field, data->line);
-    exit (1);
+    fprintf (stderr, "%s:%i: Invalid day: %s\n%.*s\n", data->filename,
+             data->line_number, field, data->line_len, data->line);
+    parse_error (data);
   }
 
   return day_code;
@@ -703,9 +752,9 @@ parse_weekday                   (ParsingData    *data,
       return i;
   }
 
-  fprintf (stderr, "%s:%i: Invalid weekday: %s\n%s\n", data->filename,
-           data->line_number, field, data->line);
-  exit (1);
+  fprintf (stderr, "%s:%i: Invalid weekday: %s\n%.*s\n", data->filename,
+           data->line_number, field, data->line_len, data->line);
+  parse_error (data);
 }
 
 
@@ -748,9 +797,9 @@ parse_time                      (ParsingData    *data,
       || minutes < 0 || minutes > 59
       || seconds < 0 || seconds > 59
       || (hours == 24 && (minutes != 0 || seconds != 0))) {
-    fprintf (stderr, "%s:%i: Invalid time: %s\n%s\n", data->filename,
-             data->line_number, field, data->line);
-    exit (1);
+    fprintf (stderr, "%s:%i: Invalid time: %s\n%.*s\n", data->filename,
+             data->line_number, field, data->line_len, data->line);
+    parse_error (data);
   }
 
 #if 0
@@ -788,9 +837,9 @@ parse_time                      (ParsingData    *data,
     }
   }
 
-  fprintf (stderr, "%s:%i: Invalid time: %s\n%s\n", data->filename,
-           data->line_number, field, data->line);
-  exit (1);
+  fprintf (stderr, "%s:%i: Invalid time: %s\n%.*s\n", data->filename,
+           data->line_number, field, data->line_len, data->line);
+  parse_error (data);
 }
 
 
@@ -815,9 +864,9 @@ parse_number                    (ParsingData    *data,
   }
 
   if (*p < '0' || *p > '9') {
-    fprintf (stderr, "%s:%i: Invalid number: %s\n%s\n", data->filename,
-             data->line_number, *num, data->line);
-    exit (1);
+    fprintf (stderr, "%s:%i: Invalid number: %s\n%.*s\n", data->filename,
+             data->line_number, *num, data->line_len, data->line);
+    parse_error (data);
   }
 
   result = *p++ - '0';
@@ -849,7 +898,7 @@ parse_rules_save                (ParsingData    *data,
     return parse_time (data, field, &time_code);
 
   /* It must be a rules name. */
-  *rules = g_strdup (field);
+  *rules = intern_string (field);
   return 0;
 }
 
@@ -27,7 +27,7 @@
 
 #include <glib.h>
 
-void            parse_olson_file                (char           *filename,
+gboolean        parse_olson_file                (char           *filename,
                                                  GArray        **zone_data,
                                                  GHashTable    **rule_data,
                                                  GHashTable    **link_data,
@@ -0,0 +1,218 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The protocol is line-based. A client connects to the socket and sends one
+ * or more requests, each of which gets a one-line reply, "OK ..." or
+ * "ERROR <message>":
+ *
+ *   RELOAD <file>              The Olson file has been changed, e.g.
+ *                              'RELOAD europe'. The reply is "OK <n>", where
+ *                              n is the number of zones output again.
+ *
+ *   UPDATE <file> <length>     Followed by <length> bytes, which replace the
+ *                              Olson file before it is reloaded, so a patched
+ *                              file can be submitted from another host. The
+ *                              file is only replaced if it can be parsed.
+ *
+ *   QUIT                       Stop the daemon.
+ *
+ * The requests are handled one at a time, so a client waiting for its reply
+ * knows all the affected files have been output.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "vzic.h"
+#include "vzic-serve.h"
+
+
+/* The maximum size of a file sent with UPDATE. The biggest Olson files are
+   a few hundred KB. */
+#define SERVE_MAX_FILE_SIZE     (16 * 1024 * 1024)
+
+
+static gboolean serve_client                    (int             fd,
+                                                 VzicReloadFunc  reload);
+static void     serve_reload_reply              (int             fd,
+                                                 char           *file_name,
+                                                 int             num_zones);
+static void     serve_reply                     (int             fd,
+                                                 const char     *format,
+                                                 ...) G_GNUC_PRINTF (2, 3);
+
+
+void
+serve_requests                  (char           *socket_path,
+                                 VzicReloadFunc  reload)
+{
+  struct sockaddr_un addr;
+  int fd, client_fd;
+  gboolean quit = FALSE;
+
+  if (strlen (socket_path) >= sizeof (addr.sun_path)) {
+    fprintf (stderr, "Socket path too long: %s\n", socket_path);
+    exit (1);
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, socket_path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf (stderr, "Couldn't create socket (%s)\n", strerror (errno));
+    exit (1);
+  }
+
+  /* Remove the socket left by a previous daemon. */
+  unlink (socket_path);
+
+  if (bind (fd, (struct sockaddr*) &addr, sizeof (addr)) != 0
+      || listen (fd, 8) != 0) {
+    fprintf (stderr, "Couldn't listen on socket: %s (%s)\n", socket_path,
+             strerror (errno));
+    exit (1);
+  }
+
+  /* A client may go away before it gets its reply, which would otherwise
+     kill the daemon with SIGPIPE. */
+  signal (SIGPIPE, SIG_IGN);
+
+  printf ("Listening on %s\n", socket_path);
+  fflush (stdout);
+
+  while (!quit) {
+    client_fd = accept (fd, NULL, NULL);
+    if (client_fd < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Couldn't accept connection (%s)\n", strerror (errno));
+      exit (1);
+    }
+
+    quit = serve_client (client_fd, reload);
+  }
+
+  close (fd);
+  unlink (socket_path);
+}
+
+
+/* This handles the requests from one client until it closes the connection.
+   It returns TRUE if it got a QUIT request. */
+static gboolean
+serve_client                    (int             fd,
+                                 VzicReloadFunc  reload)
+{
+  FILE *fp;
+  char line[1024], file_name[256], *contents;
+  int length, num_zones;
+  gboolean quit = FALSE;
+
+  fp = fdopen (fd, "r");
+  if (!fp) {
+    close (fd);
+    return FALSE;
+  }
+
+  while (!quit && fgets (line, sizeof (line), fp)) {
+    g_strchomp (line);
+
+    if (sscanf (line, "RELOAD %255s", file_name) == 1) {
+      num_zones = reload (file_name, NULL, 0);
+      serve_reload_reply (fd, file_name, num_zones);
+    } else if (sscanf (line, "UPDATE %255s %i", file_name, &length) == 2) {
+      if (length < 0 || length > SERVE_MAX_FILE_SIZE) {
+        serve_reply (fd, "ERROR Invalid length: %i\n", length);
+        break;
+      }
+
+      contents = g_malloc (length + 1);
+      if (fread (contents, 1, length, fp) != length) {
+        g_free (contents);
+        break;
+      }
+
+      num_zones = reload (file_name, contents, length);
+      serve_reload_reply (fd, file_name, num_zones);
+
+      g_free (contents);
+    } else if (!strcmp (line, "QUIT")) {
+      serve_reply (fd, "OK\n");
+      quit = TRUE;
+    } else {
+      serve_reply (fd, "ERROR Invalid request\n");
+    }
+  }
+
+  fclose (fp);
+
+  return quit;
+}
+
+
+static void
+serve_reload_reply              (int             fd,
+                                 char           *file_name,
+                                 int             num_zones)
+{
+  if (num_zones == -1)
+    serve_reply (fd, "ERROR Unknown file: %s\n", file_name);
+  else if (num_zones < 0)
+    serve_reply (fd, "ERROR Invalid file: %s\n", file_name);
+  else
+    serve_reply (fd, "OK %i\n", num_zones);
+}
+
+
+/* If the client has gone away this fails with EPIPE, which we ignore. */
+static void
+serve_reply                     (int             fd,
+                                 const char     *format,
+                                 ...)
+{
+  char buffer[1024];
+  va_list args;
+  int length;
+
+  va_start (args, format);
+  length = vsnprintf (buffer, sizeof (buffer), format, args);
+  va_end (args);
+
+  if (length >= sizeof (buffer))
+    length = sizeof (buffer) - 1;
+
+  send (fd, buffer, length, 0);
+}
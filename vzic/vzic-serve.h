@@ -0,0 +1,47 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+/*
+ * The --serve daemon. It listens on a Unix socket for requests to reload
+ * one of the Olson files, which vzic.c then parses again to output the zones
+ * affected by the changes. See vzic-serve.c for the protocol.
+ */
+
+#ifndef _VZIC_SERVE_H_
+#define _VZIC_SERVE_H_
+
+#include <glib.h>
+
+/* This is called to reload an Olson file, after replacing it with contents
+   if that isn't NULL. It returns the number of zones output, -1 if the file
+   isn't one of the Olson files we convert, or -2 if it has an error, in
+   which case the old file is kept. */
+typedef int (*VzicReloadFunc) (char           *file_name,
+                               const char     *contents,
+                               gsize           length);
+
+/* This handles requests until it gets a QUIT request. */
+void            serve_requests                  (char           *socket_path,
+                                                 VzicReloadFunc  reload);
+
+#endif /* _VZIC_SERVE_H_ */
@@ -0,0 +1,318 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --tables backend. It outputs a binary table of the transitions of each
+ * zone and Link alias into the tables directory, for libcyrus-tz to look up
+ * the local time of UTC times without parsing the VTIMEZONE files. See
+ * libcyrus-tz/cyrus-tz-format.h for the format.
+ *
+ * The recurring changes at the end of a zone are expanded up to
+ * TABLE_MAX_YEAR, so most lookups are a simple binary search, and are also
+ * stored as they are, so libcyrus-tz can calculate the changes after that.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vzic.h"
+#include "vzic-backend.h"
+#include "vzic-output.h"
+#include "vzic-table.h"
+
+#include "cyrus-tz-format.h"
+
+
+/* The year we expand the recurring changes up to. */
+#define TABLE_MAX_YEAR          2100
+
+
+static gboolean table_is_enabled                (VzicFlavor     *flavor);
+static void     table_output_zone               (VzicOutputZone *zone);
+static void     table_add_transition            (GString        *table,
+                                                 GArray         *local_times,
+                                                 gint64          utc_time,
+                                                 int             stdoff,
+                                                 int             walloff,
+                                                 int             prev_walloff,
+                                                 int             abbrev);
+static void     table_add_recurrence            (GString        *table,
+                                                 VzicRecurrence *recurrence,
+                                                 int             abbrev);
+static int      table_abbrev_offset             (char           *zone_name,
+                                                 GString        *abbrevs,
+                                                 GHashTable     *abbrev_offsets,
+                                                 char           *tzname);
+static void     table_append_int32              (GString        *table,
+                                                 gint32          value);
+static void     table_append_int64              (GString        *table,
+                                                 gint64          value);
+static void     table_set_uint32                (GString        *table,
+                                                 int             pos,
+                                                 guint32         value);
+
+
+VzicBackend VzicTableBackend = {
+  "tables",
+  table_is_enabled,
+  table_output_zone,
+  NULL
+};
+
+
+static gboolean
+table_is_enabled                (VzicFlavor     *flavor)
+{
+  return VzicOutputTables;
+}
+
+
+/* The aliases get a copy of the zone's table, since it doesn't contain the
+   name of the zone. */
+static void
+table_output_zone               (VzicOutputZone *zone)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  GString *table;
+  GList *elem;
+
+  table = table_build (zone->zone->zone_name,
+                       output_zone_get_transitions (zone));
+
+  if (output_zone_filename (zone, &VzicTableBackend, zone->zone->zone_name,
+                            ".tzt", filename))
+    write_file_atomically (filename, table->str, table->len);
+
+  for (elem = zone->links; elem; elem = elem->next) {
+    if (output_zone_filename (zone, &VzicTableBackend, elem->data, ".tzt",
+                              filename))
+      write_file_atomically (filename, table->str, table->len);
+  }
+
+  g_string_free (table, TRUE);
+}
+
+
+GString*
+table_build                     (char           *zone_name,
+                                 VzicZoneTransitions *transitions)
+{
+  GString *table, *abbrevs;
+  GHashTable *abbrev_offsets;
+  GArray *local_times;
+  VzicTransition *transition;
+  VzicRecurrence *recurrence;
+  int i, year, year_offset, num_transitions, abbrev, prev_walloff;
+  gboolean done = FALSE;
+
+  table = g_string_sized_new (CYRUS_TZ_HEADER_SIZE
+                              + 256 * CYRUS_TZ_TRANSITION_SIZE);
+  g_string_append_len (table, CYRUS_TZ_MAGIC, CYRUS_TZ_MAGIC_LENGTH);
+  g_string_append_c (table, CYRUS_TZ_FORMAT_VERSION);
+  while (table->len < CYRUS_TZ_HEADER_SIZE)
+    g_string_append_c (table, '\0');
+
+  /* The first abbreviation is the empty one, for zones without any. */
+  abbrevs = g_string_new (NULL);
+  g_string_append_c (abbrevs, '\0');
+  abbrev_offsets = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  /* The local times are output after the transitions. */
+  local_times = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  prev_walloff = transitions->transitions[0].walloff;
+  for (i = 0; i < transitions->num_transitions; i++) {
+    transition = &transitions->transitions[i];
+    abbrev = table_abbrev_offset (zone_name, abbrevs, abbrev_offsets,
+                                  transition->tzname);
+    table_add_transition (table, local_times, transition->utc_time,
+                          transition->stdoff, transition->walloff,
+                          prev_walloff, abbrev);
+    prev_walloff = transition->walloff;
+  }
+  num_transitions = transitions->num_transitions;
+
+  /* Expand the recurring changes, in the same order as dump_changes() in
+     vzic-changes.c. */
+  for (year_offset = 1; transitions->num_recurrences && !done; year_offset++) {
+    for (i = 0; i < transitions->num_recurrences; i++) {
+      recurrence = &transitions->recurrences[i];
+      year = recurrence->first_year + year_offset;
+      if (year > TABLE_MAX_YEAR) {
+        done = TRUE;
+        break;
+      }
+
+      abbrev = table_abbrev_offset (zone_name, abbrevs, abbrev_offsets,
+                                    recurrence->tzname);
+      table_add_transition (table, local_times,
+                            output_recurrence_time (recurrence, year),
+                            recurrence->stdoff, recurrence->walloff,
+                            prev_walloff, abbrev);
+      prev_walloff = recurrence->walloff;
+      num_transitions++;
+    }
+  }
+
+  for (i = 0; i < local_times->len; i++)
+    table_append_int64 (table, g_array_index (local_times, gint64, i));
+  g_array_free (local_times, TRUE);
+
+  for (i = 0; i < transitions->num_recurrences; i++) {
+    recurrence = &transitions->recurrences[i];
+    abbrev = table_abbrev_offset (zone_name, abbrevs, abbrev_offsets,
+                                  recurrence->tzname);
+    table_add_recurrence (table, recurrence, abbrev);
+  }
+
+  g_string_append_len (table, abbrevs->str, abbrevs->len);
+
+  table_set_uint32 (table, CYRUS_TZ_HEADER_NUM_TRANSITIONS, num_transitions);
+  table_set_uint32 (table, CYRUS_TZ_HEADER_NUM_RECURRENCES,
+                    transitions->num_recurrences);
+  table_set_uint32 (table, CYRUS_TZ_HEADER_ABBREVS_LENGTH, abbrevs->len);
+
+  g_hash_table_destroy (abbrev_offsets);
+  g_string_free (abbrevs, TRUE);
+
+  return table;
+}
+
+
+/* This adds a transition, and the first local time affected by it to
+   local_times. */
+static void
+table_add_transition            (GString        *table,
+                                 GArray         *local_times,
+                                 gint64          utc_time,
+                                 int             stdoff,
+                                 int             walloff,
+                                 int             prev_walloff,
+                                 int             abbrev)
+{
+  gint64 local_time;
+
+  if (utc_time == G_MININT64)
+    local_time = G_MININT64;
+  else
+    local_time = utc_time + MIN (walloff, prev_walloff);
+  g_array_append_val (local_times, local_time);
+
+  table_append_int64 (table, utc_time);
+  table_append_int32 (table, walloff);
+  g_string_append_c (table, stdoff != walloff ? 1 : 0);
+  g_string_append_c (table, abbrev);
+  g_string_append_len (table, "\0\0", 2);
+}
+
+
+/* The DayCode and TimeCode values are the same as in the table format. */
+static void
+table_add_recurrence            (GString        *table,
+                                 VzicRecurrence *recurrence,
+                                 int             abbrev)
+{
+  table_append_int32 (table, recurrence->month);
+  table_append_int32 (table, recurrence->day_code);
+  table_append_int32 (table, recurrence->day_number);
+  table_append_int32 (table, recurrence->day_weekday);
+  table_append_int32 (table, recurrence->time_seconds);
+  table_append_int32 (table, recurrence->time_code);
+  table_append_int32 (table, recurrence->prev_stdoff);
+  table_append_int32 (table, recurrence->prev_walloff);
+  table_append_int32 (table, recurrence->walloff);
+  g_string_append_c (table, recurrence->stdoff != recurrence->walloff ? 1 : 0);
+  g_string_append_c (table, abbrev);
+  g_string_append_len (table, "\0\0", 2);
+}
+
+
+/* This returns the offset of the abbreviation in the abbreviations section,
+   adding it if needed. The tznames are interned, so we can hash the
+   pointers. The offsets have to fit in a byte. */
+static int
+table_abbrev_offset             (char           *zone_name,
+                                 GString        *abbrevs,
+                                 GHashTable     *abbrev_offsets,
+                                 char           *tzname)
+{
+  gpointer offset;
+
+  if (!tzname)
+    return 0;
+
+  offset = g_hash_table_lookup (abbrev_offsets, tzname);
+  if (offset)
+    return GPOINTER_TO_INT (offset);
+
+  if (abbrevs->len > 255) {
+    fprintf (stderr, "Too many abbreviations in zone: %s\n", zone_name);
+    exit (1);
+  }
+
+  offset = GINT_TO_POINTER (abbrevs->len);
+  g_string_append_len (abbrevs, tzname, strlen (tzname) + 1);
+
+  g_hash_table_insert (abbrev_offsets, tzname, offset);
+
+  return GPOINTER_TO_INT (offset);
+}
+
+
+static void
+table_append_int32              (GString        *table,
+                                 gint32          value)
+{
+  guint32 v = value;
+  char bytes[4];
+  int i;
+
+  for (i = 0; i < 4; i++)
+    bytes[i] = (v >> (i * 8)) & 0xFF;
+  g_string_append_len (table, bytes, 4);
+}
+
+
+static void
+table_append_int64              (GString        *table,
+                                 gint64          value)
+{
+  table_append_int32 (table, (guint64) value & 0xFFFFFFFF);
+  table_append_int32 (table, (guint64) value >> 32);
+}
+
+
+static void
+table_set_uint32                (GString        *table,
+                                 int             pos,
+                                 guint32         value)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    table->str[pos + i] = (value >> (i * 8)) & 0xFF;
+}
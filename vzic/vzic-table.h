@@ -0,0 +1,40 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The binary transition tables of --tables, which are also stored in the
+ * --bundle file. See libcyrus-tz/cyrus-tz-format.h for the format.
+ * vzic.h and vzic-backend.h must be included before this.
+ */
+
+#ifndef _VZIC_TABLE_H_
+#define _VZIC_TABLE_H_
+
+#include <glib.h>
+
+/* Returns the table of a zone's transitions. */
+GString*        table_build                     (char           *zone_name,
+                                                 VzicZoneTransitions *transitions);
+
+#endif /* _VZIC_TABLE_H_ */
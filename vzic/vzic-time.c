@@ -0,0 +1,208 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * The conversions between dates and days are the usual ones for the
+ * Gregorian calendar. We count the years from 1st March, so the leap day
+ * comes at the end of the year, and split the years into 400-year eras,
+ * which always have the same number of days. Then the day of the year can be
+ * found with a simple formula, without looking up the length of each month.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vzic.h"
+#include "vzic-time.h"
+
+
+#define SECONDS_PER_DAY         (24 * 60 * 60)
+
+/* The number of days in each 400-year era. */
+#define DAYS_PER_ERA            146097
+
+/* The number of days from 1st March 0000 to 1st Jan 1970. */
+#define DAYS_TO_EPOCH           719468
+
+/* 1st Jan 1970 was a Thursday. */
+#define EPOCH_WEEKDAY           4
+
+
+static const int DaysInMonth[2][12] = {
+  { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 },
+  { 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 }
+};
+
+/* The number of days from one weekday to the next occurrence of another
+   weekday (or the same day), i.e. DaysToWeekday[from][to]. */
+static const int DaysToWeekday[7][7] = {
+  { 0, 1, 2, 3, 4, 5, 6 },
+  { 6, 0, 1, 2, 3, 4, 5 },
+  { 5, 6, 0, 1, 2, 3, 4 },
+  { 4, 5, 6, 0, 1, 2, 3 },
+  { 3, 4, 5, 6, 0, 1, 2 },
+  { 2, 3, 4, 5, 6, 0, 1 },
+  { 1, 2, 3, 4, 5, 6, 0 }
+};
+
+
+/* Returns the number of days from 1st Jan 1970 to the given date. A month
+   of 12 is taken as January of the next year, since calculate_actual_time()
+   may move a date past the end of December. */
+gint64
+time_days_from_civil            (int             year,
+                                 int             month,
+                                 int             day)
+{
+  gint64 y, era;
+  int year_of_era, day_of_year, day_of_era;
+
+  y = (gint64) year + month / 12;
+  month %= 12;
+  if (month < 2)
+    y--;
+
+  era = (y >= 0 ? y : y - 399) / 400;
+  year_of_era = y - era * 400;
+  day_of_year = (153 * ((month + 10) % 12) + 2) / 5 + day - 1;
+  day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100
+    + day_of_year;
+
+  return era * DAYS_PER_ERA + day_of_era - DAYS_TO_EPOCH;
+}
+
+
+/* Converts a number of days since 1st Jan 1970 back to a date. */
+void
+time_civil_from_days            (gint64          days,
+                                 int            *year,
+                                 int            *month,
+                                 int            *day)
+{
+  gint64 era;
+  int day_of_era, year_of_era, day_of_year, mp;
+
+  days += DAYS_TO_EPOCH;
+  era = (days >= 0 ? days : days - DAYS_PER_ERA + 1) / DAYS_PER_ERA;
+  day_of_era = days - era * DAYS_PER_ERA;
+  year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524
+                 - day_of_era / (DAYS_PER_ERA - 1)) / 365;
+  day_of_year = day_of_era - (year_of_era * 365 + year_of_era / 4
+                              - year_of_era / 100);
+  mp = (5 * day_of_year + 2) / 153;
+
+  *day = day_of_year - (153 * mp + 2) / 5 + 1;
+  *month = (mp + 2) % 12;
+  *year = era * 400 + year_of_era + (*month < 2 ? 1 : 0);
+}
+
+
+int
+time_days_in_month              (int             year,
+                                 int             month)
+{
+  gboolean is_leap;
+
+  is_leap = (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0));
+
+  return DaysInMonth[is_leap ? 1 : 0][month];
+}
+
+
+/* Returns the weekday of the given number of days since 1st Jan 1970. */
+int
+time_weekday                    (gint64          days)
+{
+  return (days % 7 + 7 + EPOCH_WEEKDAY) % 7;
+}
+
+
+/* This returns the day of the month that the given day code refers to, e.g.
+   the last Sunday or the first Monday on or after the 8th. Note that the
+   result may be in the next month (e.g. 'Sun>=29') or the previous one, in
+   which case it is > the number of days in the month or <= 0. */
+int
+time_resolve_day                (int             year,
+                                 int             month,
+                                 DayCode         day_code,
+                                 int             day_number,
+                                 int             day_weekday)
+{
+  int weekday;
+
+  switch (day_code) {
+  case DAY_SIMPLE:
+    return day_number;
+  case DAY_LAST_WEEKDAY:
+    /* Go back from the last day of the month to the weekday. */
+    day_number = time_days_in_month (year, month);
+    weekday = time_weekday (time_days_from_civil (year, month, day_number));
+    return day_number - DaysToWeekday[day_weekday][weekday];
+  case DAY_WEEKDAY_ON_OR_AFTER:
+    weekday = time_weekday (time_days_from_civil (year, month, day_number));
+    return day_number + DaysToWeekday[weekday][day_weekday];
+  case DAY_WEEKDAY_ON_OR_BEFORE:
+    weekday = time_weekday (time_days_from_civil (year, month, day_number));
+    return day_number - DaysToWeekday[day_weekday][weekday];
+  default:
+    fprintf (stderr, "Invalid day code\n");
+    exit (1);
+  }
+}
+
+
+/* Returns the number of seconds from 1st Jan 1970 to the given date and
+   time. YEAR_MINIMUM and YEAR_MAXIMUM are mapped to G_MININT64 and
+   G_MAXINT64, so they still sort before and after all other times. */
+gint64
+time_to_seconds                 (int             year,
+                                 int             month,
+                                 int             day,
+                                 int             seconds)
+{
+  if (year == YEAR_MINIMUM)
+    return G_MININT64;
+  if (year == YEAR_MAXIMUM)
+    return G_MAXINT64;
+
+  return time_days_from_civil (year, month, day) * SECONDS_PER_DAY + seconds;
+}
+
+
+/* Rounds a UTC offset to the nearest minute, as the Outlook-compatible
+   output does for the Zone lines. This also works with -ve numbers, I think.
+   -56 % 60 = -59. -61 % 60 = -1. */
+int
+time_round_to_minute            (int             seconds)
+{
+  if (seconds >= 0)
+    seconds += 30;
+  else
+    seconds -= 29;
+
+  return seconds - seconds % 60;
+}
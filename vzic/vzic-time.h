@@ -0,0 +1,64 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+ * These functions do the calendar calculations, using the proleptic Gregorian
+ * calendar like zic does. Dates are converted to a count of days or seconds
+ * since 1st Jan 1970, so they work for any year, and times can be compared
+ * as integers. Months are 0 (Jan) to 11 (Dec) and weekdays are 0 (Sun) to
+ * 6 (Sat), as in the rest of vzic. vzic.h must be included before this.
+ */
+
+#ifndef _VZIC_TIME_H_
+#define _VZIC_TIME_H_
+
+#include <glib.h>
+
+gint64          time_days_from_civil            (int             year,
+                                                 int             month,
+                                                 int             day);
+void            time_civil_from_days            (gint64          days,
+                                                 int            *year,
+                                                 int            *month,
+                                                 int            *day);
+
+int             time_days_in_month              (int             year,
+                                                 int             month);
+int             time_weekday                    (gint64          days);
+
+int             time_resolve_day                (int             year,
+                                                 int             month,
+                                                 DayCode         day_code,
+                                                 int             day_number,
+                                                 int             day_weekday);
+
+gint64          time_to_seconds                 (int             year,
+                                                 int             month,
+                                                 int             day,
+                                                 int             seconds);
+
+int             time_round_to_minute            (int             seconds);
+
+#endif /* _VZIC_TIME_H_ */
@@ -0,0 +1,573 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --tzif-dir backend. It outputs a TZif file (RFC 8536, see tzfile(5))
+ * for each zone and Link alias, like the ones zic outputs for the C library,
+ * from the same transitions as the VTIMEZONE files. The UTC offsets are
+ * never rounded, whatever the flavor.
+ *
+ * Like 'zic -b slim', we only output the 64-bit data of version 2, with an
+ * empty version 1 block, and the changes after the last transition are
+ * given by a POSIX TZ string in the footer, e.g.
+ * "CET-1CEST,M3.5.0,M10.5.0/3". Version 3 is used if the TZ string needs
+ * its extensions, i.e. times of day outside 0 to 24 hours. If the recurring
+ * changes of a zone can't be given by a TZ string, we expand them for a
+ * whole 400-year cycle of the calendar after 2037 instead and leave the
+ * footer empty, as zic does.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vzic.h"
+#include "vzic-backend.h"
+#include "vzic-output.h"
+#include "vzic-time.h"
+
+
+/* The year we expand the recurring changes up to if they can't be given by
+   a TZ string. */
+#define TZIF_MAX_YEAR           (2037 + 400)
+
+/* The size of the header of each data block. */
+#define TZIF_HEADER_SIZE        44
+
+/* The default time of day of the changes in a TZ string, 02:00. */
+#define TZIF_DEFAULT_TIME       (2 * 60 * 60)
+
+
+/* The transitions and local time types of a TZif file. */
+typedef struct _VzicTzifData VzicTzifData;
+struct _VzicTzifData
+{
+  char         *zone_name;
+
+  GArray       *times;
+  GByteArray   *type_indexes;
+
+  /* The local time types, each the 6-byte ttinfo structure, and the
+     abbreviations they use, each ending with a nul. */
+  GByteArray   *types;
+  GString      *abbrevs;
+  int           num_types;
+};
+
+
+static gboolean tzif_is_enabled                 (VzicFlavor     *flavor);
+static void     tzif_output_zone                (VzicOutputZone *zone);
+static char*    tzif_output_dir                 (VzicFlavor     *flavor);
+static GString* tzif_build                      (char           *zone_name,
+                                                 VzicZoneTransitions *transitions);
+static void     tzif_add_transition             (VzicTzifData   *data,
+                                                 gint64          utc_time,
+                                                 int             stdoff,
+                                                 int             walloff,
+                                                 char           *tzname);
+static int      tzif_find_type                  (VzicTzifData   *data,
+                                                 int             stdoff,
+                                                 int             walloff,
+                                                 char           *tzname);
+static void     tzif_expand_recurrences         (VzicTzifData   *data,
+                                                 VzicZoneTransitions *transitions);
+static void     tzif_append_header              (GString        *out,
+                                                 char            version,
+                                                 int             timecnt,
+                                                 int             typecnt,
+                                                 int             charcnt);
+static char     tzif_tz_string                  (GString        *out,
+                                                 VzicZoneTransitions *transitions);
+static gboolean tzif_append_rule                (GString        *out,
+                                                 VzicRecurrence *recurrence,
+                                                 char           *version);
+static gboolean tzif_append_abbrev              (GString        *out,
+                                                 char           *tzname);
+static void     tzif_append_time                (GString        *out,
+                                                 int             seconds);
+static void     tzif_append_int32               (GString        *out,
+                                                 gint32          value);
+static void     tzif_append_int64               (GString        *out,
+                                                 gint64          value);
+
+
+VzicBackend VzicTzifBackend = {
+  NULL,
+  tzif_is_enabled,
+  tzif_output_zone,
+  tzif_output_dir
+};
+
+
+static gboolean
+tzif_is_enabled                 (VzicFlavor     *flavor)
+{
+  return VzicTzifDir && flavor == &VzicFlavors[0];
+}
+
+
+static char*
+tzif_output_dir                 (VzicFlavor     *flavor)
+{
+  return VzicTzifDir;
+}
+
+
+/* The aliases get a copy of the zone's file, as with the tables. */
+static void
+tzif_output_zone                (VzicOutputZone *zone)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  GString *tzif;
+  GList *elem;
+
+  tzif = tzif_build (zone->zone->zone_name,
+                     output_zone_get_exact_transitions (zone));
+
+  if (output_zone_filename (zone, &VzicTzifBackend, zone->zone->zone_name,
+                            "", filename))
+    write_file_atomically (filename, tzif->str, tzif->len);
+
+  for (elem = zone->links; elem; elem = elem->next) {
+    if (output_zone_filename (zone, &VzicTzifBackend, elem->data, "",
+                              filename))
+      write_file_atomically (filename, tzif->str, tzif->len);
+  }
+
+  g_string_free (tzif, TRUE);
+}
+
+
+static GString*
+tzif_build                      (char           *zone_name,
+                                 VzicZoneTransitions *transitions)
+{
+  VzicTzifData data;
+  VzicTransition *transition;
+  GString *out, *tz_string;
+  char version;
+  int i;
+
+  data.zone_name = zone_name;
+  data.times = g_array_new (FALSE, FALSE, sizeof (gint64));
+  data.type_indexes = g_byte_array_new ();
+  data.types = g_byte_array_new ();
+  data.abbrevs = g_string_new (NULL);
+  data.num_types = 0;
+
+  /* The first transition gives the offsets used before the first change,
+     which are always the first local time type. */
+  transition = &transitions->transitions[0];
+  tzif_find_type (&data, transition->stdoff, transition->walloff,
+                  transition->tzname);
+
+  for (i = 1; i < transitions->num_transitions; i++) {
+    transition = &transitions->transitions[i];
+    tzif_add_transition (&data, transition->utc_time, transition->stdoff,
+                         transition->walloff, transition->tzname);
+  }
+
+  tz_string = g_string_new (NULL);
+  version = tzif_tz_string (tz_string, transitions);
+  if (!version) {
+    g_string_truncate (tz_string, 0);
+    tzif_expand_recurrences (&data, transitions);
+    version = '2';
+  }
+
+  out = g_string_sized_new (1024);
+
+  /* The version 1 block, which has no transitions and one unused type. */
+  tzif_append_header (out, version, 0, 1, 1);
+  g_string_append_len (out, "\0\0\0\0\0\0\0", 7);
+
+  tzif_append_header (out, version, data.times->len, data.num_types,
+                      data.abbrevs->len);
+  for (i = 0; i < data.times->len; i++)
+    tzif_append_int64 (out, g_array_index (data.times, gint64, i));
+  g_string_append_len (out, (char*) data.type_indexes->data,
+                       data.type_indexes->len);
+  g_string_append_len (out, (char*) data.types->data, data.types->len);
+  g_string_append_len (out, data.abbrevs->str, data.abbrevs->len);
+
+  g_string_append_c (out, '\n');
+  g_string_append_len (out, tz_string->str, tz_string->len);
+  g_string_append_c (out, '\n');
+
+  g_array_free (data.times, TRUE);
+  g_byte_array_free (data.type_indexes, TRUE);
+  g_byte_array_free (data.types, TRUE);
+  g_string_free (data.abbrevs, TRUE);
+  g_string_free (tz_string, TRUE);
+
+  return out;
+}
+
+
+/* The transition times must be in strictly ascending order, so a transition
+   at the same time as the previous one replaces it. */
+static void
+tzif_add_transition             (VzicTzifData   *data,
+                                 gint64          utc_time,
+                                 int             stdoff,
+                                 int             walloff,
+                                 char           *tzname)
+{
+  guint8 type_index;
+
+  type_index = tzif_find_type (data, stdoff, walloff, tzname);
+
+  if (data->times->len > 0
+      && g_array_index (data->times, gint64, data->times->len - 1)
+         >= utc_time) {
+    data->type_indexes->data[data->type_indexes->len - 1] = type_index;
+    return;
+  }
+
+  g_array_append_val (data->times, utc_time);
+  g_byte_array_append (data->type_indexes, &type_index, 1);
+}
+
+
+/* This returns the index of the local time type, adding it if it isn't
+   there. A zone only has a few types, so we just search them. */
+static int
+tzif_find_type                  (VzicTzifData   *data,
+                                 int             stdoff,
+                                 int             walloff,
+                                 char           *tzname)
+{
+  guint8 ttinfo[6];
+  char *abbrev;
+  int i, abbrev_index;
+
+  if (!tzname)
+    tzname = "";
+
+  /* The abbreviations are usually short, so we don't bother sharing the
+     suffixes of the longer ones as zic does. */
+  for (abbrev = data->abbrevs->str;
+       abbrev < data->abbrevs->str + data->abbrevs->len;
+       abbrev += strlen (abbrev) + 1) {
+    if (!strcmp (abbrev, tzname))
+      break;
+  }
+  abbrev_index = abbrev - data->abbrevs->str;
+
+  ttinfo[0] = ((guint32) walloff >> 24) & 0xFF;
+  ttinfo[1] = ((guint32) walloff >> 16) & 0xFF;
+  ttinfo[2] = ((guint32) walloff >> 8) & 0xFF;
+  ttinfo[3] = (guint32) walloff & 0xFF;
+  ttinfo[4] = stdoff != walloff;
+  ttinfo[5] = abbrev_index;
+
+  for (i = 0; i < data->num_types; i++) {
+    if (!memcmp (data->types->data + i * 6, ttinfo, 6))
+      return i;
+  }
+
+  if (data->num_types == 256 || abbrev_index > 255) {
+    fprintf (stderr, "Too many local time types in zone: %s\n",
+             data->zone_name);
+    exit (1);
+  }
+
+  if (abbrev_index == data->abbrevs->len)
+    g_string_append_len (data->abbrevs, tzname, strlen (tzname) + 1);
+
+  g_byte_array_append (data->types, ttinfo, 6);
+
+  return data->num_types++;
+}
+
+
+/* This adds the recurring changes after their first year, which is already
+   in the transitions, up to TZIF_MAX_YEAR. */
+static void
+tzif_expand_recurrences         (VzicTzifData   *data,
+                                 VzicZoneTransitions *transitions)
+{
+  VzicRecurrence *recurrence;
+  int year, i;
+
+  if (transitions->num_recurrences == 0)
+    return;
+
+  for (year = transitions->recurrences[0].first_year;
+       year <= TZIF_MAX_YEAR; year++) {
+    for (i = 0; i < transitions->num_recurrences; i++) {
+      recurrence = &transitions->recurrences[i];
+      if (year > recurrence->first_year)
+        tzif_add_transition (data, output_recurrence_time (recurrence, year),
+                             recurrence->stdoff, recurrence->walloff,
+                             recurrence->tzname);
+    }
+  }
+}
+
+
+static void
+tzif_append_header              (GString        *out,
+                                 char            version,
+                                 int             timecnt,
+                                 int             typecnt,
+                                 int             charcnt)
+{
+  int i;
+
+  g_string_append (out, "TZif");
+  g_string_append_c (out, version);
+  for (i = 0; i < 15; i++)
+    g_string_append_c (out, '\0');
+
+  /* isutcnt, isstdcnt and leapcnt are always 0. */
+  tzif_append_int32 (out, 0);
+  tzif_append_int32 (out, 0);
+  tzif_append_int32 (out, 0);
+  tzif_append_int32 (out, timecnt);
+  tzif_append_int32 (out, typecnt);
+  tzif_append_int32 (out, charcnt);
+}
+
+
+/* This outputs the TZ string for the times after the last transition. It
+   returns the TZif version it needs, '2' or '3', or 0 if the zone's changes
+   can't be given by a TZ string. */
+static char
+tzif_tz_string                  (GString        *out,
+                                 VzicZoneTransitions *transitions)
+{
+  VzicTransition *last;
+  VzicRecurrence *recurrence, *std = NULL, *dst = NULL;
+  char version = '2';
+  int i;
+
+  last = &transitions->transitions[transitions->num_transitions - 1];
+
+  if (transitions->num_recurrences == 0) {
+    if (!tzif_append_abbrev (out, last->tzname))
+      return 0;
+    if (last->stdoff == last->walloff) {
+      tzif_append_time (out, -last->walloff);
+      return version;
+    }
+
+    /* Permanent daylight-saving time is daylight-saving time all year,
+       from midnight on 1st January to midnight standard time after 31st
+       December. The standard time is never used, so it has the same
+       abbreviation. */
+    tzif_append_time (out, -last->stdoff);
+    tzif_append_abbrev (out, last->tzname);
+    tzif_append_time (out, -last->walloff);
+    g_string_append (out, ",0/0,J365/");
+    tzif_append_time (out, 24 * 60 * 60 + last->walloff - last->stdoff);
+    return '3';
+  }
+
+  /* The TZ string can only give the start and end of daylight-saving
+     time. */
+  if (transitions->num_recurrences != 2)
+    return 0;
+
+  for (i = 0; i < 2; i++) {
+    recurrence = &transitions->recurrences[i];
+    if (recurrence->stdoff == recurrence->walloff)
+      std = recurrence;
+    else
+      dst = recurrence;
+  }
+  if (!std || !dst)
+    return 0;
+
+  if (!tzif_append_abbrev (out, std->tzname))
+    return 0;
+  tzif_append_time (out, -std->walloff);
+  if (!tzif_append_abbrev (out, dst->tzname))
+    return 0;
+  if (dst->walloff != std->walloff + 60 * 60)
+    tzif_append_time (out, -dst->walloff);
+
+  g_string_append_c (out, ',');
+  if (!tzif_append_rule (out, dst, &version))
+    return 0;
+  g_string_append_c (out, ',');
+  if (!tzif_append_rule (out, std, &version))
+    return 0;
+
+  return version;
+}
+
+
+/* This outputs the date and time of a recurring change, in the local time
+   before the change, as zic does. Days like "Sun>=9" don't fit the "Mm.w.d"
+   form, so they are given as the day before the weekday ("Sat>=8", the 2nd
+   Saturday) with 24 hours added to the time, which needs version 3 if the
+   time goes over 24 hours. */
+static gboolean
+tzif_append_rule                (GString        *out,
+                                 VzicRecurrence *recurrence,
+                                 char           *version)
+{
+  int time = recurrence->time_seconds, month = recurrence->month;
+  int day = recurrence->day_number, weekday = recurrence->day_weekday;
+  int week, days = 0;
+
+  switch (recurrence->time_code) {
+  case TIME_WALL:
+    break;
+  case TIME_STANDARD:
+    time += recurrence->prev_walloff - recurrence->prev_stdoff;
+    break;
+  case TIME_UNIVERSAL:
+    time += recurrence->prev_walloff;
+    break;
+  }
+
+  switch (recurrence->day_code) {
+  case DAY_SIMPLE:
+    /* "Jn" counts the days from 1st January, never counting 29th
+       February. */
+    if (month == 1 && day == 29)
+      return FALSE;
+    g_string_append_printf (out, "J%i",
+                            (int) (time_days_from_civil (2001, month, day)
+                                   - time_days_from_civil (2001, 0, 1) + 1));
+    week = 0;
+    break;
+
+  case DAY_LAST_WEEKDAY:
+    week = 5;
+    break;
+
+  case DAY_WEEKDAY_ON_OR_AFTER:
+    /* Week 5 is the last week, which isn't the same as days 29-31. */
+    if (day > 28)
+      return FALSE;
+    days = (day - 1) % 7;
+    week = (day - 1) / 7 + 1;
+    break;
+
+  case DAY_WEEKDAY_ON_OR_BEFORE:
+    /* 2000 is a leap year, so this is the last day of the month. */
+    if (day == time_days_in_month (2000, month)) {
+      week = 5;
+    } else {
+      days = day % 7;
+      week = day / 7;
+      if (week < 1)
+        return FALSE;
+    }
+    break;
+
+  default:
+    return FALSE;
+  }
+
+  if (week) {
+    weekday = (weekday - days + 7) % 7;
+    time += days * 24 * 60 * 60;
+    g_string_append_printf (out, "M%i.%i.%i", month + 1, week, weekday);
+  }
+
+  if (time != TZIF_DEFAULT_TIME) {
+    g_string_append_c (out, '/');
+    tzif_append_time (out, time);
+  }
+
+  if (time < 0 || time > 24 * 60 * 60)
+    *version = '3';
+
+  return TRUE;
+}
+
+
+/* The abbreviations must have at least 3 characters, and they are quoted
+   with <> if they aren't all letters, e.g. "<+0530>". */
+static gboolean
+tzif_append_abbrev              (GString        *out,
+                                 char           *tzname)
+{
+  gboolean alphabetic = TRUE;
+  char *p;
+
+  if (!tzname || strlen (tzname) < 3)
+    return FALSE;
+
+  for (p = tzname; *p; p++) {
+    if (g_ascii_isalpha (*p))
+      continue;
+    if (!g_ascii_isdigit (*p) && *p != '+' && *p != '-')
+      return FALSE;
+    alphabetic = FALSE;
+  }
+
+  if (alphabetic)
+    g_string_append (out, tzname);
+  else
+    g_string_append_printf (out, "<%s>", tzname);
+
+  return TRUE;
+}
+
+
+/* This outputs a UTC offset or time of day as [-]hh[:mm[:ss]]. */
+static void
+tzif_append_time                (GString        *out,
+                                 int             seconds)
+{
+  if (seconds < 0) {
+    g_string_append_c (out, '-');
+    seconds = -seconds;
+  }
+
+  g_string_append_printf (out, "%i", seconds / 3600);
+  if (seconds % 3600)
+    g_string_append_printf (out, ":%02i", seconds / 60 % 60);
+  if (seconds % 60)
+    g_string_append_printf (out, ":%02i", seconds % 60);
+}
+
+
+/* The integers in TZif files are big-endian. */
+static void
+tzif_append_int32               (GString        *out,
+                                 gint32          value)
+{
+  guint32 v = value;
+  int i;
+
+  for (i = 3; i >= 0; i--)
+    g_string_append_c (out, (v >> (i * 8)) & 0xFF);
+}
+
+
+static void
+tzif_append_int64               (GString        *out,
+                                 gint64          value)
+{
+  tzif_append_int32 (out, (guint64) value >> 32);
+  tzif_append_int32 (out, (guint64) value & 0xFFFFFFFF);
+}
@@ -0,0 +1,205 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * This watches the Olson directory for files that are written or moved into
+ * it, e.g. by an editor or rsync. The changes are debounced: once a file has
+ * changed we wait until nothing has changed for WATCH_DEBOUNCE_MS, so a sync
+ * of several files, or a file written in several steps, is only reloaded
+ * once. Each changed file is then reloaded with the same function as the
+ * --serve RELOAD request, which only outputs the zones affected by the
+ * changes. Every output file is written to a temporary file and renamed, so
+ * programs reading the output never see a partly-written file.
+ *
+ * Files that aren't Olson files we convert, e.g. the temporary files of
+ * rsync or editors, are ignored. A file that can't be parsed leaves the
+ * output as it was, and is reloaded again when it is next changed. If the
+ * kernel's event queue overflows we don't know which files have changed, so
+ * we reload all of them.
+ *
+ * Changes to zone.tab aren't picked up, since every zone would have to be
+ * output again, so vzic has to be restarted after zone.tab is changed.
+ */
+
+#include <config.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "vzic.h"
+#include "vzic-watch.h"
+
+
+/* How long to wait after the last change before reloading the files. */
+#define WATCH_DEBOUNCE_MS       1000
+
+
+static void     read_watch_events               (int             fd,
+                                                 char           *olson_dir,
+                                                 char          **file_names,
+                                                 int             num_files,
+                                                 GHashTable     *changed_files);
+static void     reload_changed_files            (GHashTable     *changed_files,
+                                                 VzicReloadFunc  reload);
+
+
+void
+watch_olson_dir                 (char           *olson_dir,
+                                 char          **file_names,
+                                 int             num_files,
+                                 VzicReloadFunc  reload)
+{
+  GHashTable *changed_files;
+  struct pollfd pfd;
+  int fd, timeout, result;
+
+  fd = inotify_init1 (IN_CLOEXEC);
+  if (fd < 0) {
+    fprintf (stderr, "Couldn't initialize inotify (%s)\n", strerror (errno));
+    exit (1);
+  }
+
+  if (inotify_add_watch (fd, olson_dir,
+                         IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fprintf (stderr, "Couldn't watch directory: %s (%s)\n", olson_dir,
+             strerror (errno));
+    exit (1);
+  }
+
+  printf ("Watching %s\n", olson_dir);
+  fflush (stdout);
+
+  changed_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         NULL);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    /* Wait forever for the first change, then until the changes stop. */
+    timeout = g_hash_table_size (changed_files) ? WATCH_DEBOUNCE_MS : -1;
+
+    result = poll (&pfd, 1, timeout);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf (stderr, "Couldn't poll inotify (%s)\n", strerror (errno));
+      exit (1);
+    }
+
+    if (result > 0)
+      read_watch_events (fd, olson_dir, file_names, num_files,
+                         changed_files);
+    else
+      reload_changed_files (changed_files, reload);
+  }
+}
+
+
+/* This adds the files that have been written and closed, or moved into the
+   directory, to changed_files. If events have been lost it adds all the
+   Olson files that are in the directory. */
+static void
+read_watch_events               (int             fd,
+                                 char           *olson_dir,
+                                 char          **file_names,
+                                 int             num_files,
+                                 GHashTable     *changed_files)
+{
+  char buffer[4096]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t length;
+  char *p, *filename;
+  int i;
+
+  length = read (fd, buffer, sizeof (buffer));
+  if (length < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return;
+    fprintf (stderr, "Couldn't read inotify events (%s)\n", strerror (errno));
+    exit (1);
+  }
+
+  for (p = buffer; p < buffer + length;
+       p += sizeof (struct inotify_event) + event->len) {
+    event = (const struct inotify_event*) p;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      fprintf (stderr, "Warning: Lost inotify events, reloading all files\n");
+      for (i = 0; i < num_files; i++) {
+        filename = g_strdup_printf ("%s/%s", olson_dir, file_names[i]);
+        if (access (filename, F_OK) == 0)
+          g_hash_table_add (changed_files, g_strdup (file_names[i]));
+        g_free (filename);
+      }
+      continue;
+    }
+
+    if (!event->len || (event->mask & IN_ISDIR))
+      continue;
+
+    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+      g_hash_table_add (changed_files, g_strdup (event->name));
+  }
+}
+
+
+/* The files are reloaded in alphabetical order, so the output is always the
+   same. Each reload takes the current data of all the other files into
+   account, so the order doesn't change the final output. */
+static void
+reload_changed_files            (GHashTable     *changed_files,
+                                 VzicReloadFunc  reload)
+{
+  GList *file_names, *elem;
+  int num_zones;
+
+  file_names = g_hash_table_get_keys (changed_files);
+  file_names = g_list_sort (file_names, (GCompareFunc) strcmp);
+
+  for (elem = file_names; elem; elem = elem->next) {
+    num_zones = reload (elem->data, NULL, 0);
+    if (num_zones >= 0) {
+      printf ("Reloaded %s: %i zones output\n", (char*) elem->data, num_zones);
+      fflush (stdout);
+    } else if (num_zones == -2) {
+      /* The file may be half-edited, so we wait for it to change again. */
+      fprintf (stderr, "Keeping the old data of %s until it is fixed\n",
+               (char*) elem->data);
+    }
+  }
+
+  g_list_free (file_names);
+  g_hash_table_remove_all (changed_files);
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
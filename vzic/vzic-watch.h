@@ -0,0 +1,44 @@
+/*
+ * Vzic - a program to convert Olson timezone database files into VZTIMEZONE
+ * files compatible with the iCalendar specification (RFC2445).
+ *
+ * Copyright (C) 2000-2001 Ximian, Inc.
+ * Copyright (C) 2003 Damon Chaplin.
+ *
+ * Author: Damon Chaplin <damon@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The --watch mode. It watches the Olson directory with inotify and reloads
+ * the Olson files when they are changed. See vzic-watch.c.
+ */
+
+#ifndef _VZIC_WATCH_H_
+#define _VZIC_WATCH_H_
+
+#include <glib.h>
+
+#include "vzic-serve.h"
+
+/* This watches the directory until vzic is killed, calling reload for each
+   of the num_files file_names that has been changed. */
+void            watch_olson_dir                 (char           *olson_dir,
+                                                 char          **file_names,
+                                                 int             num_files,
+                                                 VzicReloadFunc  reload);
+
+#endif /* _VZIC_WATCH_H_ */
@@ -22,14 +22,24 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "vzic.h"
 #include "vzic-parse.h"
 #include "vzic-dump.h"
 #include "vzic-output.h"
+#include "vzic-bundle.h"
+#include "vzic-index.h"
+#include "vzic-cache.h"
+#include "vzic-serve.h"
+#include "vzic-watch.h"
+#include "vzic-time.h"
 
 
 /*
@@ -43,6 +53,10 @@ gboolean VzicPureOutput                 = FALSE;
 gboolean VzicDumpTzDataArtifacts        = FALSE;
 gboolean VzicDumpOutput                 = FALSE;
 gboolean VzicDumpChanges                = FALSE;
+gboolean VzicOutputTables               = FALSE;
+char*    VzicBundleFile                 = NULL;
+char*    VzicTzifDir                    = NULL;
+char*    VzicZoneIndexFile              = NULL;
 gboolean VzicDumpZoneNamesAndCoords     = TRUE;
 gboolean VzicDumpZoneTranslatableStrings= FALSE;
 gboolean VzicNoRRules                   = FALSE;
@@ -50,15 +64,162 @@ gboolean VzicNoRDates                   = FALSE;
 char*    VzicOutputDir                  = "zoneinfo";
 char*    VzicUrlPrefix                  = NULL;
 char*    VzicOlsonDir                   = OLSON_DIR;
+char*    VzicCacheDir                   = NULL;
+char*    VzicServeSocket                = NULL;
+gboolean VzicWatch                      = FALSE;
+gboolean VzicFullZonesTab               = FALSE;
+int      VzicJobs                       = 1;
+gint64   VzicTimestamp                  = 0;
+gboolean VzicReproducible               = FALSE;
+VzicLinkAliasMode VzicLinkAliases       = LINK_ALIASES_COPY;
+VzicFlavor* VzicFlavors                 = NULL;
+int      VzicNumFlavors                 = 0;
 
 GList*   VzicTimeZoneNames              = NULL;
 
-static void     convert_olson_file              (char           *olson_file,
+
+/* The interned strings. See intern_string(). */
+static GStringChunk *InternedStrings    = NULL;
+G_LOCK_DEFINE_STATIC (interned_strings);
+
+/* The --zone glob patterns and the compiled --zone-regex patterns, or NULL
+   if none were given. See zone_name_is_selected(). */
+static GPtrArray *ZonePatterns          = NULL;
+static GPtrArray *ZoneRegexes           = NULL;
+
+
+/*
+ * The Olson files we convert, in the order they are output.
+ */
+static char *OlsonFileNames[] = {
+  /* These are backwards-compatibility for zones in other files.
+     This file MUST be processed first.
+     The links will be output when the actual zone is processed. */
+  "backward",
+
+  /* The Olson timezone files. */
+  "africa",
+  "antarctica",
+  "asia",
+  "australasia",
+  "europe",
+  "northamerica",
+  "southamerica",
+
+  /* These are backwards-compatibility and weird stuff. */
+  "etcetera",
+#if 0
+  "leapseconds",
+  "pacificnew",
+#endif
+
+  /* This doesn't really do anything and it messes up vzic-dump.pl so we
+     don't bother. */
+#if 0
+  "factory",
+#endif
+
+  /* This is old System V stuff. It uses 'min' as a Rule FROM value, which
+     we treat as the year before the first year used in any of its Rules.
+     It was removed in the 2020b release, so it is optional. */
+  "systemv",
+};
+
+
+/*
+ * The Olson files which are skipped if they aren't in the Olson directory,
+ * since they aren't in every release.
+ */
+static char *OptionalOlsonFileNames[] = {
+  "systemv",
+};
+
+
+/* This holds the data parsed from one Olson file. The files can be parsed in
+   any order, by several threads, but they are always merged and output in
+   the order of OlsonFileNames. */
+typedef struct _VzicOlsonFile VzicOlsonFile;
+struct _VzicOlsonFile
+{
+  char         *name;
+
+  GArray       *zone_data;
+  GHashTable   *rule_data;
+
+  /* The Link lines from this file only. These are merged into the shared
+     link data just before the file is output, so each zone gets the same
+     links as if the files were parsed one after the other. */
+  GHashTable   *link_data;
+
+  int           max_until_year;
+
+  /* With --serve, the hash of each set of Rules, and the names of the zones
+     that use each set of Rules, so we can find the zones affected when the
+     file is changed. See index_olson_file(). */
+  GHashTable   *rule_hashes;
+  GHashTable   *rule_zones;
+
+  /* TRUE once the file has been parsed. Protected by ParsedMutex. */
+  gboolean      parsed;
+};
+
+
+/* This is shared by the threads parsing the Olson files. */
+typedef struct _VzicParseQueue VzicParseQueue;
+struct _VzicParseQueue
+{
+  VzicOlsonFile *files;
+  int            num_files;
+
+  /* The index of the next file to be parsed. */
+  volatile gint  next_file;
+};
+
+static GMutex   ParsedMutex;
+static GCond    ParsedCond;
+
+/* With --serve or --watch, all the Olson files and the zone.tab data are
+   kept while the daemon is running. */
+static VzicOlsonFile *ServedFiles       = NULL;
+static int      NumServedFiles          = 0;
+static GHashTable *ServedZonesHash      = NULL;
+
+
+static void     parse_olson_file_data           (VzicOlsonFile  *file);
+static gboolean read_olson_file                 (VzicOlsonFile  *file,
+                                                 char           *filename);
+static gboolean olson_file_is_optional          (char           *name);
+static gpointer parse_olson_files_thread        (gpointer        data);
+static void     merge_link_data                 (GHashTable     *link_data,
+                                                 GHashTable     *file_link_data);
+static void     convert_olson_file              (VzicOlsonFile  *file,
                                                  GHashTable     *zones_hash,
                                                  GHashTable     *link_data);
+static void     dump_olson_file                 (VzicOlsonFile  *file);
+static void     output_zone_names               (GHashTable     *zones_hash);
+
+static void     index_olson_file                (VzicOlsonFile  *file);
+static int      reload_olson_file               (char           *file_name,
+                                                 const char     *contents,
+                                                 gsize           length);
+static GHashTable* find_affected_zones          (int             file_index,
+                                                 VzicOlsonFile  *old_file);
+static void     add_link_affected_zone          (GHashTable     *affected,
+                                                 GHashTable     *zone_files,
+                                                 int             file_index,
+                                                 char           *zone_name);
+static gboolean zone_lines_equal                (ZoneData       *zone1,
+                                                 ZoneData       *zone2);
+static gboolean links_equal                     (GList          *links1,
+                                                 GList          *links2);
+
+static void     set_timestamp                   (void);
+static gint64   get_olson_release_time          (void);
+static char*    get_olson_version               (void);
 
 static void     usage                           (void);
 
+static void     free_olson_file_data            (VzicOlsonFile  *file);
 static void     free_zone_data                  (GArray         *zone_data);
 static void     free_rule_array                 (gpointer        key,
                                                  gpointer        value,
@@ -72,10 +233,19 @@ int
 main                            (int             argc,
                                  char           *argv[])
 {
-  int i;
+  int i, num_files, num_threads;
   char directory[PATHNAME_BUFFER_SIZE];
   char filename[PATHNAME_BUFFER_SIZE];
   GHashTable *zones_hash, *link_data;
+  VzicOlsonFile *files;
+  VzicParseQueue queue;
+  GThread **threads = NULL;
+  GArray *flavors;
+  VzicFlavor flavor;
+  GRegex *regex;
+  GError *error = NULL;
+
+  flavors = g_array_new (FALSE, FALSE, sizeof (VzicFlavor));
 
   /*
    * Command-Line Option Parsing.
@@ -110,6 +280,132 @@ main                            (int             argc,
       VzicOlsonDir = argv[++i];
     }
 
+    /* --cache-dir: Keep a copy of each VTIMEZONE file in this directory, and
+       reuse it the next time if the zone's data hasn't changed. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--cache-dir")) {
+      VzicCacheDir = argv[++i];
+    }
+
+    /* --zone: Only output the zones whose name, or the name of one of their
+       Link aliases, matches the glob pattern, e.g. 'Europe/Lon*'. It can be
+       used several times. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--zone")) {
+      if (!ZonePatterns)
+        ZonePatterns = g_ptr_array_new ();
+      g_ptr_array_add (ZonePatterns, argv[++i]);
+    }
+
+    /* --zone-regex: The same as --zone, with a regular expression. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--zone-regex")) {
+      regex = g_regex_new (argv[++i], 0, 0, &error);
+      if (!regex) {
+        fprintf (stderr, "Invalid regular expression: %s (%s)\n", argv[i],
+                 error->message);
+        exit (1);
+      }
+      if (!ZoneRegexes)
+        ZoneRegexes = g_ptr_array_new ();
+      g_ptr_array_add (ZoneRegexes, regex);
+    }
+
+    /* --full-zones-tab: List all the zones in zones.tab, even if --zone is
+       used to only output some of them. */
+    else if (!strcmp (argv[i], "--full-zones-tab"))
+      VzicFullZonesTab = TRUE;
+
+    /* --serve: After outputting all the zones, listen on this Unix socket
+       for requests to reload a changed Olson file, and output the zones
+       affected by the changes. See vzic-serve.c. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--serve")) {
+      VzicServeSocket = argv[++i];
+    }
+
+    /* --watch: After outputting all the zones, watch the Olson directory
+       and output the zones affected by any changes to the files. See
+       vzic-watch.c. It needs inotify, so it is only built on Linux. */
+    else if (!strcmp (argv[i], "--watch")) {
+#ifdef HAVE_SYS_INOTIFY_H
+      VzicWatch = TRUE;
+#else
+      fprintf (stderr, "--watch isn't supported on this system\n");
+      exit (1);
+#endif
+    }
+
+    /* --jobs: Output the VTIMEZONE files using this many threads. 0 means
+       use one thread for each processor. The default is 1. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--jobs")) {
+      VzicJobs = atoi (argv[++i]);
+      if (VzicJobs < 0)
+        usage ();
+      if (VzicJobs == 0)
+        VzicJobs = g_get_num_processors ();
+    }
+
+    /* --link-aliases: Output the Link aliases as hard or symbolic links to
+       the zone's file, rather than a copy with the alias's TZID. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--link-aliases")) {
+      i++;
+      if (!strcmp (argv[i], "hard"))
+        VzicLinkAliases = LINK_ALIASES_HARD;
+      else if (!strcmp (argv[i], "symbolic"))
+        VzicLinkAliases = LINK_ALIASES_SYMBOLIC;
+      else
+        usage ();
+    }
+
+    /* --tables: Also output a binary table of the transitions of each zone
+       into the tables directory, for fast lookups with libcyrus-tz. See
+       vzic-table.c. */
+    else if (!strcmp (argv[i], "--tables"))
+      VzicOutputTables = TRUE;
+
+    /* --bundle: Also output the tables and the VTIMEZONEs of all the zones
+       into this file, for libcyrus-tz to map in one go. See
+       vzic-bundle.c. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--bundle")) {
+      VzicBundleFile = argv[++i];
+    }
+
+    /* --tzif-dir: Also output a TZif file for each zone into this
+       directory, like zic does. See vzic-tzif.c. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--tzif-dir")) {
+      VzicTzifDir = argv[++i];
+    }
+
+    /* --zone-index: Also output a perfect hash of the zone and alias names
+       into this file, mapping each to a zone id. See vzic-index.c. */
+    else if (argc > i + 1 && !strcmp (argv[i], "--zone-index")) {
+      VzicZoneIndexFile = argv[++i];
+    }
+
+    /* --reproducible: Use the release date of the Olson files for the
+       LAST-MODIFIED properties and the %D in the TZID prefix, rather than
+       the current time, so the output is the same each time. */
+    else if (!strcmp (argv[i], "--reproducible"))
+      VzicReproducible = TRUE;
+
+    /* --flavor: Also output another flavor of VTIMEZONEs into the given
+       directory, without parsing the Olson files again. The flavor is
+       'pure', 'outlook' (the default output) or 'artifacts' (the pure output
+       with the --artifacts data). */
+    else if (argc > i + 2 && !strcmp (argv[i], "--flavor")) {
+      i++;
+      if (!strcmp (argv[i], "pure")) {
+        flavor.pure_output = TRUE;
+        flavor.dump_tzdata_artifacts = FALSE;
+      } else if (!strcmp (argv[i], "outlook")) {
+        flavor.pure_output = FALSE;
+        flavor.dump_tzdata_artifacts = FALSE;
+      } else if (!strcmp (argv[i], "artifacts")) {
+        flavor.pure_output = TRUE;
+        flavor.dump_tzdata_artifacts = TRUE;
+      } else
+        usage ();
+      flavor.output_dir = argv[++i];
+      g_array_append_val (flavors, flavor);
+    }
+
     /*
      * Debugging Options.
      */
@@ -142,10 +438,33 @@ main                            (int             argc,
       usage ();
   }
 
+  if (VzicServeSocket && VzicWatch) {
+    fprintf (stderr, "--serve and --watch can't be used together\n");
+    exit (1);
+  }
+
+  set_timestamp ();
+
+  /* The main output goes first. */
+  flavor.output_dir = VzicOutputDir;
+  flavor.pure_output = VzicPureOutput;
+  flavor.dump_tzdata_artifacts = VzicDumpTzDataArtifacts;
+  g_array_prepend_val (flavors, flavor);
+
+  VzicNumFlavors = flavors->len;
+  VzicFlavors = (VzicFlavor*) g_array_free (flavors, FALSE);
+
   /*
    * Create any necessary directories.
    */
-  ensure_directory_exists (VzicOutputDir);
+  for (i = 0; i < VzicNumFlavors; i++)
+    ensure_directory_exists (VzicFlavors[i].output_dir);
+
+  if (VzicCacheDir)
+    ensure_directory_exists (VzicCacheDir);
+
+  if (VzicTzifDir)
+    ensure_directory_exists (VzicTzifDir);
 
   if (VzicDumpOutput) {
     /* Create the directories for the dump output, if they don't exist. */
@@ -156,182 +475,758 @@ main                            (int             argc,
   }
 
   if (VzicDumpChanges) {
-    /* Create the directory for the changes output, if it doesn't exist. */
-    sprintf (directory, "%s/ChangesVzic", VzicOutputDir);
-    ensure_directory_exists (directory);
+    /* Create the directories for the changes output, if they don't exist. */
+    for (i = 0; i < VzicNumFlavors; i++) {
+      sprintf (directory, "%s/ChangesVzic", VzicFlavors[i].output_dir);
+      ensure_directory_exists (directory);
+    }
   }
 
+  InternedStrings = g_string_chunk_new (16 * 1024);
+
   sprintf (filename, "%s/zone.tab", VzicOlsonDir);
   zones_hash = parse_zone_tab (filename);
 
-  link_data = g_hash_table_new (g_str_hash, g_str_equal);
+  link_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  num_files = G_N_ELEMENTS (OlsonFileNames);
+  files = g_new0 (VzicOlsonFile, num_files);
+  for (i = 0; i < num_files; i++)
+    files[i].name = OlsonFileNames[i];
 
   /*
-   * These are backwards-compatibility for zones in other files.
-   * This file MUST be processed first.
-   * The links will be output when the actual zone is processed.
+   * With --jobs we parse all the Olson files in the background, while the
+   * files already parsed are being output.
    */
-  convert_olson_file ("backward", zones_hash, link_data);
+  num_threads = MIN (VzicJobs, num_files);
+  if (num_threads > 1) {
+    queue.files = files;
+    queue.num_files = num_files;
+    queue.next_file = 0;
+
+    threads = g_new (GThread*, num_threads);
+    for (i = 0; i < num_threads; i++)
+      threads[i] = g_thread_new ("vzic-parse", parse_olson_files_thread,
+                                 &queue);
+  }
 
   /*
-   * Convert the Olson timezone files.
+   * Convert the Olson timezone files, in order.
    */
-  convert_olson_file ("africa", zones_hash, link_data);
-  convert_olson_file ("antarctica", zones_hash, link_data);
-  convert_olson_file ("asia", zones_hash, link_data);
-  convert_olson_file ("australasia", zones_hash, link_data);
-  convert_olson_file ("europe", zones_hash, link_data);
-  convert_olson_file ("northamerica", zones_hash, link_data);
-  convert_olson_file ("southamerica", zones_hash, link_data);
-
-  /* These are backwards-compatibility and weird stuff. */
-  convert_olson_file ("etcetera", zones_hash, link_data);
-#if 0
-  convert_olson_file ("leapseconds", zones_hash, link_data);
-  convert_olson_file ("pacificnew", zones_hash, link_data);
-#endif
+  for (i = 0; i < num_files; i++) {
+    if (threads) {
+      g_mutex_lock (&ParsedMutex);
+      while (!files[i].parsed)
+        g_cond_wait (&ParsedCond, &ParsedMutex);
+      g_mutex_unlock (&ParsedMutex);
+    } else {
+      parse_olson_file_data (&files[i]);
+    }
 
-  /* This doesn't really do anything and it messes up vzic-dump.pl so we
-     don't bother. */
-#if 0
-  convert_olson_file ("factory", zones_hash, link_data);
-#endif
+    convert_olson_file (&files[i], zones_hash, link_data);
+  }
 
-  /* This is old System V stuff, which we don't currently support since it
-     uses 'min' as a Rule FROM value which messes up our algorithm, making
-     it too slow and use too much memory. */
-#if 0
-  convert_olson_file ("systemv", zones_hash, link_data);
-#endif
+  if (threads) {
+    for (i = 0; i < num_threads; i++)
+      g_thread_join (threads[i]);
+    g_free (threads);
+  }
 
   g_hash_table_foreach (link_data, free_link_data, NULL);
   g_hash_table_destroy (link_data);
 
-  /* Output the timezone names and coordinates in a zone.tab file, and
-     the translatable strings to feed to gettext. */
-  if (VzicDumpZoneNamesAndCoords) {
-    dump_time_zone_names (VzicTimeZoneNames, VzicOutputDir, zones_hash);
+  output_zone_names (zones_hash);
+
+  if (VzicBundleFile)
+    bundle_save (VzicBundleFile);
+
+  if (VzicZoneIndexFile)
+    index_save (VzicZoneIndexFile);
+
+  if (VzicCacheDir)
+    cache_prune ();
+
+  if (VzicServeSocket) {
+    ServedFiles = files;
+    NumServedFiles = num_files;
+    ServedZonesHash = zones_hash;
+
+    serve_requests (VzicServeSocket, reload_olson_file);
+
+    for (i = 0; i < num_files; i++)
+      free_olson_file_data (&files[i]);
   }
+#ifdef HAVE_SYS_INOTIFY_H
+  else if (VzicWatch) {
+    ServedFiles = files;
+    NumServedFiles = num_files;
+    ServedZonesHash = zones_hash;
+
+    /* This never returns. */
+    watch_olson_dir (VzicOlsonDir, OlsonFileNames,
+                     G_N_ELEMENTS (OlsonFileNames), reload_olson_file);
+  }
+#endif
+  g_free (files);
+
+  if (ZonePatterns)
+    g_ptr_array_free (ZonePatterns, TRUE);
+  if (ZoneRegexes) {
+    for (i = 0; i < ZoneRegexes->len; i++)
+      g_regex_unref (g_ptr_array_index (ZoneRegexes, i));
+    g_ptr_array_free (ZoneRegexes, TRUE);
+  }
+
+  bundle_free ();
+  index_free ();
+  g_list_free (VzicTimeZoneNames);
+  g_string_chunk_free (InternedStrings);
+  g_free (VzicFlavors);
 
   return 0;
 }
 
 
-static void
-convert_olson_file              (char           *olson_file,
-                                 GHashTable     *zones_hash,
-                                 GHashTable     *link_data)
+/* This returns the interned copy of the string, adding it if it isn't
+   already there. It is called by all the parsing and output threads. */
+char*
+intern_string                   (const char     *string)
+{
+  char *result;
+
+  if (!string)
+    return NULL;
+
+  G_LOCK (interned_strings);
+  result = g_string_chunk_insert_const (InternedStrings, string);
+  G_UNLOCK (interned_strings);
+
+  return result;
+}
+
+
+/* This returns TRUE if the zone or Link alias name matches one of the
+   --zone or --zone-regex patterns, or if there aren't any. */
+gboolean
+zone_name_is_selected           (const char     *zone_name)
 {
+  int i;
+
+  if (!ZonePatterns && !ZoneRegexes)
+    return TRUE;
 
+  for (i = 0; ZonePatterns && i < ZonePatterns->len; i++) {
+    if (g_pattern_match_simple (g_ptr_array_index (ZonePatterns, i),
+                                zone_name))
+      return TRUE;
+  }
+
+  for (i = 0; ZoneRegexes && i < ZoneRegexes->len; i++) {
+    if (g_regex_match (g_ptr_array_index (ZoneRegexes, i), zone_name, 0,
+                       NULL))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/* This parses one Olson file into its own tables. It doesn't touch any
+   shared data, so it can be run for several files at once. */
+static void
+parse_olson_file_data           (VzicOlsonFile  *file)
+{
   char input_filename[PATHNAME_BUFFER_SIZE];
-  GArray *zone_data;
-  GHashTable *rule_data;
-  char dump_filename[PATHNAME_BUFFER_SIZE];
-  ZoneData *zone;
-  int i, max_until_year;
 
-  sprintf (input_filename, "%s/%s", VzicOlsonDir, olson_file);
+  sprintf (input_filename, "%s/%s", VzicOlsonDir, file->name);
+
+  /* A missing optional file is treated like an empty one. */
+  if (olson_file_is_optional (file->name)
+      && access (input_filename, F_OK) != 0) {
+    fprintf (stderr, "Skipping %s, since it isn't in %s\n", file->name,
+             VzicOlsonDir);
+    file->zone_data = g_array_new (FALSE, FALSE, sizeof (ZoneData));
+    file->rule_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+    file->link_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+    file->max_until_year = 0;
+    return;
+  }
 
-  parse_olson_file (input_filename, &zone_data, &rule_data, &link_data,
-                    &max_until_year);
+  if (!read_olson_file (file, input_filename))
+    exit (1);
+}
 
-  if (VzicDumpOutput) {
-    sprintf (dump_filename, "%s/ZonesVzic/%s", VzicOutputDir, olson_file);
-    dump_zone_data (zone_data, dump_filename);
 
-    sprintf (dump_filename, "%s/RulesVzic/%s", VzicOutputDir, olson_file);
-    dump_rule_data (rule_data, dump_filename);
+static gboolean
+olson_file_is_optional          (char           *name)
+{
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (OptionalOlsonFileNames); i++) {
+    if (!strcmp (name, OptionalOlsonFileNames[i]))
+      return TRUE;
   }
 
-  output_vtimezone_files (VzicOutputDir, zone_data, rule_data, link_data,
-                          zones_hash, max_until_year);
+  return FALSE;
+}
+
 
-  free_zone_data (zone_data);
-  g_hash_table_foreach (rule_data, free_rule_array, NULL);
-  g_hash_table_destroy (rule_data);
+/* This parses filename into the file's tables. If it returns FALSE the
+   tables still have to be freed. */
+static gboolean
+read_olson_file                 (VzicOlsonFile  *file,
+                                 char           *filename)
+{
+  file->link_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  return parse_olson_file (filename, &file->zone_data, &file->rule_data,
+                           &file->link_data, &file->max_until_year);
 }
 
 
+/* This parses files from the queue until there are none left, signalling
+   the main thread as each one is finished. */
+static gpointer
+parse_olson_files_thread        (gpointer        data)
+{
+  VzicParseQueue *queue = data;
+  VzicOlsonFile *file;
+  gint i;
+
+  for (;;) {
+    i = g_atomic_int_add (&queue->next_file, 1);
+    if (i >= queue->num_files)
+      break;
+
+    file = &queue->files[i];
+    parse_olson_file_data (file);
+
+    g_mutex_lock (&ParsedMutex);
+    file->parsed = TRUE;
+    g_cond_broadcast (&ParsedCond);
+    g_mutex_unlock (&ParsedMutex);
+  }
+
+  return NULL;
+}
+
+
+/* This copies the links from one file into the shared link data. The lists
+   are built with g_list_prepend(), so the file's links go in front of any
+   links to the same zone from earlier files, just as they would if the file
+   had been parsed straight into the shared link data. The file keeps its
+   own links, so --serve can merge them again after reloading a file. */
 static void
-usage                           (void)
+merge_link_data                 (GHashTable     *link_data,
+                                 GHashTable     *file_link_data)
 {
-  fprintf (stderr, "Usage: cyr_vzic [--dump] [--dump-changes] [--no-rrules] [--no-rdates] [--pure] [--output-dir <directory>] [--url-prefix <url>] [--olson-dir <directory>]\n");
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, file_link_data);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_hash_table_insert (link_data, key,
+                         g_list_concat (g_list_copy (value),
+                                        g_hash_table_lookup (link_data, key)));
+}
 
-  exit (1);
+
+static void
+convert_olson_file              (VzicOlsonFile  *file,
+                                 GHashTable     *zones_hash,
+                                 GHashTable     *link_data)
+{
+  merge_link_data (link_data, file->link_data);
+
+  if (VzicDumpOutput)
+    dump_olson_file (file);
+
+  output_vtimezone_files (file->zone_data, file->rule_data, link_data,
+                          zones_hash, file->max_until_year, NULL);
+
+  /* The daemon keeps the data, to compare with the file when it changes. */
+  if (VzicServeSocket || VzicWatch)
+    index_olson_file (file);
+  else
+    free_olson_file_data (file);
 }
 
 
+static void
+dump_olson_file                 (VzicOlsonFile  *file)
+{
+  char dump_filename[PATHNAME_BUFFER_SIZE];
 
+  sprintf (dump_filename, "%s/ZonesVzic/%s", VzicOutputDir, file->name);
+  dump_zone_data (file->zone_data, dump_filename);
 
-/*
- * Functions to free the data structures.
- */
+  sprintf (dump_filename, "%s/RulesVzic/%s", VzicOutputDir, file->name);
+  dump_rule_data (file->rule_data, dump_filename);
+}
 
+
+/* Output the timezone names and coordinates in a zone.tab file, and the
+   translatable strings to feed to gettext. */
 static void
-free_zone_data                  (GArray         *zone_data)
+output_zone_names               (GHashTable     *zones_hash)
+{
+  int i;
+
+  if (!VzicDumpZoneNamesAndCoords)
+    return;
+
+  /* dump_time_zone_names() sorts the list, so we sort it first to keep
+     hold of the start of the list. */
+  VzicTimeZoneNames = g_list_sort (VzicTimeZoneNames, (GCompareFunc) strcmp);
+  for (i = 0; i < VzicNumFlavors; i++)
+    dump_time_zone_names (VzicTimeZoneNames, VzicFlavors[i].output_dir,
+                          zones_hash);
+}
+
+
+/* This builds the dependency graph of a file for --serve, i.e. the zones
+   that use each set of Rules, and hashes the Rules so we can tell which
+   sets have changed when the file is reloaded. */
+static void
+index_olson_file                (VzicOlsonFile  *file)
 {
   ZoneData *zone;
   ZoneLineData *zone_line;
+  GList *zones;
   int i, j;
 
-  for (i = 0; i < zone_data->len; i++) {
-    zone = &g_array_index (zone_data, ZoneData, i);
+  file->rule_hashes = cache_hash_rule_data (file->rule_data,
+                                            file->max_until_year);
 
-    g_free (zone->zone_name);
+  file->rule_zones = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < file->zone_data->len; i++) {
+    zone = &g_array_index (file->zone_data, ZoneData, i);
 
     for (j = 0; j < zone->zone_line_data->len; j++) {
       zone_line = &g_array_index (zone->zone_line_data, ZoneLineData, j);
+      if (!zone_line->rules)
+        continue;
 
-      g_free (zone_line->rules);
-      g_free (zone_line->format);
+      zones = g_hash_table_lookup (file->rule_zones, zone_line->rules);
+      if (zones && zones->data == zone->zone_name)
+        continue;
+
+      g_hash_table_insert (file->rule_zones, zone_line->rules,
+                           g_list_prepend (zones, zone->zone_name));
     }
+  }
+}
 
-    g_array_free (zone->zone_line_data, TRUE);
+
+/* This is called by the --serve and --watch daemons when an Olson file has
+   changed. It parses the file again and outputs the zones affected by the
+   changes. The other files are still gone through in order, to merge the
+   links in the same way as the first time and to list all the zones in
+   zones.tab. If the file can't be parsed we keep the data of the old one,
+   and with contents the Olson file isn't replaced. */
+static int
+reload_olson_file               (char           *file_name,
+                                 const char     *contents,
+                                 gsize           length)
+{
+  char filename[PATHNAME_BUFFER_SIZE], *tmp_filename = NULL;
+  VzicOlsonFile *file, old_file, new_file;
+  GHashTable *affected, *link_data;
+  int i, file_index = -1, num_zones;
+
+  for (i = 0; i < NumServedFiles; i++) {
+    if (!strcmp (ServedFiles[i].name, file_name))
+      file_index = i;
+  }
+  if (file_index < 0)
+    return -1;
+
+  file = &ServedFiles[file_index];
+  sprintf (filename, "%s/%s", VzicOlsonDir, file->name);
+
+  /* New contents are parsed from a temporary file, which only replaces the
+     Olson file once we know it is valid. */
+  if (contents)
+    tmp_filename = write_temp_file (filename, contents, length);
+
+  memset (&new_file, 0, sizeof (new_file));
+  new_file.name = file->name;
+  if (!read_olson_file (&new_file, tmp_filename ? tmp_filename : filename)) {
+    free_olson_file_data (&new_file);
+    if (tmp_filename) {
+      unlink (tmp_filename);
+      g_free (tmp_filename);
+    }
+    return -2;
   }
 
-  g_array_free (zone_data, TRUE);
+  if (tmp_filename) {
+    if (rename (tmp_filename, filename) != 0) {
+      fprintf (stderr, "Couldn't rename file: %s\n", tmp_filename);
+      exit (1);
+    }
+    g_free (tmp_filename);
+  }
+
+  /* The LAST-MODIFIED of the zones we output again is the current time. */
+  set_timestamp ();
+
+  old_file = *file;
+  *file = new_file;
+  index_olson_file (file);
+
+  affected = find_affected_zones (file_index, &old_file);
+  free_olson_file_data (&old_file);
+
+  if (VzicDumpOutput)
+    dump_olson_file (file);
+
+  g_list_free (VzicTimeZoneNames);
+  VzicTimeZoneNames = NULL;
+
+  link_data = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < NumServedFiles; i++) {
+    file = &ServedFiles[i];
+    merge_link_data (link_data, file->link_data);
+    output_vtimezone_files (file->zone_data, file->rule_data, link_data,
+                            ServedZonesHash, file->max_until_year, affected);
+  }
+  g_hash_table_foreach (link_data, free_link_data, NULL);
+  g_hash_table_destroy (link_data);
+
+  output_zone_names (ServedZonesHash);
+
+  if (VzicBundleFile)
+    bundle_save (VzicBundleFile);
+
+  if (VzicZoneIndexFile)
+    index_save (VzicZoneIndexFile);
+
+  num_zones = g_hash_table_size (affected);
+  g_hash_table_destroy (affected);
+
+  return num_zones;
+}
+
+
+/* This returns the names of the zones affected by the changes to a file,
+   i.e. new zones, zones whose Zone lines or Rules have changed, and zones
+   whose Link aliases have changed. A Link only affects the zones in the same
+   or later files, since those are the files it has been merged into when
+   they are output. */
+static GHashTable*
+find_affected_zones             (int             file_index,
+                                 VzicOlsonFile  *old_file)
+{
+  VzicOlsonFile *file = &ServedFiles[file_index];
+  GHashTable *affected, *old_zones, *zone_files;
+  GHashTableIter iter;
+  gpointer key, value;
+  ZoneData *zone, *old_zone;
+  char *old_hash;
+  GList *elem;
+  int i, j;
+
+  affected = g_hash_table_new (g_str_hash, g_str_equal);
+
+  old_zones = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < old_file->zone_data->len; i++) {
+    old_zone = &g_array_index (old_file->zone_data, ZoneData, i);
+    g_hash_table_insert (old_zones, old_zone->zone_name, old_zone);
+  }
+
+  for (i = 0; i < file->zone_data->len; i++) {
+    zone = &g_array_index (file->zone_data, ZoneData, i);
+    old_zone = g_hash_table_lookup (old_zones, zone->zone_name);
+    if (!old_zone || !zone_lines_equal (zone, old_zone))
+      g_hash_table_add (affected, zone->zone_name);
+  }
+
+  g_hash_table_destroy (old_zones);
+
+  /* The Rules are only used by the zones in the same file. */
+  g_hash_table_iter_init (&iter, file->rule_hashes);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    old_hash = g_hash_table_lookup (old_file->rule_hashes, key);
+    if (old_hash && !strcmp (old_hash, value))
+      continue;
+
+    for (elem = g_hash_table_lookup (file->rule_zones, key); elem;
+         elem = elem->next)
+      g_hash_table_add (affected, elem->data);
+  }
+
+  /* This maps each zone name to the index of its file + 1. */
+  zone_files = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (i = 0; i < NumServedFiles; i++) {
+    for (j = 0; j < ServedFiles[i].zone_data->len; j++) {
+      zone = &g_array_index (ServedFiles[i].zone_data, ZoneData, j);
+      g_hash_table_insert (zone_files, zone->zone_name, GINT_TO_POINTER (i + 1));
+    }
+  }
+
+  g_hash_table_iter_init (&iter, file->link_data);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (!links_equal (value, g_hash_table_lookup (old_file->link_data, key)))
+      add_link_affected_zone (affected, zone_files, file_index, key);
+  }
+
+  g_hash_table_iter_init (&iter, old_file->link_data);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (!g_hash_table_contains (file->link_data, key))
+      add_link_affected_zone (affected, zone_files, file_index, key);
+  }
+
+  g_hash_table_destroy (zone_files);
+
+  return affected;
 }
 
 
 static void
-free_rule_array                 (gpointer        key,
-                                 gpointer        value,
-                                 gpointer        data)
+add_link_affected_zone          (GHashTable     *affected,
+                                 GHashTable     *zone_files,
+                                 int             file_index,
+                                 char           *zone_name)
+{
+  int zone_file;
+
+  zone_file = GPOINTER_TO_INT (g_hash_table_lookup (zone_files, zone_name));
+  if (zone_file > file_index)
+    g_hash_table_add (affected, zone_name);
+}
+
+
+/* The strings are interned, so we can compare them with '=='. */
+static gboolean
+zone_lines_equal                (ZoneData       *zone1,
+                                 ZoneData       *zone2)
 {
-  char *name = key;
-  GArray *rule_array = value;
-  RuleData *rule;
+  ZoneLineData *line1, *line2;
   int i;
 
-  for (i = 0; i < rule_array->len; i++) {
-    rule = &g_array_index (rule_array, RuleData, i);
+  if (zone1->zone_line_data->len != zone2->zone_line_data->len)
+    return FALSE;
+
+  for (i = 0; i < zone1->zone_line_data->len; i++) {
+    line1 = &g_array_index (zone1->zone_line_data, ZoneLineData, i);
+    line2 = &g_array_index (zone2->zone_line_data, ZoneLineData, i);
+
+    if (line1->stdoff_seconds != line2->stdoff_seconds
+        || line1->rules != line2->rules
+        || line1->save_seconds != line2->save_seconds
+        || line1->format != line2->format
+        || line1->until_set != line2->until_set)
+      return FALSE;
+
+    /* The UNTIL fields aren't set if there is no UNTIL time. */
+    if (line1->until_set
+        && (line1->until_year != line2->until_year
+            || line1->until_month != line2->until_month
+            || line1->until_day_code != line2->until_day_code
+            || line1->until_day_number != line2->until_day_number
+            || line1->until_day_weekday != line2->until_day_weekday
+            || line1->until_time_seconds != line2->until_time_seconds
+            || line1->until_time_code != line2->until_time_code))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static gboolean
+links_equal                     (GList          *links1,
+                                 GList          *links2)
+{
+  while (links1 && links2) {
+    if (links1->data != links2->data)
+      return FALSE;
+    links1 = links1->next;
+    links2 = links2->next;
+  }
+
+  return !links1 && !links2;
+}
+
 
-    if (!rule->is_shallow_copy) {
-      g_free (rule->type);
-      g_free (rule->letter_s);
+/* This sets VzicTimestamp. As in other build tools, SOURCE_DATE_EPOCH
+   overrides the current time, see https://reproducible-builds.org/. */
+static void
+set_timestamp                   (void)
+{
+  char *source_date_epoch, *end;
+
+  source_date_epoch = getenv ("SOURCE_DATE_EPOCH");
+  if (source_date_epoch && *source_date_epoch) {
+    VzicReproducible = TRUE;
+    VzicTimestamp = g_ascii_strtoll (source_date_epoch, &end, 10);
+    if (*end) {
+      fprintf (stderr, "Invalid SOURCE_DATE_EPOCH: %s\n", source_date_epoch);
+      exit (1);
     }
+  } else if (VzicReproducible) {
+    VzicTimestamp = get_olson_release_time ();
+  } else {
+    VzicTimestamp = time (NULL);
+  }
+}
+
+
+/* This returns the release time of the Olson files, which is on the line
+   for the version (from the 'version' file) in the NEWS file, e.g.
+   "Release 2017c - 2017-10-20 14:49:34 -0700". */
+static gint64
+get_olson_release_time          (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  char *version, *news, *prefix, *line, sign;
+  int year, month, day, hour, minute, second, offset_hours, offset_minutes;
+  int num_fields = 0, offset;
+
+  version = get_olson_version ();
+  if (!version) {
+    fprintf (stderr,
+             "Couldn't read file: %s/version (set SOURCE_DATE_EPOCH instead)\n",
+             VzicOlsonDir);
+    exit (1);
+  }
+
+  sprintf (filename, "%s/NEWS", VzicOlsonDir);
+  if (!g_file_get_contents (filename, &news, NULL, NULL)) {
+    fprintf (stderr, "Couldn't read file: %s (set SOURCE_DATE_EPOCH instead)\n",
+             filename);
+    exit (1);
   }
 
-  g_array_free (rule_array, TRUE);
+  prefix = g_strdup_printf ("Release %s - ", version);
+  for (line = news; line; line = strchr (line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (g_str_has_prefix (line, prefix)) {
+      num_fields = sscanf (line + strlen (prefix), "%d-%d-%d %d:%d:%d %c%2d%2d",
+                           &year, &month, &day, &hour, &minute, &second,
+                           &sign, &offset_hours, &offset_minutes);
+      break;
+    }
+  }
+
+  if (num_fields != 9 || (sign != '+' && sign != '-')) {
+    fprintf (stderr, "Couldn't find the release date of %s in: %s\n",
+             version, filename);
+    exit (1);
+  }
+
+  g_free (prefix);
+  g_free (news);
+  g_free (version);
+
+  offset = offset_hours * 3600 + offset_minutes * 60;
+  if (sign == '-')
+    offset = -offset;
+
+  return time_to_seconds (year, month - 1, day,
+                          hour * 3600 + minute * 60 + second) - offset;
+}
+
 
-  g_free (name);
+/* This returns the version of the Olson files, e.g. "2017c", from the
+   'version' file, or NULL if there isn't one. It should be freed with
+   g_free(). */
+static char*
+get_olson_version               (void)
+{
+  char filename[PATHNAME_BUFFER_SIZE];
+  char *version;
+
+  sprintf (filename, "%s/version", VzicOlsonDir);
+  if (!g_file_get_contents (filename, &version, NULL, NULL))
+    return NULL;
+
+  version[strcspn (version, " \t\r\n")] = '\0';
+
+  return version;
 }
 
 
 static void
-free_link_data                  (gpointer        key,
-                                 gpointer        value,
-                                 gpointer        data)
+usage                           (void)
 {
-  GList *link = data;
+  fprintf (stderr, "Usage: cyr_vzic [--dump] [--dump-changes] [--no-rrules] [--no-rdates] [--pure] [--output-dir <directory>] [--url-prefix <url>] [--olson-dir <directory>] [--cache-dir <directory>] [--jobs <n>] [--link-aliases hard|symbolic] [--flavor pure|outlook|artifacts <directory>] [--reproducible] [--zone <pattern>] [--zone-regex <regex>] [--full-zones-tab] [--serve <socket>] [--watch] [--tables] [--bundle <file>] [--tzif-dir <directory>] [--zone-index <file>]\n");
+
+  exit (1);
+}
+
 
-  g_free (key);
 
-  while (link) {
-    g_free (link->data);
-    link = link->next;
+
+/*
+ * Functions to free the data structures.
+ */
+
+/* This frees the data parsed from a file, and the --serve index. */
+static void
+free_olson_file_data            (VzicOlsonFile  *file)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  free_zone_data (file->zone_data);
+  file->zone_data = NULL;
+
+  g_hash_table_foreach (file->rule_data, free_rule_array, NULL);
+  g_hash_table_destroy (file->rule_data);
+  file->rule_data = NULL;
+
+  g_hash_table_foreach (file->link_data, free_link_data, NULL);
+  g_hash_table_destroy (file->link_data);
+  file->link_data = NULL;
+
+  if (file->rule_hashes) {
+    g_hash_table_destroy (file->rule_hashes);
+    file->rule_hashes = NULL;
   }
 
-  g_list_free (data);
+  if (file->rule_zones) {
+    g_hash_table_iter_init (&iter, file->rule_zones);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+      g_list_free (value);
+    g_hash_table_destroy (file->rule_zones);
+    file->rule_zones = NULL;
+  }
+}
+
+
+/* The strings are all interned, so we only free the arrays and lists. */
+static void
+free_zone_data                  (GArray         *zone_data)
+{
+  ZoneData *zone;
+  int i;
+
+  for (i = 0; i < zone_data->len; i++) {
+    zone = &g_array_index (zone_data, ZoneData, i);
+    g_array_free (zone->zone_line_data, TRUE);
+  }
+
+  g_array_free (zone_data, TRUE);
+}
+
+
+static void
+free_rule_array                 (gpointer        key,
+                                 gpointer        value,
+                                 gpointer        data)
+{
+  g_array_free (value, TRUE);
+}
+
+
+static void
+free_link_data                  (gpointer        key,
+                                 gpointer        value,
+                                 gpointer        data)
+{
+  g_list_free (value);
 }
 
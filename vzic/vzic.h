@@ -46,8 +46,90 @@ extern gboolean VzicNoRDates;
 extern char*    VzicUrlPrefix;
 extern char*    VzicOutputDir;
 
+/* With --tables, a binary table of the transitions of each zone is also
+   output, for libcyrus-tz. See vzic-table.c. */
+extern gboolean VzicOutputTables;
+
+/* If set, the transition tables and VTIMEZONEs of all the zones are also
+   output into this bundle file. See vzic-bundle.c. */
+extern char*    VzicBundleFile;
+
+/* If set, a TZif file is also output for each zone into this directory,
+   like the ones zic outputs. See vzic-tzif.c. */
+extern char*    VzicTzifDir;
+
+/* If set, a perfect hash of the names of all the zones and aliases is also
+   output into this file, mapping each name to a zone id. See
+   vzic-index.c. */
+extern char*    VzicZoneIndexFile;
+
+/* If set, the VTIMEZONE files are cached in this directory, and reused for
+   any zones that haven't changed. See vzic-cache.c. */
+extern char*    VzicCacheDir;
+
+/* With --full-zones-tab, the zones.tab file lists all the zones, even if
+   --zone is used to only output some of them. */
+extern gboolean VzicFullZonesTab;
+
+/* If set, vzic keeps running after outputting the zones, and listens on
+   this Unix socket for requests to reload changed Olson files. See
+   vzic-serve.c. */
+extern char*    VzicServeSocket;
+
+/* With --watch, vzic keeps running after outputting the zones, and reloads
+   the Olson files when they change. See vzic-watch.c. */
+extern gboolean VzicWatch;
+
+/* The number of threads to use when outputting the VTIMEZONE files. */
+extern int      VzicJobs;
+
+/* The time used for the LAST-MODIFIED properties and the %D in the TZID
+   prefix, in seconds since 1970. Normally it is the current time, but if
+   SOURCE_DATE_EPOCH is set or --reproducible is used VzicReproducible is
+   set, and it is SOURCE_DATE_EPOCH or the release date of the Olson files,
+   so the output only changes when the data does. */
+extern gint64   VzicTimestamp;
+extern gboolean VzicReproducible;
+
+/* How to output the Link aliases of a zone. By default each alias gets a
+   copy of the zone's VTIMEZONE file with its own TZID, but with
+   --link-aliases they can be hard or symbolic links to the zone's file. */
+typedef enum
+{
+  LINK_ALIASES_COPY,
+  LINK_ALIASES_HARD,
+  LINK_ALIASES_SYMBOLIC
+} VzicLinkAliasMode;
+
+extern VzicLinkAliasMode VzicLinkAliases;
+
+/* A flavor of VTIMEZONE output. The first flavor is set by the --output-dir,
+   --pure and --artifacts options, and each --flavor option adds another one,
+   which is output into its own directory from the same parsed data. */
+typedef struct _VzicFlavor VzicFlavor;
+struct _VzicFlavor
+{
+  char         *output_dir;
+  gboolean      pure_output;
+  gboolean      dump_tzdata_artifacts;
+};
+
+extern VzicFlavor* VzicFlavors;
+extern int      VzicNumFlavors;
+
 extern GList*   VzicTimeZoneNames;
 
+/* All the strings in the Zone, Rule and Link data, and the TZNAMEs we output,
+   are interned, so each distinct string is only stored once and they can be
+   compared with '=='. (So the rule data and link data hash tables use
+   g_direct_hash().) They are all freed together at the end, so the
+   interned strings must never be modified or freed. See vzic.c. */
+char*           intern_string                   (const char     *string);
+
+/* This returns TRUE if the zone or Link alias name matches one of the --zone
+   or --zone-regex patterns, or if none were given. See vzic.c. */
+gboolean        zone_name_is_selected           (const char     *zone_name);
+
 /* The minimum & maximum years we can use. */
 #define YEAR_MINIMUM    G_MININT
 #define YEAR_MAXIMUM    G_MAXINT
@@ -173,11 +255,6 @@ struct _RuleData
      name. If this is NULL then no variable part is used. (See the format field
      in the ZoneLineData struct above.) */
   char         *letter_s;
-
-
-  /* This is set to TRUE if this element is a shallow copy of another one,
-     in which case we don't free any of the fields. */
-  gboolean      is_shallow_copy;
 };
 
 